@@ -0,0 +1,54 @@
+/**
+
+  Runtime services call statistics collected by AptioMemoryFix RT shims.
+  Published as a configuration table when the driver is built with
+  APTIOFIX_RT_SHIMS_STATS, macOS shows its address in IODeviceTree
+  under /efi/configuration-table.
+
+**/
+
+#ifndef APTIOFIX_RT_STATS_H
+#define APTIOFIX_RT_STATS_H
+
+#define APTIOMEMORYFIX_RT_STATS_REVISION  2
+
+// APTIOMEMORYFIX_RT_STATS_GUID
+// 633238A3-9639-4125-9CF3-9576DB1DE791
+#define APTIOMEMORYFIX_RT_STATS_GUID  \
+  { 0x633238A3, 0x9639, 0x4125, { 0x9C, 0xF3, 0x95, 0x76, 0xDB, 0x1D, 0xE7, 0x91 } }
+
+// Service indices in APTIOMEMORYFIX_RT_STATS.Services
+#define APTIOMEMORYFIX_RT_GET_VARIABLE             0
+#define APTIOMEMORYFIX_RT_SET_VARIABLE             1
+#define APTIOMEMORYFIX_RT_GET_NEXT_VARIABLE_NAME   2
+#define APTIOMEMORYFIX_RT_GET_TIME                 3
+#define APTIOMEMORYFIX_RT_SET_TIME                 4
+#define APTIOMEMORYFIX_RT_GET_WAKEUP_TIME          5
+#define APTIOMEMORYFIX_RT_SET_WAKEUP_TIME          6
+#define APTIOMEMORYFIX_RT_GET_NEXT_HIGH_MONO_COUNT 7
+#define APTIOMEMORYFIX_RT_RESET_SYSTEM             8
+#define APTIOMEMORYFIX_RT_QUERY_VARIABLE_INFO      9
+#define APTIOMEMORYFIX_RT_UPDATE_CAPSULE           10
+#define APTIOMEMORYFIX_RT_QUERY_CAPSULE_CAPS       11
+#define APTIOMEMORYFIX_RT_SERVICE_COUNT            12
+
+// Calls of a single runtime service, times are in TSC ticks
+typedef struct {
+  // Completed calls
+  UINT64  Count;
+  // Total time spent in the firmware
+  UINT64  Ticks;
+  // Longest call
+  UINT64  MaxTicks;
+} APTIOMEMORYFIX_RT_SERVICE_STATS;
+
+// Updated by the shims on every call, readers should expect concurrent updates
+typedef struct {
+  UINT32                           Revision;
+  UINT32                           ServiceCount;
+  APTIOMEMORYFIX_RT_SERVICE_STATS  Services[APTIOMEMORYFIX_RT_SERVICE_COUNT];
+} APTIOMEMORYFIX_RT_STATS;
+
+extern EFI_GUID gAptioMemoryFixRtStatsGuid;
+
+#endif // APTIOFIX_RT_STATS_H
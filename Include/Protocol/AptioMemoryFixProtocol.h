@@ -10,16 +10,65 @@
 #ifndef APTIOFIX_MEMORY_PROTOCOL_H
 #define APTIOFIX_MEMORY_PROTOCOL_H
 
-#define APTIOMEMORYFIX_PROTOCOL_REVISION  0x0000000C
+#define APTIOMEMORYFIX_PROTOCOL_REVISION  0x0000000E
 
 // APTIOMEMORYFIX_PROTOCOL_GUID
 // C7CBA84E-CC77-461D-9E3C-6BE0CB79A7C1
 #define APTIOMEMORYFIX_PROTOCOL_GUID  \
   { 0xC7CBA84E, 0xCC77, 0x461D, { 0x9E, 0x3C, 0x6B, 0xE0, 0xCB, 0x79, 0xA7, 0xC1 } }
 
+// Number of allocation size histogram buckets, bucket N counts sizes in [2^N, 2^(N+1))
+#define APTIOMEMORYFIX_POOL_HISTOGRAM_SIZE  32
+
+// Custom pool allocator statistics, all sizes are in bytes
+typedef struct {
+  // Total pool size
+  UINT64  PoolSize;
+  // Pool memory initialised so far, equals PoolSize unless initialised lazily
+  UINT64  InitializedSize;
+  // Memory currently allocated from the pool including allocator headers
+  UINT64  LiveSize;
+  // Maximum LiveSize observed
+  UINT64  PeakLiveSize;
+  // Successful pool allocations and frees
+  UINT64  AllocationCount;
+  UINT64  FreeCount;
+  // EfiBootServicesData allocations the pool failed to serve and passed to firmware
+  UINT64  FallbackCount;
+  // Largest allocation the pool can serve right now without growing
+  UINT64  LargestFreeBlock;
+  // Number of free blocks in the pool free lists
+  UINT64  FreeBlockCount;
+  // Successful pool allocations by requested size
+  UINT64  Histogram[APTIOMEMORYFIX_POOL_HISTOGRAM_SIZE];
+  // Hot size allocations served from and missed by the reuse cache, since revision 0x0E
+  UINT64  MagazineHits;
+  UINT64  MagazineMisses;
+} APTIOMEMORYFIX_POOL_STATS;
+
+/**
+  Returns custom pool allocator statistics.
+  The structure may grow in later revisions, only StatsSize bytes are written.
+
+  @param[in,out] StatsSize  Size of Stats on input, size of the driver structure on output.
+  @param[out]    Stats      Statistics to fill.
+
+  @retval EFI_SUCCESS            Stats were filled.
+  @retval EFI_INVALID_PARAMETER  StatsSize or Stats is NULL.
+  @retval EFI_NOT_STARTED        The custom pool is not used.
+**/
+typedef
+EFI_STATUS
+(EFIAPI *APTIOMEMORYFIX_GET_POOL_STATS) (
+  IN OUT UINTN                      *StatsSize,
+  OUT    APTIOMEMORYFIX_POOL_STATS  *Stats
+  );
+
 // Includes a revision for debugging reasons
 typedef struct {
-  UINTN   Revision;
+  UINTN                          Revision;
+  // Available since revision 0x0D, takes StatsSize since revision 0x0E
+  APTIOMEMORYFIX_GET_POOL_STATS  GetPoolStats;
 } APTIOMEMORYFIX_PROTOCOL;
 
 extern EFI_GUID gAptioMemoryFixProtocolGuid;
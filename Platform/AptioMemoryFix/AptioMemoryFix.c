@@ -28,12 +28,14 @@
 #include "Hibernate.h"
 #include "RtShims.h"
 #include "ServiceOverrides.h"
+#include "VariableCache.h"
 
 //
 // One could discover AptioMemoryFix with this protocol
 //
 STATIC APTIOMEMORYFIX_PROTOCOL mAptioMemoryFixProtocol = {
-  APTIOMEMORYFIX_PROTOCOL_REVISION
+  APTIOMEMORYFIX_PROTOCOL_REVISION,
+  GetPoolStats
 };
 
 //
@@ -102,6 +104,7 @@ RunImageWithOverrides(
   InstallRtShims (GetVariableCustomSlide);
   InstallBsOverrides ();
   InstallRtOverrides ();
+  EnableVariableCache ();
 
   //
   // Clear monitoring vars
@@ -130,6 +133,7 @@ RunImageWithOverrides(
   // If we get here then boot.efi did not start kernel
   // and we'll try to do some cleanup ...
   //
+  DisableVariableCache ();
   UninstallBsOverrides ();
   UninstallRtOverrides ();
   UninstallRtShims ();
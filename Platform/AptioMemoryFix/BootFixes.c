@@ -10,7 +10,6 @@
 #include <Library/UefiLib.h>
 #include <Library/BaseMemoryLib.h>
 #include <Library/DebugLib.h>
-#include <Library/RngLib.h>
 #include <Library/UefiBootServicesTableLib.h>
 #include <Library/UefiRuntimeServicesTableLib.h>
 #include <Protocol/LoadedImage.h>
@@ -21,11 +20,14 @@
 #include "AsmFuncs.h"
 #include "VMem.h"
 #include "Lib.h"
+#include "MemoryMap.h"
 #include "Mach-O/Mach-O.h"
 #include "FlatDevTree/device_tree.h"
 #include "CsrConfig.h"
+#include "CustomSlide.h"
 #include "Hibernate.h"
 #include "RtShims.h"
+#include "VariableCache.h"
 
 // buffer and size for original kernel entry code
 UINT8 gOrigKernelCode[32];
@@ -43,8 +45,6 @@ UINTN gVirtualMapDescriptorSize = 0;
 EFI_PHYSICAL_ADDRESS gSysTableRtArea = 0;
 EFI_PHYSICAL_ADDRESS gRelocatedSysTableRtArea = 0;
 
-RT_RELOC_PROTECT_DATA gRelocInfoData;
-
 // used for restoring csr-active-config in boot-args
 BOOLEAN gCsrActiveConfigSet = FALSE;
 UINT32  gCsrActiveConfig = 0;
@@ -64,18 +64,6 @@ BOOLEAN gSlideArgPresent = FALSE;
 // TRUE if booting with -aptiodump
 BOOLEAN gDumpMemArgPresent = FALSE;
 
-// base kernel address and kaslr slide range
-#define BASE_KERNEL_ADDR       ((UINTN)0x100000)
-#define TOTAL_SLIDE_NUM        256
-
-// user for custom aslr implimentation, when some values are not valid
-UINT8   gValidSlides[TOTAL_SLIDE_NUM] = {0};
-UINT32  gValidSlidesNum = TOTAL_SLIDE_NUM;
-
-// slide calculation on Sandy and Ivy Bridge CPUs needs special treatment
-BOOLEAN gSandyOrIvy = FALSE;
-BOOLEAN gSandyOrIvySet = FALSE;
-
 void PrintSample2(unsigned char *sample, int size) {
   int i;
   for (i = 0; i < size; i++) {
@@ -274,6 +262,8 @@ ExecSetVirtualAddressesToMemMap (
   PAGE_MAP_AND_DIRECTORY_POINTER  *PageTable;
   UINTN                           Flags;
   UINTN                           BlockSize;
+  UINTN                           PoolPages;
+  UINTN                           PoolUsedPages;
 
   Desc                      = MemoryMap;
   NumEntries                = MemoryMapSize / DescriptorSize;
@@ -315,7 +305,11 @@ ExecSetVirtualAddressesToMemMap (
 
       // define virtual to phisical mapping
       DEBUG ((DEBUG_VERBOSE, "Map pages: %lx (%x) -> %lx\n", Desc->VirtualStart, Desc->NumberOfPages, Desc->PhysicalStart));
-      VmMapVirtualPages (PageTable, Desc->VirtualStart, Desc->NumberOfPages, Desc->PhysicalStart);
+      Status = VmMapVirtualPages (PageTable, Desc->VirtualStart, Desc->NumberOfPages, Desc->PhysicalStart);
+      if (EFI_ERROR (Status)) {
+        DEBUG ((DEBUG_WARN, "ERROR: cannot map RT area %lx - %r\n", Desc->PhysicalStart, Status));
+        return Status;
+      }
 
       // next gVirtualMemoryMap slot
       VirtualDesc = NEXT_MEMORY_DESCRIPTOR (VirtualDesc, DescriptorSize);
@@ -336,6 +330,13 @@ ExecSetVirtualAddressesToMemMap (
 
   VmFlashCaches ();
 
+  VmGetMemoryPoolStats (&PoolPages, &PoolUsedPages);
+  DEBUG ((DEBUG_INFO, "VmMemoryPool: used %u of %u pages\n", PoolUsedPages, PoolPages));
+
+  if (gDumpMemArgPresent) {
+    VmPrintTrace ();
+  }
+
   DEBUG ((DEBUG_VERBOSE, "ExecSetVirtualAddressesToMemMap: Size=%d, Addr=%p, DescSize=%d\nSetVirtualAddressMap ... ",
     gVirtualMapSize, MemoryMap, DescriptorSize));
   Status = gRT->SetVirtualAddressMap (gVirtualMapSize, DescriptorSize, DescriptorVersion, gVirtualMemoryMap);
@@ -476,7 +477,8 @@ ProcessBooterImage (
   UINTN BootArgsVarLen = BOOT_LINE_LENGTH;
 
   // Important to avoid triggering boot-args wrapper too early
-  Status = ((EFI_GET_VARIABLE)gGetVariable)(
+  Status = CachedGetVariable (
+    (EFI_GET_VARIABLE)gGetVariable,
     L"boot-args",
     &gAppleBootVariableGuid,
     NULL, &BootArgsVarLen,
@@ -502,254 +504,6 @@ ProcessBooterImage (
   }
 }
 
-BOOLEAN
-IsSandyOrIvy (
-  VOID
-  )
-{
-  UINT32  Eax;
-  UINT32  CpuFamily;
-  UINT32  CpuModel;
-
-  if (!gSandyOrIvySet) {
-    Eax = 0;
-
-    AsmCpuid (1, &Eax, NULL, NULL, NULL);
-
-    CpuFamily = (Eax >> 8) & 0xF;
-    if (CpuFamily == 15) // Use ExtendedFamily
-      CpuFamily = (Eax >> 20) + 15;
-
-    CpuModel = (Eax & 0xFF) >> 4;
-    if (CpuFamily == 15 || CpuFamily == 6) // Use ExtendedModel
-      CpuModel |= (Eax >> 12) & 0xF0;
-
-    gSandyOrIvy = CpuFamily == 6 && (CpuModel == 0x2A || CpuModel == 0x3A);
-    gSandyOrIvySet = TRUE;
-
-    DEBUG ((DEBUG_VERBOSE, "Discovered CpuFamily %d CpuModel %d SandyOrIvy %d\n", CpuFamily, CpuModel, gSandyOrIvy));
-  }
-
-  return gSandyOrIvy;
-}
-
-VOID
-GetSlideRangeForValue (
-  UINT8   Slide,
-  UINTN   *StartAddr,
-  UINTN   *EndAddr
-  )
-{
-  BOOLEAN SandyOrIvy;
-
-  SandyOrIvy = IsSandyOrIvy ();
-
-  *StartAddr = (UINTN)Slide * 0x200000 + BASE_KERNEL_ADDR;
-
-  // Skip ranges improperly used by Intel HD 2000/3000.
-  if (Slide >= 0x80 && SandyOrIvy)
-    *StartAddr += 0x10200000;
-
-  *EndAddr   = *StartAddr + APTIOFIX_SPECULATED_KERNEL_SIZE;
-}
-
-BOOLEAN
-OverlapsWithSlide (
-  EFI_PHYSICAL_ADDRESS   Address,
-  UINTN                  Size
-  )
-{
-  BOOLEAN               SandyOrIvy;
-  EFI_PHYSICAL_ADDRESS  Start;
-  EFI_PHYSICAL_ADDRESS  End;
-  UINTN                 Slide = 0xFF;
-
-  SandyOrIvy = IsSandyOrIvy ();
-
-  if (SandyOrIvy)
-    Slide = 0x7F;
-
-  Start = BASE_KERNEL_ADDR;
-  End   = Start + Slide * 0x200000 + APTIOFIX_SPECULATED_KERNEL_SIZE;
-
-  if (End >= Address && Start <= Address + Size) {
-    return TRUE;
-  } else if (SandyOrIvy) {
-    Start = 0x80 * 0x200000 + BASE_KERNEL_ADDR + 0x10200000;
-    End   = Start + Slide * 0x200000 + APTIOFIX_SPECULATED_KERNEL_SIZE;
-    if (End >= Address && Start <= Address + Size)
-      return TRUE;
-  }
-
-  return FALSE;
-}
-
-UINT8
-GenerateRandomSlideValue (
-  VOID
-  )
-{
-  UINT32  Clock = 0;
-  UINT32  Ecx = 0;
-  UINT8   Slide = 0;
-  UINT16  Value = 0;
-  BOOLEAN RdRandSupport;
-
-  AsmCpuid (0x1, NULL, NULL, &Ecx, NULL);
-  RdRandSupport = (Ecx & 0x40000000) != 0;
-
-  do {
-    if (RdRandSupport &&
-      GetRandomNumber16(&Value) == EFI_SUCCESS &&
-      Slide != 0)
-      break;
-
-    Clock = (UINT32)AsmReadTsc();
-    Slide = (Clock & 0xFF) ^ ((Clock >> 8) & 0xFF);
-  } while (Slide == 0);
-
-  //PrintScreen (L"Generated slide index %d value %d\n", Slide, gValidSlides[Slide % gValidSlidesNum]);
-
-  //FIXME: This is bad due to uneven distribution, but let's use it for now.
-  return gValidSlides[Slide % gValidSlidesNum];
-}
-
-VOID
-DecideOnCustomSlideImplementation (
-  VOID
-  )
-{
-  UINTN                  AllocatedMapPages;
-  UINTN                  MemoryMapSize;
-  EFI_MEMORY_DESCRIPTOR  *MemoryMap;
-  UINTN                  MapKey;
-  EFI_STATUS             Status;
-  UINTN                  DescriptorSize;
-  UINT32                 DescriptorVersion;
-  UINTN                  Index;
-  UINTN                  Slide;
-  UINTN                  NumEntries;
-
-  Status = GetMemoryMapAlloc (
-    &AllocatedMapPages,
-    &MemoryMapSize,
-    &MemoryMap,
-    &MapKey,
-    &DescriptorSize,
-    &DescriptorVersion
-    );
-
-  if (Status != EFI_SUCCESS) {
-    PrintScreen (L"AMF: Failed to obtain memory map for KASLR - %r\n", Status);
-    return;
-  }
-
-  // At this point we have a memory map that we could use to determine what slide values are allowed.
-  NumEntries = MemoryMapSize / DescriptorSize;
-
-  // Reset valid slides to zero and find actually working ones.
-  gValidSlidesNum = 0;
-
-  for (Slide = 0; Slide < TOTAL_SLIDE_NUM; Slide++) {
-    EFI_MEMORY_DESCRIPTOR  *Desc = MemoryMap;
-    BOOLEAN                Supported = TRUE;
-    UINTN                  StartAddr;
-    UINTN                  EndAddr;
-    UINTN                  DescEndAddr;
-    UINTN                  AvailableSize;
-
-    GetSlideRangeForValue ((UINT8)Slide, &StartAddr, &EndAddr);
-
-    AvailableSize = 0;
-
-    for (Index = 0; Index < NumEntries; Index++) {
-      DescEndAddr = (Desc->PhysicalStart + EFI_PAGES_TO_SIZE (Desc->NumberOfPages));
-
-      if ((Desc->PhysicalStart < EndAddr) && (DescEndAddr > StartAddr)) {
-        //
-        // The memory overlaps with the slide region.
-        //
-        if (Desc->Type != EfiConventionalMemory) {
-          //
-          // The memory is unusable atm.
-          //
-          Supported = FALSE;
-          break;
-        } else {
-          //
-          // The memory will be available for the kernel.
-          //
-          AvailableSize += EFI_PAGES_TO_SIZE (Desc->NumberOfPages);
-
-          if (Desc->PhysicalStart < StartAddr) {
-            //
-            // The region starts before the slide region.  Subtract the memory
-            // that is located before the slide region.
-            //
-            AvailableSize -= (StartAddr - Desc->PhysicalStart);
-          }
-
-          if (DescEndAddr > EndAddr) {
-            //
-            // The region ends after the slide region.  Subtract the memory
-            // that is located after the slide region.
-            //
-            AvailableSize -= (DescEndAddr - EndAddr);
-          }
-        }
-      }
-
-      Desc = NEXT_MEMORY_DESCRIPTOR (Desc, DescriptorSize);
-    }
-
-    if ((StartAddr + AvailableSize) != EndAddr) {
-      //
-      // The slide region is not continuous.
-      //
-      Supported = FALSE;
-    }
-
-    if (Supported) {
-      DEBUG ((DEBUG_VERBOSE, "Slide %03d at %08x:%08x should be ok.\n", (UINT32)Slide, (UINT32)StartAddr, (UINT32)EndAddr));
-      gValidSlides[gValidSlidesNum++] = (UINT8)Slide;
-    } else {
-      DEBUG ((DEBUG_VERBOSE, "Slide %03d at %08x:%08x cannot be used!\n", (UINT32)Slide, (UINT32)StartAddr, (UINT32)EndAddr));
-    }
-  }
-
-  gBS->FreePages ((EFI_PHYSICAL_ADDRESS)MemoryMap, AllocatedMapPages);
-
-  if (gValidSlidesNum != TOTAL_SLIDE_NUM) {
-    if (gValidSlidesNum == 0) {
-      PrintScreen (L"AMF: No slide values are usable! Use custom slide!\n");
-    } else {
-      //
-      // Pretty-print valid slides as ranges.
-      // For example, 1, 2, 3, 4, 5 will becomes 1-5.
-      //
-      PrintScreen (L"AMF: Only %d/%d slide values are usable! Booting may fail!\n", gValidSlidesNum, TOTAL_SLIDE_NUM);
-      NumEntries = 0;
-      for (Index = 0; Index <= gValidSlidesNum; Index++) {
-        if (Index == 0) {
-          PrintScreen (L"Valid slides: %d", gValidSlides[Index]);
-        } else if (Index == gValidSlidesNum || gValidSlides[Index - 1] + 1 != gValidSlides[Index]) {
-          if (NumEntries == 1)
-            PrintScreen (L", %d", gValidSlides[Index-1]);
-          else if (NumEntries > 1)
-            PrintScreen (L"-%d", gValidSlides[Index-1]);
-          if (Index == gValidSlidesNum)
-            PrintScreen (L"\n");
-          else
-            PrintScreen (L", %d", gValidSlides[Index]);
-          NumEntries = 0;
-        } else {
-          NumEntries++;
-        }
-      }
-    }
-  }
-}
-
 EFI_STATUS
 EFIAPI
 GetVariableCustomSlide (
@@ -810,7 +564,7 @@ GetVariableCustomSlide (
   }
 
   if (IsCsrActiveConfig) {
-    Status = RealGetVariable (VariableName, VendorGuid, Attributes, DataSize, Data);
+    Status = CachedGetVariable (RealGetVariable, VariableName, VendorGuid, Attributes, DataSize, Data);
     UINT32 *Config = (UINT32 *)Data;
     if (EFI_ERROR (Status)) {
       DEBUG ((DEBUG_WARN, "GetVariable csr-active-config returned %r\n", Status));
@@ -831,7 +585,7 @@ GetVariableCustomSlide (
     if (!gStoredBootArgsVarSet) {
       UINTN StoredBootArgsSize = BOOT_LINE_LENGTH;
       UINT8 Slide = GenerateRandomSlideValue ();
-      Status = RealGetVariable (VariableName, VendorGuid, Attributes, &StoredBootArgsSize, gStoredBootArgsVar);
+      Status = CachedGetVariable (RealGetVariable, VariableName, VendorGuid, Attributes, &StoredBootArgsSize, gStoredBootArgsVar);
 
       CHAR8 *AppendPtr = gStoredBootArgsVar;
       if (EFI_ERROR (Status)) {
@@ -890,7 +644,7 @@ GetVariableCustomSlide (
 
     *DataSize = gStoredBootArgsVarSize;
   } else {
-    Status = RealGetVariable (VariableName, VendorGuid, Attributes, DataSize, Data);
+    Status = CachedGetVariable (RealGetVariable, VariableName, VendorGuid, Attributes, DataSize, Data);
   }
 
   return Status;
@@ -928,149 +682,6 @@ HideSlideFromOS (
   SetMem(gStoredBootArgsVar, sizeof(gStoredBootArgsVar), 0);
 }
 
-VOID
-RestoreRelocInfoProtectMemTypes (
-  UINTN                   MemoryMapSize,
-  UINTN                   DescriptorSize,
-  EFI_MEMORY_DESCRIPTOR   *MemoryMap
-  )
-{
-  EFI_MEMORY_DESCRIPTOR   *Desc;
-  UINTN Index;
-  UINTN Index2;
-  UINTN NumEntriesLeft;
-
-  NumEntriesLeft = gRelocInfoData.NumEntries;
-  Desc = MemoryMap;
-
-  if (NumEntriesLeft > 0) {
-    for (Index = 0; Index < (MemoryMapSize / DescriptorSize); ++Index) {
-      if (NumEntriesLeft > 0) {
-        for (Index2 = 0; Index2 < gRelocInfoData.NumEntries; ++Index2) {
-          if (Desc->PhysicalStart == gRelocInfoData.RelocInfo[Index2].PhysicalStart) {
-            Desc->Type = gRelocInfoData.RelocInfo[Index2].Type;
-            --NumEntriesLeft;
-          }
-        }
-      }
-
-      Desc = NEXT_MEMORY_DESCRIPTOR (Desc, DescriptorSize);
-    }
-  }
-}
-
-/** Protect RT data from relocation by marking them MemMapIO. Except area with EFI system table.
- *  This one must be relocated into kernel boot image or kernel will crash (kernel accesses it
- *  before RT areas are mapped into vm).
- *  This fixes NVRAM issues on some boards where access to nvram after boot services is possible
- *  only in SMM mode. RT driver passes data to SM handler through previously negotiated buffer
- *  and this buffer must not be relocated.
- *  Explained and examined in detail by CodeRush and night199uk:
- *  http://www.projectosx.com/forum/index.php?showtopic=3298
- *
- *  It seems this does not do any harm to others where this is not needed,
- *  so it's added as standard fix for all.
- *
- *  Starting with APTIO V for nvram to work not only data but could too can no longer be moved
- *  due to the use of commbuffers. This, however, creates a memory protection issue, because
- *  XNU maps RT data as RW and code as RX, and AMI appears use global variables in some RT drivers.
- *  For this reason we shim (most?) affected RT services via wrapers that unset the WP bit during
- *  the UEFI call and set it back on return.
- *  Explained in detail by Download-Fritz and vit9696:
- *  http://www.insanelymac.com/forum/topic/331381-aptiomemoryfix (first 2 links in particular).
- */
-VOID
-ProtectRtMemoryFromRelocation (
-  IN UINTN                  MemoryMapSize,
-  IN UINTN                  DescriptorSize,
-  IN UINT32                 DescriptorVersion,
-  IN EFI_MEMORY_DESCRIPTOR  *MemoryMap
-  )
-{
-  UINTN                   NumEntries;
-  UINTN                   Index;
-  EFI_MEMORY_DESCRIPTOR   *Desc;
-
-  RT_RELOC_PROTECT_INFO *RelocInfo;
-
-  Desc = MemoryMap;
-  NumEntries = MemoryMapSize / DescriptorSize;
-  DEBUG ((DEBUG_VERBOSE, "FixNvramRelocation\n"));
-
-  gRelocInfoData.NumEntries = 0;
-
-  RelocInfo = &gRelocInfoData.RelocInfo[0];
-
-  for (Index = 0; Index < NumEntries; Index++) {
-    if ((Desc->Attribute & EFI_MEMORY_RUNTIME) != 0 &&
-        (Desc->Type == EfiRuntimeServicesCode ||
-        (Desc->Type == EfiRuntimeServicesData && Desc->PhysicalStart != gSysTableRtArea))) {
-
-      if (gRelocInfoData.NumEntries < ARRAY_SIZE (gRelocInfoData.RelocInfo)) {
-        RelocInfo->PhysicalStart = Desc->PhysicalStart;
-        RelocInfo->Type          = Desc->Type;
-        ++RelocInfo;
-        ++gRelocInfoData.NumEntries;
-      } else {
-        DEBUG ((DEBUG_WARN, " WARNING: Cannot save mem type for entry: %lx (type 0x%x)\n", Desc->PhysicalStart, (UINTN)Desc->Type));
-      }
-
-      DEBUG ((DEBUG_VERBOSE, " RT mem %lx (0x%x) -> MemMapIO\n", Desc->PhysicalStart, Desc->NumberOfPages));
-      Desc->Type = EfiMemoryMappedIO;
-    }
-
-    Desc = NEXT_MEMORY_DESCRIPTOR(Desc, DescriptorSize);
-  }
-}
-
-/** AMI CSM module allocates up to two regions for legacy video output.
- *  1. For PMM and EBDA areas.
- *     On Ivy Bridge and below it ends at 0xA0000-0x1000-0x1 and has EfiBootServicesCode type.
- *     On Haswell and above it is allocated below 0xA0000 address with the same type.
- *  2. For Intel RC S3 reserved area, fixed from 0x9F000 to 0x9FFFF.
- *     On Sandy Bridge and below it is not present in memory map.
- *     On Ivy Bridge and newer it is present as EfiRuntimeServicesData.
- *     Starting from at least SkyLake it is present as EfiReservedMemoryType.
- *
- *  Prior to AptioMemoryFix EfiRuntimeServicesData could have been relocated by boot.efi,
- *  and the 2nd region could have been overwritten by the kernel. Now it is no longer the
- *  case, and only the 1st region may need special handling.
- *
- *  For the 1st region there appear to be (unconfirmed) reports that it may still be accessed
- *  after waking from sleep. This does not seem to be valid according to AMI code, but we still
- *  protect it in case such systems really exist.
- *
- *  Researched and fixed on gigabyte boards by Slice
- */
-VOID
-ProtectCsmRegion (
-  UINTN                   MemoryMapSize,
-  EFI_MEMORY_DESCRIPTOR   *MemoryMap,
-  UINTN                   DescriptorSize
-  )
-{
-  UINTN                   NumEntries;
-  UINTN                   Index;
-  EFI_MEMORY_DESCRIPTOR   *Desc;
-  UINTN                   BlockSize;
-  UINTN                   PhysicalEnd;
-
-  Desc = MemoryMap;
-  NumEntries = MemoryMapSize / DescriptorSize;
-
-  for (Index = 0; Index < NumEntries; Index++) {
-    BlockSize = EFI_PAGES_TO_SIZE ((UINTN)Desc->NumberOfPages);
-    PhysicalEnd = Desc->PhysicalStart + BlockSize;
-
-    if (PhysicalEnd >= 0x9E000 && PhysicalEnd < 0xA0000 && Desc->Type == EfiBootServicesData) {
-      Desc->Type = EfiACPIMemoryNVS;
-      break;
-    }
-
-    Desc = NEXT_MEMORY_DESCRIPTOR(Desc, DescriptorSize);
-  }
-}
-
 /** Fixes stuff when booting without relocation block. Called when boot.efi jumps to kernel. */
 UINTN
 FixBooting (
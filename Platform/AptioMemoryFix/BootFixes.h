@@ -9,16 +9,6 @@
 #ifndef APTIOFIX_BOOT_FIXES_H
 #define APTIOFIX_BOOT_FIXES_H
 
-typedef struct {
-  EFI_PHYSICAL_ADDRESS  PhysicalStart;
-  EFI_MEMORY_TYPE       Type;
-} RT_RELOC_PROTECT_INFO;
-
-typedef struct {
-  UINTN                 NumEntries;
-  RT_RELOC_PROTECT_INFO RelocInfo[APTIFIX_MAX_RT_RELOC_NUM];
-} RT_RELOC_PROTECT_DATA;
-
 extern EFI_PHYSICAL_ADDRESS   gSysTableRtArea;
 
 extern EFI_PHYSICAL_ADDRESS   gRelocatedSysTableRtArea;
@@ -61,14 +51,6 @@ CopyEfiSysTableToSeparateRtDataArea (
   IN OUT UINT32             *EfiSystemTable
   );
 
-VOID
-ProtectRtMemoryFromRelocation(
-  IN UINTN                  MemoryMapSize,
-  IN UINTN                  DescriptorSize,
-  IN UINT32                 DescriptorVersion,
-  IN EFI_MEMORY_DESCRIPTOR  *MemoryMap
-  );
-
 VOID
 UnlockSlideSupportForSafeModeAndCheckSlide (
   UINT8                   *ImageBase,
@@ -80,16 +62,6 @@ ProcessBooterImage (
   EFI_HANDLE              ImageHandle
   );
 
-VOID
-DecideOnCustomSlideImplementation (
-  VOID
-  );
-
-BOOLEAN
-IsSandyOrIvy (
-  VOID
-  );
-
 EFI_STATUS
 EFIAPI
 GetVariableCustomSlide (
@@ -105,14 +77,6 @@ HideSlideFromOS (
   BootArguments   *BootArgs
   );
 
-/** Protects CSM regions from the kernel and boot.efi. */
-VOID
-ProtectCsmRegion (
-  UINTN                    MemoryMapSize,
-  EFI_MEMORY_DESCRIPTOR    *MemoryMap,
-  UINTN                    DescriptorSize
-  );
-
 /** Fixes stuff for booting without relocation block. Called when boot.efi jumps to kernel. */
 UINTN
 FixBooting(
@@ -60,7 +60,7 @@
 
 /** Maximum number of supported runtime reloc protection areas */
 #ifndef APTIFIX_MAX_RT_RELOC_NUM
-#define APTIFIX_MAX_RT_RELOC_NUM ((UINTN)64)
+#define APTIFIX_MAX_RT_RELOC_NUM ((UINTN)256)
 #endif
 
 /** Perform invasive memory dumps when -aptiodump -v are passed to boot.efi.
@@ -71,6 +71,15 @@
 #define APTIOFIX_ALLOW_MEMORY_DUMP_ARG 0
 #endif
 
+/** Store memory maps dumped with -aptiodump in aptiomemfix-memmap and aptiomemfix-vmap volatile
+ *  variables instead of printing them with a 5 second stall every 16 lines. The variables can be
+ *  read with "nvram -x -p" in macOS and analysed with Utilities/MemMapTool.
+ *  Maps are still printed when the variable cannot be set.
+ */
+#ifndef APTIOFIX_MEMORY_DUMP_TO_VARIABLE
+#define APTIOFIX_MEMORY_DUMP_TO_VARIABLE 1
+#endif
+
 /** Due to os crashes caused by using AllocatePool on several Skylake APTIO V boards we embed
  *  a custom allocator, that avoids the use of boot services allocator by preallocating a memory pool
  *  (currently 512 MB) and spreading it as requested throughout the boot process.
@@ -82,4 +91,96 @@
 #define APTIOFIX_ALLOCATOR_POOL_SIZE 0x20000000
 #endif
 
+/** Initialise and zero the custom allocator pool lazily, in APTIOFIX_ALLOCATOR_GROW_SIZE steps
+ *  as allocations need more space, instead of touching the whole pool when it is installed.
+ *  A typical boot uses only a part of the pool, so this saves zeroing the rest.
+ */
+#ifndef APTIOFIX_ALLOCATOR_LAZY_INIT
+#define APTIOFIX_ALLOCATOR_LAZY_INIT 1
+#endif
+
+/** Custom allocator pool growth step in bytes when APTIOFIX_ALLOCATOR_LAZY_INIT is enabled.
+ *  Each step is zeroed with interrupts masked, so it also bounds allocator latency.
+ *  Must be a multiple of the page size.
+ */
+#ifndef APTIOFIX_ALLOCATOR_GROW_SIZE
+#define APTIOFIX_ALLOCATOR_GROW_SIZE 0x200000
+#endif
+
+/** Number of freed allocations the custom allocator keeps per hot size class for reuse.
+ *  Hot classes are small allocations up to 16 blocks and the buffers AMI PrintLine uses.
+ *  Cached allocations are served without touching the free lists. Set to 0 to disable.
+ */
+#ifndef APTIOFIX_ALLOCATOR_MAGAZINE_DEPTH
+#define APTIOFIX_ALLOCATOR_MAGAZINE_DEPTH 8
+#endif
+
+/** Custom allocator block size in bytes, a power of two from 16 to 128.
+ *  Every allocation carries an 8 byte header and is rounded up to whole blocks.
+ *  Bigger blocks mean shorter block chains and fewer splits for the multi-megabyte
+ *  buffers boot.efi uses, at the cost of more slack for small strings.
+ */
+#ifndef APTIOFIX_ALLOCATOR_BLOCK_SIZE
+#define APTIOFIX_ALLOCATOR_BLOCK_SIZE 32
+#endif
+
+/** Requests of this size and above are served by the custom allocator from page-aligned runs
+ *  rounded up to whole pages and carved from the top of a free block, which keeps them away
+ *  from small allocations and leaves page-aligned free space behind when released.
+ */
+#ifndef APTIOFIX_ALLOCATOR_LARGE_SIZE
+#define APTIOFIX_ALLOCATOR_LARGE_SIZE 0x2000
+#endif
+
+/** Record page table walks and updates as binary events in a ring buffer instead of printing
+ *  verbose messages for every table level, which dominated mapping time in DEBUG builds.
+ *  Events are decoded by VmPrintTrace, called after mapping runtime areas with -aptiodump.
+ *  Only DEBUG builds record events.
+ */
+#ifndef APTIOFIX_VMEM_TRACE
+#define APTIOFIX_VMEM_TRACE 1
+#endif
+
+/** Number of page table events kept by APTIOFIX_VMEM_TRACE, a power of two. */
+#ifndef APTIOFIX_VMEM_TRACE_SIZE
+#define APTIOFIX_VMEM_TRACE_SIZE 256
+#endif
+
+/** Serve repeated boot.efi reads of Apple boot variables (boot-args, csr-active-config, etc.)
+ *  from memory until ExitBootServices. Cached variables are dropped on SetVariable.
+ */
+#ifndef APTIOFIX_VARIABLE_CACHE
+#define APTIOFIX_VARIABLE_CACHE 1
+#endif
+
+/** Maximum number of variables in the boot variable cache, including missing ones. */
+#ifndef APTIOFIX_VARIABLE_CACHE_ENTRIES
+#define APTIOFIX_VARIABLE_CACHE_ENTRIES 16
+#endif
+
+/** Total size of variable data kept in the boot variable cache, larger variables are not cached. */
+#ifndef APTIOFIX_VARIABLE_CACHE_DATA_SIZE
+#define APTIOFIX_VARIABLE_CACHE_DATA_SIZE 0x2000
+#endif
+
+/** Bitmask of runtime services called by RT shims with CR0.WP cleared and interrupts disabled,
+ *  bit N stands for service index N from Include/Guid/AptioMemoryFixRtStats.h.
+ *  Services with a clear bit are jumped to directly, avoiding serialising CR0 writes, which is
+ *  only safe when the firmware implementation never writes to its write-protected globals.
+ *  GetTime, GetWakeupTime and GetNextHighMonotonicCount are the usual candidates (mask 0xF57).
+ *  Can be overridden at boot with a 32-bit aptiomemfix-rtwp variable in the Apple boot GUID.
+ */
+#ifndef APTIOFIX_RT_SHIMS_WP_MASK
+#define APTIOFIX_RT_SHIMS_WP_MASK 0xFFF
+#endif
+
+/** Count calls and TSC ticks spent in every runtime service wrapped by RT shims.
+ *  Statistics are published as APTIOMEMORYFIX_RT_STATS configuration table, see
+ *  Include/Guid/AptioMemoryFixRtStats.h. Disabled builds keep the original shim path
+ *  behind a single flag check.
+ */
+#ifndef APTIOFIX_RT_SHIMS_STATS
+#define APTIOFIX_RT_SHIMS_STATS 0
+#endif
+
 #endif // APTIOFIX_HACK_CONFIG_H
@@ -0,0 +1,471 @@
+/**
+
+  Custom KASLR slide implementation for memory maps that do not have
+  all the slide values available.
+
+**/
+
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/DebugLib.h>
+#include <Library/RngLib.h>
+#include <Library/UefiLib.h>
+
+#include "Config.h"
+#include "CustomSlide.h"
+#include "Lib.h"
+
+// used for custom aslr implimentation, when some values are not valid
+UINT64  gValidSlides[SLIDE_BITMAP_SIZE] = {0};
+UINT32  gValidSlidesNum = TOTAL_SLIDE_NUM;
+
+// random slide selection: rejection sampling attempts and TSC fallback rounds
+#define SLIDE_RANDOM_MAX_ATTEMPTS 16
+#define SLIDE_TSC_JITTER_ROUNDS   32
+
+// slide calculation on Sandy and Ivy Bridge CPUs needs special treatment
+STATIC BOOLEAN mSandyOrIvy = FALSE;
+STATIC BOOLEAN mSandyOrIvySet = FALSE;
+
+BOOLEAN
+IsSandyOrIvy (
+  VOID
+  )
+{
+  UINT32  Eax;
+  UINT32  CpuFamily;
+  UINT32  CpuModel;
+
+  if (!mSandyOrIvySet) {
+    Eax = 0;
+
+    AsmCpuid (1, &Eax, NULL, NULL, NULL);
+
+    CpuFamily = (Eax >> 8) & 0xF;
+    if (CpuFamily == 15) // Use ExtendedFamily
+      CpuFamily = (Eax >> 20) + 15;
+
+    CpuModel = (Eax & 0xFF) >> 4;
+    if (CpuFamily == 15 || CpuFamily == 6) // Use ExtendedModel
+      CpuModel |= (Eax >> 12) & 0xF0;
+
+    mSandyOrIvy = CpuFamily == 6 && (CpuModel == 0x2A || CpuModel == 0x3A);
+    mSandyOrIvySet = TRUE;
+
+    DEBUG ((DEBUG_VERBOSE, "Discovered CpuFamily %d CpuModel %d SandyOrIvy %d\n", CpuFamily, CpuModel, mSandyOrIvy));
+  }
+
+  return mSandyOrIvy;
+}
+
+UINTN
+GetKernelSlideRanges (
+  OUT EFI_PHYSICAL_ADDRESS   *Starts,
+  OUT EFI_PHYSICAL_ADDRESS   *Ends
+  )
+{
+  BOOLEAN               SandyOrIvy;
+  UINTN                 Slide = 0xFF;
+
+  SandyOrIvy = IsSandyOrIvy ();
+
+  if (SandyOrIvy)
+    Slide = 0x7F;
+
+  Starts[0] = BASE_KERNEL_ADDR;
+  Ends[0]   = Starts[0] + Slide * 0x200000 + APTIOFIX_SPECULATED_KERNEL_SIZE;
+
+  if (!SandyOrIvy)
+    return 1;
+
+  Starts[1] = 0x80 * 0x200000 + BASE_KERNEL_ADDR + 0x10200000;
+  Ends[1]   = Starts[1] + Slide * 0x200000 + APTIOFIX_SPECULATED_KERNEL_SIZE;
+
+  return 2;
+}
+
+BOOLEAN
+OverlapsWithSlide (
+  EFI_PHYSICAL_ADDRESS   Address,
+  UINTN                  Size
+  )
+{
+  EFI_PHYSICAL_ADDRESS  Starts[KERNEL_SLIDE_RANGES_MAX];
+  EFI_PHYSICAL_ADDRESS  Ends[KERNEL_SLIDE_RANGES_MAX];
+  UINTN                 NumRanges;
+  UINTN                 Index;
+
+  NumRanges = GetKernelSlideRanges (Starts, Ends);
+
+  for (Index = 0; Index < NumRanges; Index++) {
+    if (Ends[Index] >= Address && Starts[Index] <= Address + Size)
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+/** Marks slides whose kernel area starts at or above RunStart and ends at or below RunEnd. */
+STATIC
+UINTN
+MarkSlidesInRun (
+  IN     EFI_PHYSICAL_ADDRESS  RunStart,
+  IN     EFI_PHYSICAL_ADDRESS  RunEnd,
+  IN     BOOLEAN               SandyOrIvy,
+  IN OUT UINT64                *Bitmap
+  )
+{
+  UINTN                 Segment;
+  UINTN                 First;
+  UINTN                 Last;
+  UINTN                 Slide;
+  UINTN                 Count;
+  EFI_PHYSICAL_ADDRESS  Base;
+  EFI_PHYSICAL_ADDRESS  Lowest;
+  EFI_PHYSICAL_ADDRESS  Highest;
+
+  if (RunEnd - RunStart < APTIOFIX_SPECULATED_KERNEL_SIZE)
+    return 0;
+
+  Count = 0;
+
+  //
+  // Kernel area start grows by 2 MB with every slide value.
+  // Sandy Bridge and Ivy Bridge skip ranges improperly used by Intel HD 2000/3000 from slide 0x80.
+  //
+  for (Segment = 0; Segment < (SandyOrIvy ? 2U : 1U); Segment++) {
+    First = SandyOrIvy ? Segment * 0x80 : 0;
+    Last  = SandyOrIvy ? First + 0x7F : TOTAL_SLIDE_NUM - 1;
+    Base  = BASE_KERNEL_ADDR + (Segment > 0 ? 0x10200000 : 0);
+
+    Lowest  = Base + First * 0x200000;
+    Highest = RunEnd - APTIOFIX_SPECULATED_KERNEL_SIZE;
+
+    if (Highest < Lowest || RunStart > Base + Last * 0x200000)
+      continue;
+
+    if (RunStart > Lowest)
+      First = (UINTN)DivU64x32 (RunStart - Base + 0x1FFFFF, 0x200000);
+    Last = MIN (Last, (UINTN)DivU64x32 (Highest - Base, 0x200000));
+
+    for (Slide = First; Slide <= Last; Slide++) {
+      Bitmap[Slide / 64] |= LShiftU64 (1, Slide % 64);
+      Count++;
+    }
+  }
+
+  return Count;
+}
+
+UINTN
+ComputeValidSlides (
+  IN  UINTN                   MemoryMapSize,
+  IN  EFI_MEMORY_DESCRIPTOR   *MemoryMap,
+  IN  UINTN                   DescriptorSize,
+  IN  BOOLEAN                 SandyOrIvy,
+  OUT UINT64                  *Bitmap
+  )
+{
+  EFI_MEMORY_DESCRIPTOR   *MemoryMapEnd;
+  EFI_MEMORY_DESCRIPTOR   *Desc;
+  EFI_PHYSICAL_ADDRESS    RunStart;
+  EFI_PHYSICAL_ADDRESS    RunEnd;
+  EFI_PHYSICAL_ADDRESS    DescEnd;
+  UINTN                   Count;
+
+  ZeroMem (Bitmap, SLIDE_BITMAP_SIZE * sizeof (UINT64));
+
+  //
+  // A slide is valid when the whole kernel area lies in a run of adjacent free descriptors.
+  // Runs are collected in a single pass, and each slide is checked against one run only.
+  //
+  Count        = 0;
+  RunStart     = 0;
+  RunEnd       = 0;
+  MemoryMapEnd = NEXT_MEMORY_DESCRIPTOR (MemoryMap, MemoryMapSize);
+
+  for (Desc = MemoryMap; Desc < MemoryMapEnd; Desc = NEXT_MEMORY_DESCRIPTOR (Desc, DescriptorSize)) {
+    if (Desc->NumberOfPages == 0)
+      continue;
+
+    DescEnd = Desc->PhysicalStart + EFI_PAGES_TO_SIZE ((UINTN)Desc->NumberOfPages);
+
+    if (Desc->Type != EfiConventionalMemory) {
+      //
+      // Used memory ends the run, and also cuts it should the descriptors overlap.
+      //
+      Count   += MarkSlidesInRun (RunStart, MIN (RunEnd, MAX (RunStart, Desc->PhysicalStart)), SandyOrIvy, Bitmap);
+      RunStart = RunEnd = DescEnd;
+    } else if (Desc->PhysicalStart == RunEnd) {
+      RunEnd = DescEnd;
+    } else {
+      Count   += MarkSlidesInRun (RunStart, RunEnd, SandyOrIvy, Bitmap);
+      RunStart = Desc->PhysicalStart;
+      RunEnd   = DescEnd;
+    }
+  }
+
+  Count += MarkSlidesInRun (RunStart, RunEnd, SandyOrIvy, Bitmap);
+
+  return Count;
+}
+
+/** Returns the number of set bits in Value, in constant time. */
+STATIC
+UINT64
+CountSetBits64 (
+  IN UINT64  Value
+  )
+{
+  Value = Value - (RShiftU64 (Value, 1) & 0x5555555555555555ULL);
+  Value = (Value & 0x3333333333333333ULL) + (RShiftU64 (Value, 2) & 0x3333333333333333ULL);
+  Value = (Value + RShiftU64 (Value, 4)) & 0x0F0F0F0F0F0F0F0FULL;
+  return RShiftU64 (MultU64x64 (Value, 0x0101010101010101ULL), 56);
+}
+
+/** Returns 1 when Left is below Right and 0 otherwise, without branching. */
+STATIC
+UINT64
+IsLessThan64 (
+  IN UINT64  Left,
+  IN UINT64  Right
+  )
+{
+  return RShiftU64 (Left ^ ((Left ^ Right) | ((Left - Right) ^ Right)), 63);
+}
+
+UINT8
+SelectValidSlide (
+  IN CONST UINT64             *Bitmap,
+  IN UINTN                    Index
+  )
+{
+  UINTN   Word;
+  UINTN   Step;
+  UINT64  Value;
+  UINT64  Bits;
+  UINT64  Seen;
+  UINT64  Rank;
+  UINT64  Low;
+  UINT64  Take;
+  UINT64  Mask;
+  UINT64  Position;
+  UINT64  Result;
+
+  //
+  // Visit every bitmap word and do the same work in each one without branching
+  // on the bitmap or the index, so that neither timing nor memory access pattern
+  // depend on the chosen slide. Within a word the wanted bit is found by halving
+  // the search window 6 times and counting the set bits in its lower half.
+  //
+  Seen   = 0;
+  Result = 0;
+
+  for (Word = 0; Word < SLIDE_BITMAP_SIZE; Word++) {
+    Value    = Bitmap[Word];
+    Bits     = CountSetBits64 (Value);
+    Rank     = (UINT64)Index - Seen;
+    Mask     = 0 - (IsLessThan64 (Rank, Bits) & (IsLessThan64 (Index, Seen) ^ 1));
+    Rank    &= 63;
+    Position = 0;
+
+    for (Step = 32; Step > 0; Step >>= 1) {
+      Low       = CountSetBits64 (RShiftU64 (Value, (UINTN)Position) & (LShiftU64 (1, Step) - 1));
+      Take      = 0 - (IsLessThan64 (Rank, Low) ^ 1);
+      Position += Step & Take;
+      Rank     -= Low & Take;
+    }
+
+    Result |= (Word * 64 + Position) & Mask;
+    Seen   += Bits;
+  }
+
+  return (UINT8)Result;
+}
+
+UINTN
+GetLargestValidSlideRun (
+  IN  CONST UINT64            *Bitmap,
+  OUT UINT8                   *First
+  )
+{
+  UINTN   Slide;
+  UINTN   RunLength;
+  UINTN   Largest;
+
+  RunLength = 0;
+  Largest   = 0;
+  *First    = 0;
+
+  for (Slide = 0; Slide < TOTAL_SLIDE_NUM; Slide++) {
+    if ((RShiftU64 (Bitmap[Slide / 64], Slide % 64) & 1) == 0) {
+      RunLength = 0;
+      continue;
+    }
+
+    RunLength++;
+    if (RunLength > Largest) {
+      Largest = RunLength;
+      *First  = (UINT8)(Slide + 1 - RunLength);
+    }
+  }
+
+  return Largest;
+}
+
+/** Returns 16 bits gathered from TSC jitter, used when RDRAND is not available or fails. */
+STATIC
+UINT16
+GetTscJitter16 (
+  VOID
+  )
+{
+  UINT64  Value;
+  UINT64  Start;
+  UINTN   Index;
+
+  //
+  // CPUID is serialising and takes a varying number of cycles, especially under
+  // a hypervisor, so the lowest bits of its duration are hard to predict.
+  //
+  Value = AsmReadTsc ();
+  for (Index = 0; Index < SLIDE_TSC_JITTER_ROUNDS; Index++) {
+    Start = AsmReadTsc ();
+    AsmCpuid (0, NULL, NULL, NULL, NULL);
+    Value = LRotU64 (Value, 7) ^ (AsmReadTsc () - Start);
+  }
+
+  //
+  // Spread the collected bits over the whole value before taking the top ones.
+  //
+  Value = MultU64x64 (Value ^ RShiftU64 (Value, 32), 0x9E3779B97F4A7C15ULL);
+  return (UINT16)RShiftU64 (Value, 48);
+}
+
+/** Returns 16 random bits from RDRAND, falling back to TSC jitter. */
+STATIC
+UINT16
+GetSlideEntropy16 (
+  VOID
+  )
+{
+  STATIC BOOLEAN  RdRandChecked;
+  STATIC BOOLEAN  RdRandSupport;
+  UINT32          Ecx;
+  UINT16          Value;
+
+  if (!RdRandChecked) {
+    Ecx = 0;
+    AsmCpuid (0x1, NULL, NULL, &Ecx, NULL);
+    RdRandSupport = (Ecx & BIT30) != 0;
+    RdRandChecked = TRUE;
+  }
+
+  //
+  // GetRandomNumber16 already retries RDRAND on underflow.
+  //
+  if (RdRandSupport && GetRandomNumber16 (&Value))
+    return Value;
+
+  return GetTscJitter16 ();
+}
+
+UINTN
+GetUniformSlideIndex (
+  IN UINTN                    Count,
+  IN SLIDE_ENTROPY_SOURCE     GetEntropy
+  )
+{
+  UINT32  Limit;
+  UINT32  Value;
+  UINTN   Attempt;
+
+  if (Count <= 1)
+    return 0;
+
+  //
+  // Drop values from the incomplete last group of Count values,
+  // so that every index is produced by the same number of 16-bit values.
+  //
+  Limit = 0x10000 - (0x10000 % (UINT32)Count);
+  Value = 0;
+
+  for (Attempt = 0; Attempt < SLIDE_RANDOM_MAX_ATTEMPTS; Attempt++) {
+    Value = GetEntropy ();
+    if (Value < Limit)
+      break;
+  }
+
+  //
+  // Less than 0.4% of values are dropped, so running out of attempts means a broken
+  // entropy source. The last value is still used then, with a negligible bias.
+  //
+  return Value % Count;
+}
+
+UINT8
+GenerateRandomSlideValue (
+  VOID
+  )
+{
+  return SelectValidSlide (gValidSlides, GetUniformSlideIndex (gValidSlidesNum, GetSlideEntropy16));
+}
+
+VOID
+DecideOnCustomSlideImplementation (
+  VOID
+  )
+{
+  UINTN                  MemoryMapSize;
+  EFI_MEMORY_DESCRIPTOR  *MemoryMap;
+  EFI_STATUS             Status;
+  UINTN                  DescriptorSize;
+  UINTN                  Slide;
+  UINTN                  RunStart;
+  BOOLEAN                Valid;
+  BOOLEAN                Separator;
+  UINT8                  LargestFirst;
+  UINTN                  LargestNum;
+
+  Status = GetMemoryMapSnapshot (&MemoryMapSize, &MemoryMap, &DescriptorSize, NULL);
+
+  if (Status != EFI_SUCCESS) {
+    PrintScreen (L"AMF: Failed to obtain memory map for KASLR - %r\n", Status);
+    return;
+  }
+
+  // At this point we have a sorted memory map that we could use to determine what slide values are allowed.
+  gValidSlidesNum = (UINT32)ComputeValidSlides (MemoryMapSize, MemoryMap, DescriptorSize, IsSandyOrIvy (), gValidSlides);
+
+  if (gValidSlidesNum != TOTAL_SLIDE_NUM) {
+    if (gValidSlidesNum == 0) {
+      PrintScreen (L"AMF: No slide values are usable! Use custom slide!\n");
+    } else {
+      //
+      // Pretty-print valid slides as ranges.
+      // For example, 1, 2, 3, 4, 5 will becomes 1-5.
+      //
+      PrintScreen (L"AMF: Only %d/%d slide values are usable! Booting may fail!\n", gValidSlidesNum, TOTAL_SLIDE_NUM);
+      PrintScreen (L"Valid slides: ");
+      RunStart  = TOTAL_SLIDE_NUM;
+      Separator = FALSE;
+      for (Slide = 0; Slide <= TOTAL_SLIDE_NUM; Slide++) {
+        Valid = Slide < TOTAL_SLIDE_NUM && (RShiftU64 (gValidSlides[Slide / 64], Slide % 64) & 1) != 0;
+        if (Valid && RunStart == TOTAL_SLIDE_NUM) {
+          PrintScreen (Separator ? L", %d" : L"%d", Slide);
+          Separator = TRUE;
+          RunStart  = Slide;
+        } else if (!Valid && RunStart != TOTAL_SLIDE_NUM) {
+          if (Slide - 1 > RunStart)
+            PrintScreen (L"-%d", Slide - 1);
+          RunStart = TOTAL_SLIDE_NUM;
+        }
+      }
+      PrintScreen (L"\n");
+
+      LargestNum = GetLargestValidSlideRun (gValidSlides, &LargestFirst);
+      PrintScreen (L"Largest contiguous slide range: %d-%d (%d values)\n",
+        LargestFirst, LargestFirst + LargestNum - 1, LargestNum);
+    }
+  }
+}
@@ -0,0 +1,96 @@
+/**
+
+  Custom KASLR slide implementation for memory maps that do not have
+  all the slide values available.
+
+**/
+
+#ifndef APTIOFIX_CUSTOM_SLIDE_H
+#define APTIOFIX_CUSTOM_SLIDE_H
+
+// base kernel address and kaslr slide range
+#define BASE_KERNEL_ADDR        ((UINTN)0x100000)
+#define TOTAL_SLIDE_NUM         256
+#define SLIDE_BITMAP_SIZE       (TOTAL_SLIDE_NUM / 64)
+#define KERNEL_SLIDE_RANGES_MAX 2
+
+// valid slide values as a bitmap, used when some values are not valid
+extern UINT64  gValidSlides[SLIDE_BITMAP_SIZE];
+extern UINT32  gValidSlidesNum;
+
+/** Returns TRUE on Sandy Bridge and Ivy Bridge CPUs, which need special slide treatment. */
+BOOLEAN
+IsSandyOrIvy (
+  VOID
+  );
+
+/** Returns the number of address ranges a kernel image may occupy with any slide value.
+ *  Ranges are returned in ascending order, and Ends are inclusive like in OverlapsWithSlide.
+ */
+UINTN
+GetKernelSlideRanges (
+  OUT EFI_PHYSICAL_ADDRESS   *Starts,
+  OUT EFI_PHYSICAL_ADDRESS   *Ends
+  );
+
+/** Checks whether the area overlaps with a possible kernel image area. */
+BOOLEAN
+OverlapsWithSlide (
+  EFI_PHYSICAL_ADDRESS   Address,
+  UINTN                  Size
+  );
+
+/** Computes the slide values a kernel image fits at in a sorted memory map.
+ *  Sets a bit in Bitmap for every valid slide and returns their number.
+ *  Does not depend on any global state, so it may be used on saved memory maps.
+ */
+UINTN
+ComputeValidSlides (
+  IN  UINTN                   MemoryMapSize,
+  IN  EFI_MEMORY_DESCRIPTOR   *MemoryMap,
+  IN  UINTN                   DescriptorSize,
+  IN  BOOLEAN                 SandyOrIvy,
+  OUT UINT64                  *Bitmap
+  );
+
+/** Returns the slide value of the Index-th valid slide in Bitmap, in constant time. */
+UINT8
+SelectValidSlide (
+  IN CONST UINT64             *Bitmap,
+  IN UINTN                    Index
+  );
+
+/** Returns the length of the longest run of valid slides in Bitmap and its first slide in First. */
+UINTN
+GetLargestValidSlideRun (
+  IN  CONST UINT64            *Bitmap,
+  OUT UINT8                   *First
+  );
+
+/** Returns 16 bits of entropy. */
+typedef
+UINT16
+(*SLIDE_ENTROPY_SOURCE) (
+  VOID
+  );
+
+/** Returns a uniformly distributed index below Count using rejection sampling on GetEntropy. */
+UINTN
+GetUniformSlideIndex (
+  IN UINTN                    Count,
+  IN SLIDE_ENTROPY_SOURCE     GetEntropy
+  );
+
+/** Returns a random slide value among the valid ones, every valid slide is equally likely. */
+UINT8
+GenerateRandomSlideValue (
+  VOID
+  );
+
+/** Analyses current memory map and finds valid slide values. */
+VOID
+DecideOnCustomSlideImplementation (
+  VOID
+  );
+
+#endif // APTIOFIX_CUSTOM_SLIDE_H
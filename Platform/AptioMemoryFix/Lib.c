@@ -27,8 +27,11 @@
 #include <Guid/FileSystemVolumeLabelInfo.h>
 
 #include "Config.h"
+#include "CustomSlide.h"
 #include "Lib.h"
+#include "MemoryMap.h"
 #include "ServiceOverrides.h"
+#include "UmmMalloc/UmmMalloc.h"
 
 CHAR16 *mEfiMemoryTypeDesc[EfiMaxMemoryType] = {
   L"Reserved",
@@ -224,68 +227,6 @@ StriStartsWithBasic(
   return Result;
 }
 
-VOID
-EFIAPI
-ShrinkMemMap (
-  IN UINTN                    *MemoryMapSize,
-  IN EFI_MEMORY_DESCRIPTOR    *MemoryMap,
-  IN UINTN                    DescriptorSize
-  )
-{
-  UINTN                   SizeFromDescToEnd;
-  UINT64                  Bytes;
-  EFI_MEMORY_DESCRIPTOR   *PrevDesc;
-  EFI_MEMORY_DESCRIPTOR   *Desc;
-  BOOLEAN                 CanBeJoined;
-  BOOLEAN                 HasEntriesToRemove;
-
-  PrevDesc           = MemoryMap;
-  Desc               = NEXT_MEMORY_DESCRIPTOR(PrevDesc, DescriptorSize);
-  SizeFromDescToEnd  = *MemoryMapSize - DescriptorSize;
-  *MemoryMapSize     = DescriptorSize;
-  HasEntriesToRemove = FALSE;
-
-  while (SizeFromDescToEnd > 0) {
-    Bytes = (((UINTN) PrevDesc->NumberOfPages) * EFI_PAGE_SIZE);
-    CanBeJoined = FALSE;
-    if (Desc->Attribute == PrevDesc->Attribute && PrevDesc->PhysicalStart + Bytes == Desc->PhysicalStart) {
-      // It *should* be safe to join this with conventional memory, because the firmware should not use
-      // GetMemoryMap for allocation, and for the kernel it does not matter, since it joins them.
-      CanBeJoined = (Desc->Type == EfiBootServicesCode ||
-        Desc->Type == EfiBootServicesData ||
-        Desc->Type == EfiConventionalMemory ||
-        Desc->Type == EfiLoaderCode ||
-        Desc->Type == EfiLoaderData) && (
-        PrevDesc->Type == EfiBootServicesCode ||
-        PrevDesc->Type == EfiBootServicesData ||
-        PrevDesc->Type == EfiConventionalMemory ||
-        PrevDesc->Type == EfiLoaderCode ||
-        PrevDesc->Type == EfiLoaderData);
-    }
-
-    if (CanBeJoined) {
-      // two entries are the same/similar - join them
-      PrevDesc->Type = EfiConventionalMemory;
-      PrevDesc->NumberOfPages += Desc->NumberOfPages;
-      HasEntriesToRemove = TRUE;
-    } else {
-      // can not be joined - we need to move to next
-      *MemoryMapSize += DescriptorSize;
-      PrevDesc = NEXT_MEMORY_DESCRIPTOR(PrevDesc, DescriptorSize);
-      if (HasEntriesToRemove) {
-        // have entries between PrevDesc and Desc which are joined to PrevDesc
-        // we need to copy [Desc, end of list] to PrevDesc + 1
-        CopyMem(PrevDesc, Desc, SizeFromDescToEnd);
-        Desc = PrevDesc;
-        HasEntriesToRemove = FALSE;
-      }
-    }
-    // move to next
-    Desc = NEXT_MEMORY_DESCRIPTOR(Desc, DescriptorSize);
-    SizeFromDescToEnd -= DescriptorSize;
-  }
-}
-
 VOID
 EFIAPI
 PrintMemMap (
@@ -329,6 +270,57 @@ PrintMemMap (
   gBS->Stall (5000000);
 }
 
+EFI_STATUS
+EFIAPI
+SaveMemMapDump (
+  IN CONST CHAR16             *VariableName,
+  IN UINTN                    MemoryMapSize,
+  IN UINTN                    DescriptorSize,
+  IN UINT32                   DescriptorVersion,
+  IN EFI_MEMORY_DESCRIPTOR    *MemoryMap,
+  IN VOID                     *Shims,
+  IN EFI_PHYSICAL_ADDRESS     SysTable,
+  IN BOOLEAN                  VirtualMap
+  )
+{
+  EFI_STATUS              Status;
+  VOID                    *Dump;
+  UINTN                   DumpSize;
+  UINT32                  Flags;
+
+  Flags = 0;
+  if (VirtualMap)
+    Flags |= MEMMAP_DUMP_FLAG_VIRTUAL_MAP;
+  if (IsSandyOrIvy ())
+    Flags |= MEMMAP_DUMP_FLAG_SANDY_OR_IVY;
+  if (APTIOFIX_PROTECT_CSM_REGION == 1)
+    Flags |= MEMMAP_DUMP_FLAG_PROTECT_CSM;
+
+  DumpSize = GetMemMapDumpSize (MemoryMapSize);
+  Dump     = DirectAllocatePool (DumpSize);
+  if (Dump == NULL)
+    return EFI_OUT_OF_RESOURCES;
+
+  FillMemMapDump (Dump, MemoryMapSize, DescriptorSize, DescriptorVersion, MemoryMap, (UINTN)Shims, SysTable, Flags);
+
+  //
+  // Volatile variable does not wear the flash, yet is still visible from macOS with "nvram -x -p".
+  //
+  Status = gRT->SetVariable ((CHAR16 *)VariableName,
+    &gAppleBootVariableGuid,
+    EFI_VARIABLE_BOOTSERVICE_ACCESS | EFI_VARIABLE_RUNTIME_ACCESS,
+    DumpSize,
+    Dump
+    );
+
+  DirectFreePool (Dump);
+
+  if (!EFI_ERROR (Status))
+    PrintScreen (L"AMF: Stored %d descriptors in %s\n", MemoryMapSize / DescriptorSize, VariableName);
+
+  return Status;
+}
+
 VOID
 EFIAPI
 PrintSystemTable (
@@ -431,6 +423,8 @@ GetMemoryMapAlloc (
   )
 {
   EFI_STATUS               Status;
+  EFI_MEMORY_DESCRIPTOR    *NewMemoryMap;
+  UINTN                    AllocatedSize;
 
   *MemoryMapSize       = 0;
   *MemoryMap           = NULL;
@@ -447,6 +441,8 @@ GetMemoryMapAlloc (
     return Status;
   }
 
+  AllocatedSize = 0;
+
   do {
     //
     // This is done because extra allocations may increase memory map size.
@@ -472,11 +468,19 @@ GetMemoryMapAlloc (
         return Status;
       }
     } else {
-      *MemoryMap = DirectAllocatePool (*MemoryMapSize);
-      if (!*MemoryMap) {
+      //
+      // Keep the buffer from the previous attempt and let it grow, usually in place.
+      //
+      NewMemoryMap = DirectReallocatePool (*MemoryMap, AllocatedSize, *MemoryMapSize);
+      if (!NewMemoryMap) {
         DEBUG ((DEBUG_WARN, "Temp memory map direct allocation failure\n"));
+        if (*MemoryMap)
+          DirectFreePool (*MemoryMap);
+        *MemoryMap = NULL;
         return EFI_OUT_OF_RESOURCES;
       }
+      *MemoryMap    = NewMemoryMap;
+      AllocatedSize = *MemoryMapSize;
     }
 
     Status = OrgGetMemoryMap (
@@ -488,11 +492,13 @@ GetMemoryMapAlloc (
       );
 
     if (EFI_ERROR (Status)) {
-      if (AllocatedTopPages)
+      if (AllocatedTopPages) {
         gBS->FreePages ((EFI_PHYSICAL_ADDRESS)*MemoryMap, *AllocatedTopPages);
-      else
+        *MemoryMap = NULL;
+      } else if (Status != EFI_BUFFER_TOO_SMALL) {
         DirectFreePool (*MemoryMap);
-      *MemoryMap = NULL;
+        *MemoryMap = NULL;
+      }
     }
   } while (Status == EFI_BUFFER_TOO_SMALL);
 
@@ -502,71 +508,316 @@ GetMemoryMapAlloc (
   return Status;
 }
 
-/** Alloctes Pages from the top of mem, up to address specified in Memory. Returns allocated address in Memory. */
+//
+// Sorted copy of the memory map shared by our own consumers, see GetMemoryMapSnapshot.
+// The firmware map is fetched into the scratch buffer first.
+//
+STATIC EFI_MEMORY_DESCRIPTOR  *mMemoryMapScratch;
+STATIC EFI_MEMORY_DESCRIPTOR  *mMemoryMapSnapshot;
+STATIC UINTN                  mMemoryMapSnapshotSize;
+STATIC UINTN                  mMemoryMapSnapshotCapacity;
+STATIC UINTN                  mMemoryMapSnapshotDescSize;
+STATIC UINTN                  mMemoryMapSnapshotKey;
+STATIC UINTN                  mMemoryMapSnapshotGeneration;
+
+//
+// Free memory intervals built from the snapshot, see FindFreePagesFromTop.
+//
+typedef struct {
+  EFI_PHYSICAL_ADDRESS  Start;
+  EFI_PHYSICAL_ADDRESS  End;
+  UINT64                MaxSize;     // Largest interval size up to and including this one
+} FREE_INTERVAL;
+
+typedef struct {
+  FREE_INTERVAL         *Intervals;
+  UINTN                 Count;
+  UINTN                 Capacity;
+  UINTN                 Generation;  // Snapshot generation the intervals were built from
+} FREE_INTERVAL_INDEX;
+
+//
+// Index 0 has all free memory, index 1 has kernel slide ranges subtracted.
+//
+STATIC FREE_INTERVAL_INDEX    mFreeIntervals[2];
+
 EFI_STATUS
 EFIAPI
-AllocatePagesFromTop (
-  IN EFI_MEMORY_TYPE           MemoryType,
-  IN UINTN                     Pages,
-  IN OUT EFI_PHYSICAL_ADDRESS  *Memory,
-  IN BOOLEAN                   CheckRange
+GetMemoryMapSnapshot (
+  OUT UINTN                       *MemoryMapSize,
+  OUT EFI_MEMORY_DESCRIPTOR       **MemoryMap,
+  OUT UINTN                       *DescriptorSize,
+  OUT UINTN                       *MapKey  OPTIONAL
+  )
+{
+  EFI_STATUS               Status;
+  UINTN                    Size;
+  UINTN                    Key;
+  UINTN                    DescSize;
+  UINT32                   DescriptorVersion;
+
+  //
+  // DXE core allocations do not go through gBS, so the map is always fetched again
+  // into the scratch buffer and only MapKey tells whether anything changed.
+  //
+  do {
+    Size   = mMemoryMapSnapshotCapacity;
+    Status = OrgGetMemoryMap (
+      &Size,
+      mMemoryMapScratch,
+      &Key,
+      &DescSize,
+      &DescriptorVersion
+      );
+
+    if (Status == EFI_BUFFER_TOO_SMALL) {
+      //
+      // Leave some room, so that the following allocations do not make us grow again.
+      // Scratch and snapshot buffers share one allocation.
+      //
+      if (mMemoryMapScratch)
+        DirectFreePool (mMemoryMapScratch);
+      mMemoryMapSnapshotSize     = 0;
+      mMemoryMapSnapshotCapacity = Size + EFI_PAGE_SIZE;
+      mMemoryMapScratch          = DirectAllocatePool (mMemoryMapSnapshotCapacity * 2);
+      if (!mMemoryMapScratch) {
+        DEBUG ((DEBUG_WARN, "Memory map snapshot allocation failure\n"));
+        mMemoryMapSnapshotCapacity = 0;
+        mMemoryMapSnapshot         = NULL;
+        return EFI_OUT_OF_RESOURCES;
+      }
+      mMemoryMapSnapshot = (EFI_MEMORY_DESCRIPTOR *)((UINT8 *)mMemoryMapScratch + mMemoryMapSnapshotCapacity);
+    }
+  } while (Status == EFI_BUFFER_TOO_SMALL);
+
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_WARN, "Failed to obtain memory map snapshot %r\n", Status));
+    mMemoryMapSnapshotSize = 0;
+    return Status;
+  }
+
+  //
+  // With an unchanged MapKey the sorted snapshot and the free interval index are still current.
+  //
+  if (mMemoryMapSnapshotSize != Size || mMemoryMapSnapshotKey != Key) {
+    CopyMem (mMemoryMapSnapshot, mMemoryMapScratch, Size);
+    SortMemoryMap (Size, mMemoryMapSnapshot, DescSize);
+    mMemoryMapSnapshotGeneration++;
+    mMemoryMapSnapshotSize     = Size;
+    mMemoryMapSnapshotDescSize = DescSize;
+    mMemoryMapSnapshotKey      = Key;
+  }
+
+  *MemoryMapSize  = mMemoryMapSnapshotSize;
+  *MemoryMap      = mMemoryMapSnapshot;
+  *DescriptorSize = mMemoryMapSnapshotDescSize;
+  if (MapKey)
+    *MapKey = mMemoryMapSnapshotKey;
+
+  return EFI_SUCCESS;
+}
+
+/** Appends free interval [Start, End) to Index, subtracting kernel slide ranges if requested. */
+STATIC
+VOID
+AddFreeInterval (
+  IN OUT FREE_INTERVAL_INDEX      *Index,
+  IN     EFI_PHYSICAL_ADDRESS     Start,
+  IN     EFI_PHYSICAL_ADDRESS     End,
+  IN     BOOLEAN                  ExcludeSlide
+  )
+{
+  EFI_PHYSICAL_ADDRESS    SlideStarts[KERNEL_SLIDE_RANGES_MAX];
+  EFI_PHYSICAL_ADDRESS    SlideEnds[KERNEL_SLIDE_RANGES_MAX];
+  UINTN                   NumRanges;
+  UINTN                   Range;
+  EFI_PHYSICAL_ADDRESS    PieceEnd;
+  FREE_INTERVAL           *Interval;
+  UINT64                  PrevMaxSize;
+
+  NumRanges = ExcludeSlide ? GetKernelSlideRanges (SlideStarts, SlideEnds) : 0;
+
+  //
+  // Slide ranges are sorted and OverlapsWithSlide treats touching areas as overlapping,
+  // so each range removes [SlideStart - 1, SlideEnd + 1) before page alignment.
+  //
+  for (Range = 0; Range <= NumRanges && Start < End; Range++) {
+    PieceEnd = End;
+    if (Range < NumRanges) {
+      if (SlideEnds[Range] < Start)
+        continue;
+      PieceEnd = MIN (End, SlideStarts[Range] - 1);
+    }
+
+    Start    = ALIGN_VALUE (Start, EFI_PAGE_SIZE);
+    PieceEnd = PieceEnd & ~((EFI_PHYSICAL_ADDRESS)EFI_PAGE_MASK);
+
+    if (Start < PieceEnd) {
+      PrevMaxSize       = Index->Count > 0 ? Index->Intervals[Index->Count - 1].MaxSize : 0;
+      Interval          = &Index->Intervals[Index->Count++];
+      Interval->Start   = Start;
+      Interval->End     = PieceEnd;
+      Interval->MaxSize = MAX (PrevMaxSize, PieceEnd - Start);
+    }
+
+    if (Range < NumRanges)
+      Start = MAX (Start, SlideEnds[Range] + 1);
+  }
+}
+
+/** Returns an index of free memory intervals for the current memory map snapshot. */
+STATIC
+EFI_STATUS
+GetFreeIntervals (
+  IN  BOOLEAN                     ExcludeSlide,
+  OUT FREE_INTERVAL_INDEX         **FreeIndex
   )
 {
   EFI_STATUS              Status;
+  FREE_INTERVAL_INDEX     *Index;
   UINTN                   MemoryMapSize;
   EFI_MEMORY_DESCRIPTOR   *MemoryMap;
-  UINTN                   MapKey;
   UINTN                   DescriptorSize;
-  UINT32                  DescriptorVersion;
   EFI_MEMORY_DESCRIPTOR   *MemoryMapEnd;
   EFI_MEMORY_DESCRIPTOR   *Desc;
+  UINTN                   Capacity;
+  EFI_PHYSICAL_ADDRESS    RunStart;
+  EFI_PHYSICAL_ADDRESS    RunEnd;
 
-  Status = GetMemoryMapAlloc (NULL, &MemoryMapSize, &MemoryMap, &MapKey, &DescriptorSize, &DescriptorVersion);
+  Status = GetMemoryMapSnapshot (&MemoryMapSize, &MemoryMap, &DescriptorSize, NULL);
   if (EFI_ERROR (Status))
     return Status;
 
-  Status = EFI_NOT_FOUND;
+  Index = &mFreeIntervals[ExcludeSlide ? 1 : 0];
+  *FreeIndex = Index;
+
+  if (Index->Intervals != NULL && Index->Generation == mMemoryMapSnapshotGeneration)
+    return EFI_SUCCESS;
+
+  //
+  // Every run of free descriptors is split by at most KERNEL_SLIDE_RANGES_MAX ranges.
+  //
+  Capacity = (MemoryMapSize / DescriptorSize) * (KERNEL_SLIDE_RANGES_MAX + 1);
+  if (Capacity > Index->Capacity) {
+    if (Index->Intervals != NULL)
+      DirectFreePool (Index->Intervals);
+    Index->Capacity  = Capacity + 32;
+    Index->Intervals = DirectAllocatePool (Index->Capacity * sizeof (FREE_INTERVAL));
+    if (Index->Intervals == NULL) {
+      Index->Capacity = 0;
+      return EFI_OUT_OF_RESOURCES;
+    }
+  }
 
+  //
+  // The snapshot is sorted, so adjacent free descriptors are joined into runs on the fly.
+  //
+  Index->Count = 0;
+  RunStart     = 0;
+  RunEnd       = 0;
   MemoryMapEnd = NEXT_MEMORY_DESCRIPTOR (MemoryMap, MemoryMapSize);
-  Desc = PREV_MEMORY_DESCRIPTOR (MemoryMapEnd, DescriptorSize);
 
-  for ( ; Desc >= MemoryMap; Desc = PREV_MEMORY_DESCRIPTOR (Desc, DescriptorSize)) {
-    //
-    // We are looking for some free memory descriptor that contains enough space below the specified memory
-    // 
-    if (Desc->Type == EfiConventionalMemory && Pages <= Desc->NumberOfPages &&
-      Desc->PhysicalStart + EFI_PAGES_TO_SIZE (Pages) <= *Memory) {
-      //
-      // Free block found
-      //
-      if (Desc->PhysicalStart + EFI_PAGES_TO_SIZE ((UINTN)Desc->NumberOfPages) <= *Memory) {
-        //
-        // The whole block is under Memory - allocate from the top of the block
-        //
-        *Memory = Desc->PhysicalStart + EFI_PAGES_TO_SIZE ((UINTN)Desc->NumberOfPages - Pages);
-      } else {
-        //
-        // The block contains enough pages under Memory, but spans above it - allocate below Memory
-        //
-        *Memory = *Memory - EFI_PAGES_TO_SIZE (Pages);
-      }
-      //
-      // Ensure that the found block does not overlap with the kernel area
-      //
-      if (CheckRange && OverlapsWithSlide (*Memory, EFI_PAGES_TO_SIZE (Pages)))
-        continue;
+  for (Desc = MemoryMap; Desc < MemoryMapEnd; Desc = NEXT_MEMORY_DESCRIPTOR (Desc, DescriptorSize)) {
+    if (Desc->Type != EfiConventionalMemory || Desc->NumberOfPages == 0)
+      continue;
 
-      Status = gBS->AllocatePages (
-        AllocateAddress,
-        MemoryType,
-        Pages,
-        Memory
-        );
-      break;
+    if (Desc->PhysicalStart != RunEnd || RunStart == RunEnd) {
+      if (RunStart < RunEnd)
+        AddFreeInterval (Index, RunStart, RunEnd, ExcludeSlide);
+      RunStart = Desc->PhysicalStart;
+    }
+
+    RunEnd = Desc->PhysicalStart + EFI_PAGES_TO_SIZE ((UINTN)Desc->NumberOfPages);
+  }
+
+  if (RunStart < RunEnd)
+    AddFreeInterval (Index, RunStart, RunEnd, ExcludeSlide);
+
+  Index->Generation = mMemoryMapSnapshotGeneration;
+
+  return EFI_SUCCESS;
+}
+
+/** Finds the highest Pages long free area ending at or below MaxAddress. */
+STATIC
+BOOLEAN
+FindFreePagesFromTop (
+  IN  FREE_INTERVAL_INDEX         *Index,
+  IN  UINTN                       Pages,
+  IN  EFI_PHYSICAL_ADDRESS        MaxAddress,
+  OUT EFI_PHYSICAL_ADDRESS        *Memory
+  )
+{
+  UINT64                  Size;
+  UINTN                   Low;
+  UINTN                   High;
+  UINTN                   Middle;
+  EFI_PHYSICAL_ADDRESS    Top;
+
+  Size       = EFI_PAGES_TO_SIZE (Pages);
+  MaxAddress = MaxAddress & ~((EFI_PHYSICAL_ADDRESS)EFI_PAGE_MASK);
+
+  //
+  // Find the first interval starting at or above MaxAddress, all the candidates are below it.
+  //
+  Low  = 0;
+  High = Index->Count;
+  while (Low < High) {
+    Middle = (Low + High) / 2;
+    if (Index->Intervals[Middle].Start < MaxAddress)
+      Low = Middle + 1;
+    else
+      High = Middle;
+  }
+
+  //
+  // MaxSize only grows with the index, so the search stops once nothing below can fit.
+  //
+  while (Low > 0 && Index->Intervals[Low - 1].MaxSize >= Size) {
+    Low--;
+    Top = MIN (Index->Intervals[Low].End, MaxAddress);
+    if (Top - Index->Intervals[Low].Start >= Size) {
+      *Memory = Top - Size;
+      return TRUE;
     }
   }
 
-  DirectFreePool (MemoryMap);
+  return FALSE;
+}
+
+/** Alloctes Pages from the top of mem, up to address specified in Memory. Returns allocated address in Memory. */
+EFI_STATUS
+EFIAPI
+AllocatePagesFromTop (
+  IN EFI_MEMORY_TYPE           MemoryType,
+  IN UINTN                     Pages,
+  IN OUT EFI_PHYSICAL_ADDRESS  *Memory,
+  IN BOOLEAN                   CheckRange
+  )
+{
+  EFI_STATUS              Status;
+  FREE_INTERVAL_INDEX     *Index;
+  EFI_PHYSICAL_ADDRESS    MaxAddress;
+  EFI_PHYSICAL_ADDRESS    Address;
+
+  MaxAddress = *Memory;
+
+  Status = GetFreeIntervals (CheckRange, &Index);
+  if (EFI_ERROR (Status))
+    return Status;
+
+  if (!FindFreePagesFromTop (Index, Pages, MaxAddress, &Address))
+    return EFI_NOT_FOUND;
+
+  Status = gBS->AllocatePages (
+    AllocateAddress,
+    MemoryType,
+    Pages,
+    &Address
+    );
+
+  if (!EFI_ERROR (Status))
+    *Memory = Address;
 
   return Status;
 }
@@ -683,3 +934,32 @@ DirectFreePool (
 {
   gBS->FreePool (Buffer);
 }
+
+/** Resize memory allocated by DirectAllocatePool, in place when possible. Buffer is freed on success. */
+VOID *
+DirectReallocatePool (
+  VOID      *Buffer,
+  UINTN     OldSize,
+  UINTN     NewSize
+  )
+{
+  VOID               *NewBuffer;
+
+  //
+  // Custom allocator buffers may grow in place, anything else has to be copied.
+  // UmmRealloc leaves Buffer intact if it fails or if it is not ours.
+  //
+  if (Buffer != NULL && NewSize <= MAX_UINT32) {
+    NewBuffer = UmmRealloc (Buffer, (UINT32)NewSize);
+    if (NewBuffer != NULL)
+      return NewBuffer;
+  }
+
+  NewBuffer = DirectAllocatePool (NewSize);
+  if (NewBuffer != NULL && Buffer != NULL) {
+    CopyMem (NewBuffer, Buffer, MIN (OldSize, NewSize));
+    DirectFreePool (Buffer);
+  }
+
+  return NewBuffer;
+}
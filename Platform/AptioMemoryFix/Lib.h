@@ -69,15 +69,6 @@ StrStriBasic (
   IN CONST CHAR16 *SearchString
   );
 
-/** Shrinks mem map by joining EfiBootServicesCode and EfiBootServicesData records. */
-VOID
-EFIAPI
-ShrinkMemMap (
-  IN UINTN                    *MemoryMapSize,
-  IN EFI_MEMORY_DESCRIPTOR    *MemoryMap,
-  IN UINTN                    DescriptorSize
-  );
-
 /** Prints mem map. */
 VOID
 EFIAPI
@@ -90,6 +81,22 @@ PrintMemMap (
   IN EFI_PHYSICAL_ADDRESS     SysTable
   );
 
+/** Stores mem map as a binary dump (see MEMMAP_DUMP_HEADER) in a volatile variable.
+ *  Unlike PrintMemMap it does not stall, and the dump can be analysed with Utilities/MemMapTool.
+ */
+EFI_STATUS
+EFIAPI
+SaveMemMapDump (
+  IN CONST CHAR16             *VariableName,
+  IN UINTN                    MemoryMapSize,
+  IN UINTN                    DescriptorSize,
+  IN UINT32                   DescriptorVersion,
+  IN EFI_MEMORY_DESCRIPTOR    *MemoryMap,
+  IN VOID                     *Shims,
+  IN EFI_PHYSICAL_ADDRESS     SysTable,
+  IN BOOLEAN                  VirtualMap
+  );
+
 /** Prints some values from Sys table and Runt. services. */
 VOID
 EFIAPI
@@ -122,6 +129,20 @@ GetMemoryMapAlloc (
   OUT UINT32                  *DescriptorVersion
   );
 
+/** Returns a sorted snapshot of mem map shared by our own consumers.
+ *  The map is fetched again on every call, it is only sorted again when firmware MapKey changed.
+ *  The snapshot must not be modified or freed, and is only valid until the next allocation.
+ *  Use GetMemoryMapAlloc when the map is passed on or its MapKey must be current.
+ */
+EFI_STATUS
+EFIAPI
+GetMemoryMapSnapshot (
+  OUT UINTN                   *MemoryMapSize,
+  OUT EFI_MEMORY_DESCRIPTOR   **MemoryMap,
+  OUT UINTN                   *DescriptorSize,
+  OUT UINTN                   *MapKey  OPTIONAL
+  );
+
 /** Alloctes pages from the top of mem, up to address specified in Memory. Returns allocated address in Memory. */
 EFI_STATUS
 EFIAPI
@@ -132,14 +153,6 @@ AllocatePagesFromTop (
   IN BOOLEAN                  CheckRange
   );
 
-/** Checks whether the area overlaps with a possible kernel image area
- TODO: move to a separate CustomSlide file... */
-BOOLEAN
-OverlapsWithSlide (
-  EFI_PHYSICAL_ADDRESS   Address,
-  UINTN                  Size
-  );
-
 /** Helper function to call ExitBootServices that can handle outdated MapKey issues. */
 EFI_STATUS
 ForceExitBootServices (
@@ -168,4 +181,12 @@ DirectFreePool (
   VOID      *Buffer
   );
 
+/** Resize memory allocated by DirectAllocatePool, in place when possible. Buffer is freed on success. */
+VOID *
+DirectReallocatePool (
+  VOID      *Buffer,
+  UINTN     OldSize,
+  UINTN     NewSize
+  );
+
 #endif // APTIOFIX_LIB_H
@@ -0,0 +1,616 @@
+/**
+
+  Memory map processing shared with the host tools.
+  Nothing here calls boot or runtime services.
+
+**/
+
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/DebugLib.h>
+
+#include "Config.h"
+#include "Lib.h"
+#include "MemoryMap.h"
+
+RT_RELOC_PROTECT_DATA gRelocInfoData;
+
+/** Returns TRUE if Desc is a CSM region that needs protection.
+ *
+ *  AMI CSM module allocates up to two regions for legacy video output.
+ *  1. For PMM and EBDA areas.
+ *     On Ivy Bridge and below it ends at 0xA0000-0x1000-0x1 and has EfiBootServicesCode type.
+ *     On Haswell and above it is allocated below 0xA0000 address with the same type.
+ *  2. For Intel RC S3 reserved area, fixed from 0x9F000 to 0x9FFFF.
+ *     On Sandy Bridge and below it is not present in memory map.
+ *     On Ivy Bridge and newer it is present as EfiRuntimeServicesData.
+ *     Starting from at least SkyLake it is present as EfiReservedMemoryType.
+ *
+ *  Prior to AptioMemoryFix EfiRuntimeServicesData could have been relocated by boot.efi,
+ *  and the 2nd region could have been overwritten by the kernel. Now it is no longer the
+ *  case, and only the 1st region may need special handling.
+ *
+ *  For the 1st region there appear to be (unconfirmed) reports that it may still be accessed
+ *  after waking from sleep. This does not seem to be valid according to AMI code, but we still
+ *  protect it in case such systems really exist.
+ *
+ *  Researched and fixed on gigabyte boards by Slice
+ */
+STATIC
+BOOLEAN
+IsCsmRegion (
+  IN EFI_MEMORY_DESCRIPTOR    *Desc
+  )
+{
+  UINTN                   PhysicalEnd;
+
+  PhysicalEnd = (UINTN)Desc->PhysicalStart + EFI_PAGES_TO_SIZE ((UINTN)Desc->NumberOfPages);
+
+  return PhysicalEnd >= 0x9E000 && PhysicalEnd < 0xA0000 && Desc->Type == EfiBootServicesData;
+}
+
+/** Returns TRUE if memory of this type is free for the kernel and may be joined. */
+STATIC
+BOOLEAN
+IsJoinableMemType (
+  IN EFI_MEMORY_TYPE          Type
+  )
+{
+  return Type == EfiBootServicesCode ||
+    Type == EfiBootServicesData ||
+    Type == EfiConventionalMemory ||
+    Type == EfiLoaderCode ||
+    Type == EfiLoaderData;
+}
+
+VOID
+EFIAPI
+ShrinkMemMap (
+  IN OUT UINTN                *MemoryMapSize,
+  IN OUT EFI_MEMORY_DESCRIPTOR *MemoryMap,
+  IN UINTN                    DescriptorSize,
+  IN BOOLEAN                  ProtectCsm
+  )
+{
+  UINTN                   NumEntries;
+  UINTN                   Index;
+  EFI_MEMORY_DESCRIPTOR   *WriteDesc;
+  EFI_MEMORY_DESCRIPTOR   *ReadDesc;
+
+  if (*MemoryMapSize < DescriptorSize) {
+    return;
+  }
+
+  //
+  // Descriptors are read once and written back through a trailing cursor,
+  // so removing joined entries never needs to move the rest of the map.
+  //
+  NumEntries = *MemoryMapSize / DescriptorSize;
+  WriteDesc  = MemoryMap;
+  ReadDesc   = MemoryMap;
+
+  for (Index = 0; Index < NumEntries; Index++) {
+    if (ProtectCsm && IsCsmRegion (ReadDesc)) {
+      ReadDesc->Type = EfiACPIMemoryNVS;
+      ProtectCsm = FALSE;
+    }
+
+    // It *should* be safe to join this with conventional memory, because the firmware should not use
+    // GetMemoryMap for allocation, and for the kernel it does not matter, since it joins them.
+    if (Index > 0
+      && ReadDesc->Attribute == WriteDesc->Attribute
+      && WriteDesc->PhysicalStart + EFI_PAGES_TO_SIZE ((UINTN)WriteDesc->NumberOfPages) == ReadDesc->PhysicalStart
+      && IsJoinableMemType (ReadDesc->Type)
+      && IsJoinableMemType (WriteDesc->Type)) {
+      WriteDesc->Type = EfiConventionalMemory;
+      WriteDesc->NumberOfPages += ReadDesc->NumberOfPages;
+    } else {
+      if (Index > 0) {
+        WriteDesc = NEXT_MEMORY_DESCRIPTOR (WriteDesc, DescriptorSize);
+      }
+      if (WriteDesc != ReadDesc) {
+        CopyMem (WriteDesc, ReadDesc, DescriptorSize);
+      }
+    }
+
+    ReadDesc = NEXT_MEMORY_DESCRIPTOR (ReadDesc, DescriptorSize);
+  }
+
+  *MemoryMapSize = (UINTN)WriteDesc - (UINTN)MemoryMap + DescriptorSize;
+}
+
+/** Swaps two memory descriptors of DescriptorSize bytes. */
+STATIC
+VOID
+SwapMemoryDescriptors (
+  IN OUT EFI_MEMORY_DESCRIPTOR    *Desc1,
+  IN OUT EFI_MEMORY_DESCRIPTOR    *Desc2,
+  IN     UINTN                    DescriptorSize
+  )
+{
+  UINT64                  *Ptr1;
+  UINT64                  *Ptr2;
+  UINT64                  Tmp;
+  UINTN                   Index;
+
+  Ptr1 = (UINT64 *)Desc1;
+  Ptr2 = (UINT64 *)Desc2;
+
+  for (Index = 0; Index < DescriptorSize / sizeof (UINT64); Index++) {
+    Tmp         = Ptr1[Index];
+    Ptr1[Index] = Ptr2[Index];
+    Ptr2[Index] = Tmp;
+  }
+}
+
+/** Returns the descriptor at Index in mem map of DescriptorSize strides. */
+#define MEMORY_DESCRIPTOR_AT(MemoryMap, Index, Size) \
+  ((EFI_MEMORY_DESCRIPTOR *)((UINT8 *)(MemoryMap) + (Index) * (Size)))
+
+/** Ranges this short are sorted with insertion sort. */
+#define MEMORY_MAP_SORT_SMALL  16
+
+/** Sorts descriptors Lo to Hi inclusive with insertion sort. */
+STATIC
+VOID
+InsertionSortMemoryMap (
+  IN OUT EFI_MEMORY_DESCRIPTOR    *MemoryMap,
+  IN     UINTN                    DescriptorSize,
+  IN     UINTN                    Lo,
+  IN     UINTN                    Hi
+  )
+{
+  EFI_MEMORY_DESCRIPTOR   *First;
+  EFI_MEMORY_DESCRIPTOR   *Desc;
+  EFI_MEMORY_DESCRIPTOR   *Prev;
+  EFI_MEMORY_DESCRIPTOR   *Curr;
+  EFI_MEMORY_DESCRIPTOR   *Last;
+
+  First = MEMORY_DESCRIPTOR_AT (MemoryMap, Lo, DescriptorSize);
+  Last  = MEMORY_DESCRIPTOR_AT (MemoryMap, Hi, DescriptorSize);
+
+  for (Desc = First; Desc <= Last; Desc = NEXT_MEMORY_DESCRIPTOR (Desc, DescriptorSize)) {
+    Curr = Desc;
+    while (Curr > First) {
+      Prev = PREV_MEMORY_DESCRIPTOR (Curr, DescriptorSize);
+      if (Prev->PhysicalStart <= Curr->PhysicalStart)
+        break;
+      SwapMemoryDescriptors (Prev, Curr, DescriptorSize);
+      Curr = Prev;
+    }
+  }
+}
+
+/** Sorts descriptors Lo to Hi inclusive with heap sort, used when quick sort degrades. */
+STATIC
+VOID
+HeapSortMemoryMap (
+  IN OUT EFI_MEMORY_DESCRIPTOR    *MemoryMap,
+  IN     UINTN                    DescriptorSize,
+  IN     UINTN                    Lo,
+  IN     UINTN                    Hi
+  )
+{
+  EFI_MEMORY_DESCRIPTOR   *Base;
+  UINTN                   Count;
+  UINTN                   Start;
+  UINTN                   End;
+  UINTN                   Root;
+  UINTN                   Child;
+
+  Base  = MEMORY_DESCRIPTOR_AT (MemoryMap, Lo, DescriptorSize);
+  Count = Hi - Lo + 1;
+
+  //
+  // Build a max heap, then move the largest descriptor to the end one by one.
+  //
+  for (Start = Count / 2; Start-- > 0;) {
+    for (Root = Start; (Child = 2 * Root + 1) < Count; Root = Child) {
+      if (Child + 1 < Count
+        && MEMORY_DESCRIPTOR_AT (Base, Child, DescriptorSize)->PhysicalStart
+          < MEMORY_DESCRIPTOR_AT (Base, Child + 1, DescriptorSize)->PhysicalStart)
+        Child++;
+      if (MEMORY_DESCRIPTOR_AT (Base, Root, DescriptorSize)->PhysicalStart
+        >= MEMORY_DESCRIPTOR_AT (Base, Child, DescriptorSize)->PhysicalStart)
+        break;
+      SwapMemoryDescriptors (MEMORY_DESCRIPTOR_AT (Base, Root, DescriptorSize),
+        MEMORY_DESCRIPTOR_AT (Base, Child, DescriptorSize), DescriptorSize);
+    }
+  }
+
+  for (End = Count - 1; End > 0; End--) {
+    SwapMemoryDescriptors (Base, MEMORY_DESCRIPTOR_AT (Base, End, DescriptorSize), DescriptorSize);
+    for (Root = 0; (Child = 2 * Root + 1) < End; Root = Child) {
+      if (Child + 1 < End
+        && MEMORY_DESCRIPTOR_AT (Base, Child, DescriptorSize)->PhysicalStart
+          < MEMORY_DESCRIPTOR_AT (Base, Child + 1, DescriptorSize)->PhysicalStart)
+        Child++;
+      if (MEMORY_DESCRIPTOR_AT (Base, Root, DescriptorSize)->PhysicalStart
+        >= MEMORY_DESCRIPTOR_AT (Base, Child, DescriptorSize)->PhysicalStart)
+        break;
+      SwapMemoryDescriptors (MEMORY_DESCRIPTOR_AT (Base, Root, DescriptorSize),
+        MEMORY_DESCRIPTOR_AT (Base, Child, DescriptorSize), DescriptorSize);
+    }
+  }
+}
+
+/** Partitions descriptors Lo to Hi inclusive around the median of the first, middle and last ones.
+ *  Returns the index of the last descriptor in the lower part, which is always below Hi.
+ */
+STATIC
+UINTN
+PartitionMemoryMap (
+  IN OUT EFI_MEMORY_DESCRIPTOR    *MemoryMap,
+  IN     UINTN                    DescriptorSize,
+  IN     UINTN                    Lo,
+  IN     UINTN                    Hi
+  )
+{
+  EFI_MEMORY_DESCRIPTOR   *LoDesc;
+  EFI_MEMORY_DESCRIPTOR   *MidDesc;
+  EFI_MEMORY_DESCRIPTOR   *HiDesc;
+  EFI_PHYSICAL_ADDRESS    Pivot;
+
+  LoDesc  = MEMORY_DESCRIPTOR_AT (MemoryMap, Lo, DescriptorSize);
+  MidDesc = MEMORY_DESCRIPTOR_AT (MemoryMap, Lo + (Hi - Lo) / 2, DescriptorSize);
+  HiDesc  = MEMORY_DESCRIPTOR_AT (MemoryMap, Hi, DescriptorSize);
+
+  if (MidDesc->PhysicalStart < LoDesc->PhysicalStart)
+    SwapMemoryDescriptors (MidDesc, LoDesc, DescriptorSize);
+  if (HiDesc->PhysicalStart < LoDesc->PhysicalStart)
+    SwapMemoryDescriptors (HiDesc, LoDesc, DescriptorSize);
+  if (HiDesc->PhysicalStart < MidDesc->PhysicalStart)
+    SwapMemoryDescriptors (HiDesc, MidDesc, DescriptorSize);
+
+  //
+  // Hoare partitioning, the middle pivot value keeps both parts non-empty.
+  //
+  Pivot = MidDesc->PhysicalStart;
+
+  while (TRUE) {
+    while (LoDesc->PhysicalStart < Pivot)
+      LoDesc = NEXT_MEMORY_DESCRIPTOR (LoDesc, DescriptorSize);
+    while (HiDesc->PhysicalStart > Pivot)
+      HiDesc = PREV_MEMORY_DESCRIPTOR (HiDesc, DescriptorSize);
+    if (LoDesc >= HiDesc)
+      return ((UINTN)HiDesc - (UINTN)MemoryMap) / DescriptorSize;
+    SwapMemoryDescriptors (LoDesc, HiDesc, DescriptorSize);
+    LoDesc = NEXT_MEMORY_DESCRIPTOR (LoDesc, DescriptorSize);
+    HiDesc = PREV_MEMORY_DESCRIPTOR (HiDesc, DescriptorSize);
+  }
+}
+
+/** Sorts descriptors Lo to Hi inclusive with introsort, falling back to heap sort after DepthLimit partitions. */
+STATIC
+VOID
+IntroSortMemoryMap (
+  IN OUT EFI_MEMORY_DESCRIPTOR    *MemoryMap,
+  IN     UINTN                    DescriptorSize,
+  IN     UINTN                    Lo,
+  IN     UINTN                    Hi,
+  IN     UINTN                    DepthLimit
+  )
+{
+  UINTN                   Split;
+
+  //
+  // Recurse into the smaller part only, so that stack usage stays logarithmic.
+  //
+  while (Hi - Lo + 1 > MEMORY_MAP_SORT_SMALL) {
+    if (DepthLimit == 0) {
+      HeapSortMemoryMap (MemoryMap, DescriptorSize, Lo, Hi);
+      return;
+    }
+    DepthLimit--;
+
+    Split = PartitionMemoryMap (MemoryMap, DescriptorSize, Lo, Hi);
+    if (Split - Lo < Hi - Split) {
+      IntroSortMemoryMap (MemoryMap, DescriptorSize, Lo, Split, DepthLimit);
+      Lo = Split + 1;
+    } else {
+      IntroSortMemoryMap (MemoryMap, DescriptorSize, Split + 1, Hi, DepthLimit);
+      Hi = Split;
+    }
+  }
+
+  InsertionSortMemoryMap (MemoryMap, DescriptorSize, Lo, Hi);
+}
+
+VOID
+EFIAPI
+SortMemoryMap (
+  IN     UINTN                    MemoryMapSize,
+  IN OUT EFI_MEMORY_DESCRIPTOR    *MemoryMap,
+  IN     UINTN                    DescriptorSize
+  )
+{
+  UINTN                   NumEntries;
+  UINTN                   Index;
+  EFI_MEMORY_DESCRIPTOR   *Desc;
+  EFI_MEMORY_DESCRIPTOR   *Next;
+
+  NumEntries = MemoryMapSize / DescriptorSize;
+  if (NumEntries < 2)
+    return;
+
+  //
+  // Most firmwares return sorted maps, which only need to be checked.
+  //
+  Desc = MemoryMap;
+  for (Index = 1; Index < NumEntries; Index++) {
+    Next = NEXT_MEMORY_DESCRIPTOR (Desc, DescriptorSize);
+    if (Next->PhysicalStart < Desc->PhysicalStart)
+      break;
+    Desc = Next;
+  }
+
+  if (Index == NumEntries)
+    return;
+
+  //
+  // Descriptors are swapped in place in DescriptorSize strides, so vendor fields past
+  // EFI_MEMORY_DESCRIPTOR stay with their descriptor and no extra buffer is needed.
+  //
+  IntroSortMemoryMap (MemoryMap, DescriptorSize, 0, NumEntries - 1, 2 * (UINTN)HighBitSet64 (NumEntries));
+}
+
+/** Sifts Targets[Root] down the max-heap of End targets. */
+STATIC
+VOID
+SiftDownMemoryMapTarget (
+  IN OUT MEMORY_MAP_TARGET      *Targets,
+  IN     UINTN                  Root,
+  IN     UINTN                  End
+  )
+{
+  MEMORY_MAP_TARGET       Tmp;
+  UINTN                   Child;
+
+  while ((Child = 2 * Root + 1) < End) {
+    if (Child + 1 < End && Targets[Child].Address < Targets[Child + 1].Address)
+      Child++;
+    if (Targets[Root].Address >= Targets[Child].Address)
+      break;
+    Tmp             = Targets[Root];
+    Targets[Root]   = Targets[Child];
+    Targets[Child]  = Tmp;
+    Root            = Child;
+  }
+}
+
+VOID
+SortMemoryMapTargets (
+  IN OUT MEMORY_MAP_TARGET      *Targets,
+  IN     UINTN                  NumTargets
+  )
+{
+  MEMORY_MAP_TARGET       Tmp;
+  UINTN                   Index;
+
+  for (Index = 1; Index < NumTargets; Index++) {
+    if (Targets[Index].Address < Targets[Index - 1].Address)
+      break;
+  }
+
+  if (Index >= NumTargets)
+    return;
+
+  //
+  // Heap sort needs neither recursion nor extra memory, which matters at kernel entry.
+  //
+  for (Index = NumTargets / 2; Index > 0; Index--) {
+    SiftDownMemoryMapTarget (Targets, Index - 1, NumTargets);
+  }
+
+  for (Index = NumTargets - 1; Index > 0; Index--) {
+    Tmp            = Targets[0];
+    Targets[0]     = Targets[Index];
+    Targets[Index] = Tmp;
+    SiftDownMemoryMapTarget (Targets, 0, Index);
+  }
+}
+
+VOID
+ResolveMemoryMapTargets (
+  IN UINTN                      MemoryMapSize,
+  IN EFI_MEMORY_DESCRIPTOR      *MemoryMap,
+  IN UINTN                      DescriptorSize,
+  IN OUT MEMORY_MAP_TARGET      *Targets,
+  IN UINTN                      NumTargets
+  )
+{
+  EFI_MEMORY_DESCRIPTOR   *Desc;
+  EFI_PHYSICAL_ADDRESS    End;
+  UINTN                   Index;
+  UINTN                   Lo;
+  UINTN                   Hi;
+  UINTN                   Mid;
+
+  for (Index = 0; Index < NumTargets; Index++) {
+    Targets[Index].Descriptor = NULL;
+  }
+
+  if (NumTargets == 0)
+    return;
+
+  Desc = MemoryMap;
+  for (Index = 0; Index < MemoryMapSize / DescriptorSize; Index++) {
+    //
+    // Find the first target at or above descriptor start.
+    //
+    Lo = 0;
+    Hi = NumTargets;
+    while (Lo < Hi) {
+      Mid = Lo + (Hi - Lo) / 2;
+      if (Targets[Mid].Address < Desc->PhysicalStart) {
+        Lo = Mid + 1;
+      } else {
+        Hi = Mid;
+      }
+    }
+
+    End = Desc->PhysicalStart + EFI_PAGES_TO_SIZE (Desc->NumberOfPages);
+    for (; Lo < NumTargets && Targets[Lo].Address < End; Lo++) {
+      Targets[Lo].Descriptor = Desc;
+    }
+
+    Desc = NEXT_MEMORY_DESCRIPTOR (Desc, DescriptorSize);
+  }
+}
+
+VOID
+RestoreRelocInfoProtectMemTypes (
+  UINTN                   MemoryMapSize,
+  UINTN                   DescriptorSize,
+  EFI_MEMORY_DESCRIPTOR   *MemoryMap
+  )
+{
+  MEMORY_MAP_TARGET       *RelocInfo;
+  UINTN                   Index;
+
+  RelocInfo = &gRelocInfoData.RelocInfo[0];
+
+  ResolveMemoryMapTargets (MemoryMapSize, MemoryMap, DescriptorSize, RelocInfo, gRelocInfoData.NumEntries);
+
+  for (Index = 0; Index < gRelocInfoData.NumEntries; Index++) {
+    //
+    // Only areas still starting at the same address are ours.
+    //
+    if (RelocInfo[Index].Descriptor != NULL && RelocInfo[Index].Descriptor->PhysicalStart == RelocInfo[Index].Address) {
+      RelocInfo[Index].Descriptor->Type = (EFI_MEMORY_TYPE)RelocInfo[Index].Context;
+    }
+  }
+}
+
+/** Protect RT data from relocation by marking them MemMapIO. Except area with EFI system table.
+ *  This one must be relocated into kernel boot image or kernel will crash (kernel accesses it
+ *  before RT areas are mapped into vm).
+ *  This fixes NVRAM issues on some boards where access to nvram after boot services is possible
+ *  only in SMM mode. RT driver passes data to SM handler through previously negotiated buffer
+ *  and this buffer must not be relocated.
+ *  Explained and examined in detail by CodeRush and night199uk:
+ *  http://www.projectosx.com/forum/index.php?showtopic=3298
+ *
+ *  It seems this does not do any harm to others where this is not needed,
+ *  so it's added as standard fix for all.
+ *
+ *  Starting with APTIO V for nvram to work not only data but could too can no longer be moved
+ *  due to the use of commbuffers. This, however, creates a memory protection issue, because
+ *  XNU maps RT data as RW and code as RX, and AMI appears use global variables in some RT drivers.
+ *  For this reason we shim (most?) affected RT services via wrapers that unset the WP bit during
+ *  the UEFI call and set it back on return.
+ *  Explained in detail by Download-Fritz and vit9696:
+ *  http://www.insanelymac.com/forum/topic/331381-aptiomemoryfix (first 2 links in particular).
+ */
+VOID
+ProtectRtMemoryFromRelocation (
+  IN UINTN                  MemoryMapSize,
+  IN UINTN                  DescriptorSize,
+  IN UINT32                 DescriptorVersion,
+  IN EFI_MEMORY_DESCRIPTOR  *MemoryMap,
+  IN EFI_PHYSICAL_ADDRESS   SysTableArea
+  )
+{
+  UINTN                   NumEntries;
+  UINTN                   Index;
+  EFI_MEMORY_DESCRIPTOR   *Desc;
+
+  MEMORY_MAP_TARGET     *RelocInfo;
+
+  Desc = MemoryMap;
+  NumEntries = MemoryMapSize / DescriptorSize;
+  DEBUG ((DEBUG_VERBOSE, "FixNvramRelocation\n"));
+
+  gRelocInfoData.NumEntries = 0;
+
+  RelocInfo = &gRelocInfoData.RelocInfo[0];
+
+  for (Index = 0; Index < NumEntries; Index++) {
+    if ((Desc->Attribute & EFI_MEMORY_RUNTIME) != 0 &&
+        (Desc->Type == EfiRuntimeServicesCode ||
+        (Desc->Type == EfiRuntimeServicesData && Desc->PhysicalStart != SysTableArea))) {
+
+      if (gRelocInfoData.NumEntries < ARRAY_SIZE (gRelocInfoData.RelocInfo)) {
+        RelocInfo->Address       = Desc->PhysicalStart;
+        RelocInfo->Context       = Desc->Type;
+        ++RelocInfo;
+        ++gRelocInfoData.NumEntries;
+      } else {
+        DEBUG ((DEBUG_WARN, " WARNING: Cannot save mem type for entry: %lx (type 0x%x)\n", Desc->PhysicalStart, (UINTN)Desc->Type));
+      }
+
+      DEBUG ((DEBUG_VERBOSE, " RT mem %lx (0x%x) -> MemMapIO\n", Desc->PhysicalStart, Desc->NumberOfPages));
+      Desc->Type = EfiMemoryMappedIO;
+    }
+
+    Desc = NEXT_MEMORY_DESCRIPTOR(Desc, DescriptorSize);
+  }
+
+  SortMemoryMapTargets (gRelocInfoData.RelocInfo, gRelocInfoData.NumEntries);
+}
+
+UINTN
+GetMemMapDumpSize (
+  IN UINTN                  MemoryMapSize
+  )
+{
+  return sizeof (MEMMAP_DUMP_HEADER) + MemoryMapSize;
+}
+
+VOID
+FillMemMapDump (
+  OUT VOID                  *Dump,
+  IN  UINTN                 MemoryMapSize,
+  IN  UINTN                 DescriptorSize,
+  IN  UINT32                DescriptorVersion,
+  IN  EFI_MEMORY_DESCRIPTOR *MemoryMap,
+  IN  UINT64                Shims,
+  IN  UINT64                SysTable,
+  IN  UINT32                Flags
+  )
+{
+  MEMMAP_DUMP_HEADER      *Header;
+
+  Header = (MEMMAP_DUMP_HEADER *)Dump;
+  Header->Signature         = MEMMAP_DUMP_SIGNATURE;
+  Header->Revision          = MEMMAP_DUMP_REVISION;
+  Header->HeaderSize        = sizeof (MEMMAP_DUMP_HEADER);
+  Header->Flags             = Flags;
+  Header->DescriptorSize    = (UINT32)DescriptorSize;
+  Header->DescriptorVersion = DescriptorVersion;
+  Header->MemoryMapSize     = MemoryMapSize;
+  Header->Shims             = Shims;
+  Header->SysTable          = SysTable;
+
+  CopyMem (Header + 1, MemoryMap, MemoryMapSize);
+}
+
+MEMMAP_DUMP_HEADER *
+ParseMemMapDump (
+  IN  VOID                  *Dump,
+  IN  UINTN                 DumpSize
+  )
+{
+  MEMMAP_DUMP_HEADER      *Header;
+
+  Header = (MEMMAP_DUMP_HEADER *)Dump;
+
+  if (DumpSize < sizeof (MEMMAP_DUMP_HEADER)
+    || Header->Signature != MEMMAP_DUMP_SIGNATURE
+    || Header->Revision != MEMMAP_DUMP_REVISION
+    || Header->HeaderSize != sizeof (MEMMAP_DUMP_HEADER)) {
+    return NULL;
+  }
+
+  //
+  // Descriptors are accessed as UINT64 arrays when sorting, and must hold at least the UEFI fields.
+  //
+  if (Header->DescriptorSize < sizeof (EFI_MEMORY_DESCRIPTOR)
+    || Header->DescriptorSize % sizeof (UINT64) != 0
+    || Header->MemoryMapSize % Header->DescriptorSize != 0
+    || Header->MemoryMapSize > DumpSize - sizeof (MEMMAP_DUMP_HEADER)) {
+    return NULL;
+  }
+
+  return Header;
+}
@@ -0,0 +1,145 @@
+/**
+
+  Memory map processing shared with the host tools.
+  Nothing here calls boot or runtime services.
+
+**/
+
+#ifndef APTIOFIX_MEMORY_MAP_H
+#define APTIOFIX_MEMORY_MAP_H
+
+/** Address looked up in mem map with ResolveMemoryMapTargets. */
+typedef struct {
+  EFI_PHYSICAL_ADDRESS  Address;
+  // Caller data, e.g. an index or a memory type
+  UINTN                 Context;
+  // Descriptor containing Address or NULL
+  EFI_MEMORY_DESCRIPTOR *Descriptor;
+} MEMORY_MAP_TARGET;
+
+/** RT areas changed by ProtectRtMemoryFromRelocation sorted by Address,
+ *  Address is the area start and Context is its original type.
+ */
+typedef struct {
+  UINTN                 NumEntries;
+  MEMORY_MAP_TARGET     RelocInfo[APTIFIX_MAX_RT_RELOC_NUM];
+} RT_RELOC_PROTECT_DATA;
+
+extern RT_RELOC_PROTECT_DATA gRelocInfoData;
+
+/** Binary mem map dump written with -aptiodump, see SaveMemMapDump.
+ *  The header is followed by MemoryMapSize bytes of raw descriptors, DescriptorSize bytes each.
+ *  All the fields have fixed sizes, so that the dump can be read by 32-bit and 64-bit tools alike.
+ */
+#define MEMMAP_DUMP_SIGNATURE  SIGNATURE_32 ('A', 'M', 'F', 'M')
+#define MEMMAP_DUMP_REVISION   1
+
+/** Map was passed to SetVirtualAddressMap and only has runtime areas */
+#define MEMMAP_DUMP_FLAG_VIRTUAL_MAP   BIT0
+/** Slides were computed for Sandy Bridge or Ivy Bridge CPU */
+#define MEMMAP_DUMP_FLAG_SANDY_OR_IVY  BIT1
+/** Driver was built with APTIOFIX_PROTECT_CSM_REGION */
+#define MEMMAP_DUMP_FLAG_PROTECT_CSM   BIT2
+
+typedef struct {
+  UINT32  Signature;
+  UINT32  Revision;
+  UINT32  HeaderSize;
+  UINT32  Flags;
+  UINT32  DescriptorSize;
+  UINT32  DescriptorVersion;
+  UINT64  MemoryMapSize;
+  UINT64  Shims;
+  UINT64  SysTable;
+} MEMMAP_DUMP_HEADER;
+
+/** Shrinks mem map by joining EfiBootServicesCode and EfiBootServicesData records.
+ *  With ProtectCsm set also marks the CSM region below 0xA0000 as EfiACPIMemoryNVS.
+ *  Both are done in a single pass without moving the rest of the map.
+ *  Only neighbouring descriptors are joined, so the map should be sorted with SortMemoryMap first.
+ */
+VOID
+EFIAPI
+ShrinkMemMap (
+  IN OUT UINTN                *MemoryMapSize,
+  IN OUT EFI_MEMORY_DESCRIPTOR *MemoryMap,
+  IN UINTN                    DescriptorSize,
+  IN BOOLEAN                  ProtectCsm
+  );
+
+/** Sorts mem map descriptors by their physical address in place, keeping DescriptorSize strides.
+ *  Sorted maps are only checked, unsorted ones are sorted with introsort.
+ */
+VOID
+EFIAPI
+SortMemoryMap (
+  IN     UINTN                  MemoryMapSize,
+  IN OUT EFI_MEMORY_DESCRIPTOR  *MemoryMap,
+  IN     UINTN                  DescriptorSize
+  );
+
+/** Sorts mem map lookup targets by Address, already sorted targets are only checked. */
+VOID
+SortMemoryMapTargets (
+  IN OUT MEMORY_MAP_TARGET      *Targets,
+  IN     UINTN                  NumTargets
+  );
+
+/** Sets Descriptor of every target to the mem map descriptor containing its Address, or NULL.
+ *  Targets must be sorted with SortMemoryMapTargets, while the map may be unsorted and is not changed.
+ *  Every descriptor is looked up with a binary search, which takes O(n log m) for n descriptors and m targets.
+ */
+VOID
+ResolveMemoryMapTargets (
+  IN UINTN                      MemoryMapSize,
+  IN EFI_MEMORY_DESCRIPTOR      *MemoryMap,
+  IN UINTN                      DescriptorSize,
+  IN OUT MEMORY_MAP_TARGET      *Targets,
+  IN UINTN                      NumTargets
+  );
+
+/** Marks RT areas except SysTableArea with EFI system table as MemMapIO, remembering their types in gRelocInfoData. */
+VOID
+ProtectRtMemoryFromRelocation (
+  IN UINTN                  MemoryMapSize,
+  IN UINTN                  DescriptorSize,
+  IN UINT32                 DescriptorVersion,
+  IN EFI_MEMORY_DESCRIPTOR  *MemoryMap,
+  IN EFI_PHYSICAL_ADDRESS   SysTableArea
+  );
+
+/** Restores RT area types changed by ProtectRtMemoryFromRelocation. */
+VOID
+RestoreRelocInfoProtectMemTypes (
+  UINTN                   MemoryMapSize,
+  UINTN                   DescriptorSize,
+  EFI_MEMORY_DESCRIPTOR   *MemoryMap
+  );
+
+/** Returns the size of a mem map dump including its header. */
+UINTN
+GetMemMapDumpSize (
+  IN UINTN                  MemoryMapSize
+  );
+
+/** Writes mem map dump header followed by the descriptors to Dump of GetMemMapDumpSize bytes. */
+VOID
+FillMemMapDump (
+  OUT VOID                  *Dump,
+  IN  UINTN                 MemoryMapSize,
+  IN  UINTN                 DescriptorSize,
+  IN  UINT32                DescriptorVersion,
+  IN  EFI_MEMORY_DESCRIPTOR *MemoryMap,
+  IN  UINT64                Shims,
+  IN  UINT64                SysTable,
+  IN  UINT32                Flags
+  );
+
+/** Validates mem map dump of DumpSize bytes and returns its header, or NULL when it is malformed. */
+MEMMAP_DUMP_HEADER *
+ParseMemMapDump (
+  IN  VOID                  *Dump,
+  IN  UINTN                 DumpSize
+  );
+
+#endif // APTIOFIX_MEMORY_MAP_H
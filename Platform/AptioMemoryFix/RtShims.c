@@ -14,12 +14,17 @@
 #include <Library/UefiBootServicesTableLib.h>
 #include <Library/UefiRuntimeServicesTableLib.h>
 
+#include <Guid/AptioMemoryFixRtStats.h>
+
 #include "Config.h"
 #include "Lib.h"
+#include "MemoryMap.h"
 #include "RtShims.h"
 
 extern UINTN gRtShimsDataStart;
 extern UINTN gRtShimsDataEnd;
+extern UINTN gRtShimsStats;
+extern UINTN gRtShimsStatsEnd;
 
 extern UINTN RtShimGetVariable;
 extern UINTN RtShimGetNextVariableName;
@@ -30,6 +35,9 @@ extern UINTN RtShimGetWakeupTime;
 extern UINTN RtShimSetWakeupTime;
 extern UINTN RtShimGetNextHighMonoCount;
 extern UINTN RtShimResetSystem;
+extern UINTN RtShimQueryVariableInfo;
+extern UINTN RtShimUpdateCapsule;
+extern UINTN RtShimQueryCapsuleCapabilities;
 
 VOID *gRtShims = NULL;
 
@@ -44,9 +52,34 @@ STATIC ShimPtrs mShimPtrArray[] = {
   { &gGetWakeupTime },
   { &gSetWakeupTime },
   { &gGetNextHighMonoCount },
-  { &gResetSystem }
+  { &gResetSystem },
+  { &gQueryVariableInfo },
+  { &gUpdateCapsule },
+  { &gQueryCapsuleCapabilities }
 };
 
+/** Returns the services needing CR0.WP lifted, see APTIOFIX_RT_SHIMS_WP_MASK. */
+STATIC
+UINT32
+GetRtShimsWpMask (
+  VOID
+  )
+{
+  EFI_STATUS  Status;
+  UINT32      WpMask;
+  UINTN       DataSize;
+
+  DataSize = sizeof (WpMask);
+  Status = gRT->GetVariable (L"aptiomemfix-rtwp", &gAppleBootVariableGuid, NULL, &DataSize, &WpMask);
+  if (EFI_ERROR (Status) || DataSize != sizeof (WpMask)) {
+    WpMask = APTIOFIX_RT_SHIMS_WP_MASK;
+  } else {
+    DEBUG ((DEBUG_INFO, "Using RT shims WP mask %X from NVRAM\n", WpMask));
+  }
+
+  return WpMask & ((1U << APTIOMEMORYFIX_RT_SERVICE_COUNT) - 1);
+}
+
 VOID InstallRtShims (
   EFI_GET_VARIABLE GetVariableOverride
   )
@@ -89,7 +122,25 @@ VOID InstallRtShims (
     gGetNextHighMonoCount = (UINTN)gRT->GetNextHighMonotonicCount;
     gResetSystem          = (UINTN)gRT->ResetSystem;
 
+    //
+    // Capsule and variable info services were only added in UEFI 2.0.
+    //
+    if (gRT->Hdr.Revision >= EFI_2_00_SYSTEM_TABLE_REVISION) {
+      gQueryVariableInfo        = (UINTN)gRT->QueryVariableInfo;
+      gUpdateCapsule            = (UINTN)gRT->UpdateCapsule;
+      gQueryCapsuleCapabilities = (UINTN)gRT->QueryCapsuleCapabilities;
+    }
+
     gGetVariableOverride  = (UINTN)GetVariableOverride;
+    gRtShimsWpMask        = GetRtShimsWpMask ();
+
+#if APTIOFIX_RT_SHIMS_STATS == 1
+    gRtShimsStatsEnabled  = 1;
+#endif
+
+    ASSERT ((UINTN)&gRtShimsStatsEnd - (UINTN)&gRtShimsStats == sizeof (APTIOMEMORYFIX_RT_STATS));
+    ((APTIOMEMORYFIX_RT_STATS *)&gRtShimsStats)->Revision     = APTIOMEMORYFIX_RT_STATS_REVISION;
+    ((APTIOMEMORYFIX_RT_STATS *)&gRtShimsStats)->ServiceCount = APTIOMEMORYFIX_RT_SERVICE_COUNT;
 
     CopyMem (
       gRtShims,
@@ -107,8 +158,32 @@ VOID InstallRtShims (
     gRT->GetNextHighMonotonicCount = (EFI_GET_NEXT_HIGH_MONO_COUNT)((UINTN)gRtShims  + ((UINTN)&RtShimGetNextHighMonoCount - (UINTN)&gRtShimsDataStart));
     gRT->ResetSystem               = (EFI_RESET_SYSTEM)((UINTN)gRtShims              + ((UINTN)&RtShimResetSystem          - (UINTN)&gRtShimsDataStart));
 
+    if (gQueryVariableInfo != 0) {
+      gRT->QueryVariableInfo         = (EFI_QUERY_VARIABLE_INFO)((UINTN)gRtShims         + ((UINTN)&RtShimQueryVariableInfo        - (UINTN)&gRtShimsDataStart));
+    }
+    if (gUpdateCapsule != 0) {
+      gRT->UpdateCapsule             = (EFI_UPDATE_CAPSULE)((UINTN)gRtShims              + ((UINTN)&RtShimUpdateCapsule            - (UINTN)&gRtShimsDataStart));
+    }
+    if (gQueryCapsuleCapabilities != 0) {
+      gRT->QueryCapsuleCapabilities  = (EFI_QUERY_CAPSULE_CAPABILITIES)((UINTN)gRtShims  + ((UINTN)&RtShimQueryCapsuleCapabilities - (UINTN)&gRtShimsDataStart));
+    }
+
     gRT->Hdr.CRC32 = 0;
     gBS->CalculateCrc32(gRT, gRT->Hdr.HeaderSize, &gRT->Hdr.CRC32);
+
+#if APTIOFIX_RT_SHIMS_STATS == 1
+    //
+    // Counters live in the shims area, which is runtime memory, so the table
+    // stays valid after ExitBootServices and is updated by every shim call.
+    //
+    Status = gBS->InstallConfigurationTable (
+      &gAptioMemoryFixRtStatsGuid,
+      (VOID *)((UINTN)gRtShims + ((UINTN)&gRtShimsStats - (UINTN)&gRtShimsDataStart))
+      );
+    if (EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_WARN, "Failed to install RT stats table - %r\n", Status));
+    }
+#endif
   } else {
     DEBUG ((DEBUG_VERBOSE, "Nulling RtShims\n"));
     gRtShims = NULL;
@@ -131,8 +206,22 @@ UninstallRtShims (
   gRT->GetNextHighMonotonicCount = (EFI_GET_NEXT_HIGH_MONO_COUNT)gGetNextHighMonoCount;
   gRT->ResetSystem               = (EFI_RESET_SYSTEM)gResetSystem;
 
+  if (gQueryVariableInfo != 0) {
+    gRT->QueryVariableInfo         = (EFI_QUERY_VARIABLE_INFO)gQueryVariableInfo;
+  }
+  if (gUpdateCapsule != 0) {
+    gRT->UpdateCapsule             = (EFI_UPDATE_CAPSULE)gUpdateCapsule;
+  }
+  if (gQueryCapsuleCapabilities != 0) {
+    gRT->QueryCapsuleCapabilities  = (EFI_QUERY_CAPSULE_CAPABILITIES)gQueryCapsuleCapabilities;
+  }
+
   gRT->Hdr.CRC32 = 0;
   gBS->CalculateCrc32(gRT, gRT->Hdr.HeaderSize, &gRT->Hdr.CRC32);
+
+#if APTIOFIX_RT_SHIMS_STATS == 1
+  gBS->InstallConfigurationTable (&gAptioMemoryFixRtStatsGuid, NULL);
+#endif
 }
 
 VOID
@@ -142,8 +231,10 @@ VirtualizeRtShims (
   EFI_MEMORY_DESCRIPTOR  *MemoryMap
   )
 {
+  MEMORY_MAP_TARGET      Targets[ARRAY_SIZE (mShimPtrArray)];
   EFI_MEMORY_DESCRIPTOR  *Desc;
-  UINTN                  Index, Index2, FixedCount = 0;
+  UINTN                  Index;
+  UINTN                  NumTargets = 0;
 
   //
   // For some reason creating an event for catching SetVirtualAddress doesn't work on APTIO IV Z77,
@@ -156,8 +247,6 @@ VirtualizeRtShims (
   if (mRtShimsAddrUpdated)
     return;
 
-  Desc = MemoryMap;
-
   //
   // Custom GetVariable wrapper is no longer allowed!
   //
@@ -165,26 +254,24 @@ VirtualizeRtShims (
 
   for (Index = 0; Index < ARRAY_SIZE (mShimPtrArray); ++Index) {
     mShimPtrArray[Index].Func = (UINTN *)((UINTN)gRtShims + ((UINTN)(mShimPtrArray[Index].gFunc) - (UINTN)&gRtShimsDataStart));
+    //
+    // Services missing before UEFI 2.0 have nothing to virtualize.
+    //
+    if (*(mShimPtrArray[Index].gFunc) != 0) {
+      Targets[NumTargets].Address = *(mShimPtrArray[Index].gFunc);
+      Targets[NumTargets].Context = Index;
+      ++NumTargets;
+    }
   }
 
-  for (Index = 0; Index < (MemoryMapSize / DescriptorSize); ++Index) {
-    for (Index2 = 0; Index2 < ARRAY_SIZE (mShimPtrArray); ++Index2) {
-      if (
-        !mShimPtrArray[Index2].Fixed &&
-        (*(mShimPtrArray[Index2].gFunc) >= Desc->PhysicalStart) &&
-        (*(mShimPtrArray[Index2].gFunc) < (Desc->PhysicalStart + EFI_PAGES_TO_SIZE (Desc->NumberOfPages)))
-      ) {
-        mShimPtrArray[Index2].Fixed = TRUE;
-        *(mShimPtrArray[Index2].Func) += (Desc->VirtualStart - Desc->PhysicalStart);
-        FixedCount++;
-      }
-    }
+  SortMemoryMapTargets (Targets, NumTargets);
+  ResolveMemoryMapTargets (MemoryMapSize, MemoryMap, DescriptorSize, Targets, NumTargets);
 
-    if (FixedCount == ARRAY_SIZE (mShimPtrArray)) {
-      break;
+  for (Index = 0; Index < NumTargets; ++Index) {
+    Desc = Targets[Index].Descriptor;
+    if (Desc != NULL) {
+      *(mShimPtrArray[Targets[Index].Context].Func) += (Desc->VirtualStart - Desc->PhysicalStart);
     }
-
-    Desc = NEXT_MEMORY_DESCRIPTOR (Desc, DescriptorSize);
   }
 
   mRtShimsAddrUpdated = TRUE;
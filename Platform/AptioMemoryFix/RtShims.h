@@ -18,14 +18,18 @@ extern UINTN gGetWakeupTime;
 extern UINTN gSetWakeupTime;
 extern UINTN gGetNextHighMonoCount;
 extern UINTN gResetSystem;
+extern UINTN gQueryVariableInfo;
+extern UINTN gUpdateCapsule;
+extern UINTN gQueryCapsuleCapabilities;
 extern UINTN gGetVariableOverride;
+extern UINTN gRtShimsStatsEnabled;
+extern UINTN gRtShimsWpMask;
 
 extern VOID *gRtShims;
 
 typedef struct {
   UINTN           *gFunc;
   UINTN           *Func;
-  BOOLEAN         Fixed;
 } ShimPtrs;
 
 VOID
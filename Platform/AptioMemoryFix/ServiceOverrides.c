@@ -19,8 +19,11 @@
 #include "BootFixes.h"
 #include "Hibernate.h"
 #include "Lib.h"
+#include "MemoryMap.h"
 #include "RtShims.h"
 #include "ServiceOverrides.h"
+#include "VariableCache.h"
+#include "VMem.h"
 #include "UmmMalloc/UmmMalloc.h"
 
 //
@@ -33,6 +36,7 @@ STATIC EFI_GET_MEMORY_MAP          mStoredGetMemoryMap;
 STATIC EFI_EXIT_BOOT_SERVICES      mStoredExitBootServices;
 STATIC EFI_HANDLE_PROTOCOL         mStoredHandleProtocol;
 STATIC EFI_SET_VIRTUAL_ADDRESS_MAP mStoredSetVirtualAddressMap;
+STATIC EFI_SET_VARIABLE            mStoredSetVariable;
 
 //
 // Original runtime services hash we restore on uninstallation
@@ -50,6 +54,11 @@ STATIC EFI_PHYSICAL_ADDRESS mHibernateImageAddress;
 STATIC EFI_HANDLE           mExitBSImageHandle;
 STATIC UINTN                mExitBSMapKey;
 
+//
+// Number of EfiBootServicesData allocations the custom pool could not serve
+//
+STATIC UINT64               mPoolFallbackCount;
+
 //
 // Minimum and maximum addresses allocated by AlocatePages
 //
@@ -78,7 +87,9 @@ InstallBsOverrides (
   if (!UmmInitialized ()) {
     Status = AllocatePagesFromTop (EfiBootServicesData, PageNum, &UmmHeap, TRUE);
     if (!EFI_ERROR (Status)) {
+#if !APTIOFIX_ALLOCATOR_LAZY_INIT
       gBS->SetMem ((VOID *)UmmHeap, APTIOFIX_ALLOCATOR_POOL_SIZE, 0);
+#endif
       UmmSetHeap ((VOID *)UmmHeap);
 
       mStoredAllocatePool   = gBS->AllocatePool;
@@ -146,8 +157,10 @@ InstallRtOverrides (
   mRtPreOverridesCRC32 = gRT->Hdr.CRC32;
 
   mStoredSetVirtualAddressMap = gRT->SetVirtualAddressMap;
+  mStoredSetVariable          = gRT->SetVariable;
 
   gRT->SetVirtualAddressMap = MOSetVirtualAddressMap;
+  gRT->SetVariable          = MOSetVariable;
 
   gRT->Hdr.CRC32 = 0;
   gBS->CalculateCrc32 (gRT, gRT->Hdr.HeaderSize, &gRT->Hdr.CRC32);
@@ -159,6 +172,7 @@ UninstallRtOverrides (
   )
 {
   gRT->SetVirtualAddressMap = mStoredSetVirtualAddressMap;
+  gRT->SetVariable          = mStoredSetVariable;
 
   gRT->Hdr.CRC32 = mRtPreOverridesCRC32;
 }
@@ -300,6 +314,9 @@ MOAllocatePool (
     // Tests on 10.13.3 show that the total allocated memory is around 300 MBs.
     // However, if it does (for any reason), let's try to fallback.
     //
+    if (UmmInitialized ()) {
+      mPoolFallbackCount++;
+    }
   }
 
   return mStoredAllocatePool (Type, Size, Buffer);
@@ -323,6 +340,51 @@ MOFreePool (
   return mStoredFreePool (Buffer);
 }
 
+/** Returns custom pool allocator statistics, see APTIOMEMORYFIX_PROTOCOL.
+ */
+EFI_STATUS
+EFIAPI
+GetPoolStats (
+  IN OUT UINTN                      *StatsSize,
+  OUT    APTIOMEMORYFIX_POOL_STATS  *Stats
+  )
+{
+  APTIOMEMORYFIX_POOL_STATS  PoolStats;
+  UMM_STATS                  UmmStats;
+  UINTN                      Index;
+
+  if (StatsSize == NULL || Stats == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  if (!UmmInitialized ()) {
+    return EFI_NOT_STARTED;
+  }
+
+  UmmGetStats (&UmmStats);
+
+  PoolStats.PoolSize         = UmmStats.HeapSize;
+  PoolStats.InitializedSize  = UmmStats.InitSize;
+  PoolStats.LiveSize         = UmmStats.UsedSize;
+  PoolStats.PeakLiveSize     = UmmStats.PeakUsedSize;
+  PoolStats.AllocationCount  = UmmStats.Allocs;
+  PoolStats.FreeCount        = UmmStats.Frees;
+  PoolStats.FallbackCount    = mPoolFallbackCount;
+  PoolStats.LargestFreeBlock = UmmStats.LargestFree;
+  PoolStats.FreeBlockCount   = UmmStats.FreeBlocks;
+  PoolStats.MagazineHits     = UmmStats.MagazineHits;
+  PoolStats.MagazineMisses   = UmmStats.MagazineMisses;
+
+  for (Index = 0; Index < APTIOMEMORYFIX_POOL_HISTOGRAM_SIZE; Index++) {
+    PoolStats.Histogram[Index] = Index < UMM_HISTOGRAM_SIZE ? UmmStats.Histogram[Index] : 0;
+  }
+
+  CopyMem (Stats, &PoolStats, MIN (*StatsSize, sizeof (PoolStats)));
+  *StatsSize = sizeof (PoolStats);
+
+  return EFI_SUCCESS;
+}
+
 /** gBS->GetMemoryMap override:
  * Returns shrinked memory map. XNU can handle up to PMAP_MEMORY_REGIONS_SIZE (128) entries.
  */
@@ -337,19 +399,35 @@ MOGetMemoryMap (
   )
 {
   EFI_STATUS            Status;
+  UINTN                 OriginalMapSize;
 
+  OriginalMapSize = *MemoryMapSize;
   Status = mStoredGetMemoryMap (MemoryMapSize, MemoryMap, MapKey, DescriptorSize, DescriptorVersion);
+
+  //
+  // Make sure we can map all the runtime areas after ExitBootServices.
+  // Growing the page table pool changes the memory map, so obtain it again for a valid MapKey.
+  //
+  if (Status == EFI_SUCCESS && VmUpdateMemoryPool (*MemoryMapSize, MemoryMap, *DescriptorSize)) {
+    *MemoryMapSize = OriginalMapSize;
+    Status = mStoredGetMemoryMap (MemoryMapSize, MemoryMap, MapKey, DescriptorSize, DescriptorVersion);
+  }
+
   DEBUG ((DEBUG_VERBOSE, "GetMemoryMap: %p = %r\n", MemoryMap, Status));
 
   if (Status == EFI_SUCCESS) {
-    if (gDumpMemArgPresent)
+    if (gDumpMemArgPresent
+      && (APTIOFIX_MEMORY_DUMP_TO_VARIABLE == 0
+      || EFI_ERROR (SaveMemMapDump (L"aptiomemfix-memmap", *MemoryMapSize, *DescriptorSize, *DescriptorVersion,
+        MemoryMap, gRtShims, gSysTableRtArea, FALSE))))
       PrintMemMap (L"GetMemoryMap", *MemoryMapSize, *DescriptorSize, MemoryMap, gRtShims, gSysTableRtArea);
 
-#if APTIOFIX_PROTECT_CSM_REGION == 1
-    ProtectCsmRegion (*MemoryMapSize, MemoryMap, *DescriptorSize);
-#endif
-
-    ShrinkMemMap (MemoryMapSize, MemoryMap, *DescriptorSize);
+    //
+    // Some firmwares return unsorted maps, where adjacent areas are not adjacent in the array
+    // and cannot be joined. XNU only handles a limited number of memory regions.
+    //
+    SortMemoryMap (*MemoryMapSize, MemoryMap, *DescriptorSize);
+    ShrinkMemMap (MemoryMapSize, MemoryMap, *DescriptorSize, APTIOFIX_PROTECT_CSM_REGION == 1);
 
     //
     // Remember some descriptor size, since we will not have it later
@@ -395,6 +473,11 @@ MOExitBootServices (
   VOID                     *MachOImage = NULL;
   IOHibernateImageHeader   *ImageHeader = NULL;
 
+  //
+  // Variable cache lives in boot services memory and is not needed by the kernel
+  //
+  DisableVariableCache ();
+
   //
   // We need hibernate image address for wake
   //
@@ -463,7 +546,13 @@ MOSetVirtualAddressMap (
   UninstallRtOverrides ();
 
   if (gDumpMemArgPresent) {
-    PrintMemMap (L"SetVirtualAddressMap", MemoryMapSize, DescriptorSize, VirtualMap, gRtShims, gSysTableRtArea);
+    //
+    // Boot services are still available here, since ExitBootServices is delayed below.
+    //
+    if (APTIOFIX_MEMORY_DUMP_TO_VARIABLE == 0
+      || EFI_ERROR (SaveMemMapDump (L"aptiomemfix-vmap", MemoryMapSize, DescriptorSize, DescriptorVersion,
+        VirtualMap, gRtShims, gSysTableRtArea, TRUE)))
+      PrintMemMap (L"SetVirtualAddressMap", MemoryMapSize, DescriptorSize, VirtualMap, gRtShims, gSysTableRtArea);
     //
     // To print as much information as possible we delay ExitBootServices.
     // Most likely this will fail, but let's still try!
@@ -474,7 +563,7 @@ MOSetVirtualAddressMap (
   //
   // Protect RT areas from relocation by marking then MemMapIO
   //
-  ProtectRtMemoryFromRelocation (MemoryMapSize, DescriptorSize, DescriptorVersion, VirtualMap);
+  ProtectRtMemoryFromRelocation (MemoryMapSize, DescriptorSize, DescriptorVersion, VirtualMap, gSysTableRtArea);
 
   //
   // Remember physical sys table addr
@@ -495,3 +584,21 @@ MOSetVirtualAddressMap (
 
   return Status;
 }
+
+/** gRT->SetVariable override:
+ * Drops the variable from the boot variable cache before changing it.
+ */
+EFI_STATUS
+EFIAPI
+MOSetVariable (
+  IN CHAR16                 *VariableName,
+  IN EFI_GUID               *VendorGuid,
+  IN UINT32                 Attributes,
+  IN UINTN                  DataSize,
+  IN VOID                   *Data
+  )
+{
+  InvalidateCachedVariable (VariableName, VendorGuid);
+
+  return mStoredSetVariable (VariableName, VendorGuid, Attributes, DataSize, Data);
+}
@@ -10,6 +10,8 @@
 #ifndef APTIOFIX_SERVICE_OVERRIDES_H
 #define APTIOFIX_SERVICE_OVERRIDES_H
 
+#include <Protocol/AptioMemoryFixProtocol.h>
+
 //
 // Minimum and maximum addresses allocated by AlocatePages
 //
@@ -72,6 +74,13 @@ MOFreePool (
   IN VOID                 *Buffer
   );
 
+EFI_STATUS
+EFIAPI
+GetPoolStats (
+  IN OUT UINTN                      *StatsSize,
+  OUT    APTIOMEMORYFIX_POOL_STATS  *Stats
+  );
+
 EFI_STATUS
 EFIAPI
 MOGetMemoryMap (
@@ -108,4 +117,14 @@ MOSetVirtualAddressMap (
   IN EFI_MEMORY_DESCRIPTOR  *VirtualMap
   );
 
+EFI_STATUS
+EFIAPI
+MOSetVariable (
+  IN CHAR16                 *VariableName,
+  IN EFI_GUID               *VendorGuid,
+  IN UINT32                 Attributes,
+  IN UINTN                  DataSize,
+  IN VOID                   *Data
+  );
+
 #endif // APTIOFIX_SERVICE_OVERRIDES_H
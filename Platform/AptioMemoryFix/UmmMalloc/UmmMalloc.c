@@ -54,6 +54,10 @@
  * ----------------------------------------------------------------------------
  */
 
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+
 #include "UmmMalloc.h"
 #include "Config.h"
 
@@ -63,16 +67,49 @@ STATIC UINT8 *default_umm_heap;
 #error "You must set APTIOFIX_ALLOCATOR_POOL_SIZE with a sane pool size!"
 #endif
 
-#define UMM_MALLOC_CFG_HEAP_SIZE APTIOFIX_ALLOCATOR_POOL_SIZE
-#define UMM_MALLOC_CFG_HEAP_ADDR default_umm_heap
+#if APTIOFIX_ALLOCATOR_BLOCK_SIZE < 16 || APTIOFIX_ALLOCATOR_BLOCK_SIZE > 128 \
+  || (APTIOFIX_ALLOCATOR_BLOCK_SIZE & (APTIOFIX_ALLOCATOR_BLOCK_SIZE - 1)) != 0
+#error "APTIOFIX_ALLOCATOR_BLOCK_SIZE must be a power of two from 16 to 128!"
+#endif
+
+#if APTIOFIX_ALLOCATOR_POOL_SIZE / APTIOFIX_ALLOCATOR_BLOCK_SIZE > 0x7FFFFFFF
+#error "APTIOFIX_ALLOCATOR_POOL_SIZE has too many blocks for 31-bit block numbers!"
+#endif
+
+#define UMM_MALLOC_CFG_HEAP_SIZE  APTIOFIX_ALLOCATOR_POOL_SIZE
+#define UMM_MALLOC_CFG_HEAP_ADDR  default_umm_heap
+#define UMM_MALLOC_CFG_BLOCK_SIZE APTIOFIX_ALLOCATOR_BLOCK_SIZE
+#define UMM_MALLOC_CFG_LARGE_SIZE APTIOFIX_ALLOCATOR_LARGE_SIZE
+#define UMM_MALLOC_CFG_LAZY_INIT  APTIOFIX_ALLOCATOR_LAZY_INIT
+#define UMM_MALLOC_CFG_GROW_SIZE  APTIOFIX_ALLOCATOR_GROW_SIZE
+#define UMM_MALLOC_CFG_MAG_DEPTH  APTIOFIX_ALLOCATOR_MAGAZINE_DEPTH
+
+#if UMM_MALLOC_CFG_LAZY_INIT && (UMM_MALLOC_CFG_GROW_SIZE % EFI_PAGE_SIZE) != 0
+#error "APTIOFIX_ALLOCATOR_GROW_SIZE must be a multiple of the page size!"
+#endif
 
 #define UMM_BEST_FIT
 
 #define DBGLOG_DEBUG(format, ...) do { } while (0)
 #define DBGLOG_TRACE(froamt, ...) do { } while (0)
 
-#define UMM_CRITICAL_ENTRY()
-#define UMM_CRITICAL_EXIT()
+/*
+ * The pool is reached from gBS->AllocatePool and gBS->FreePool, which timer
+ * and notify callbacks may call while we are in the middle of updating the
+ * free lists. Raising to TPL_HIGH_LEVEL masks interrupts and thus any event
+ * notification. The sections below are short enough for it, the longest one
+ * is zeroing a single APTIOFIX_ALLOCATOR_GROW_SIZE step of a lazily
+ * initialised heap. Larger growths are split into steps, see
+ * umm_find_free_block().
+ *
+ * Nothing nests, so a single saved TPL is enough. It is only accessed while
+ * at TPL_HIGH_LEVEL.
+ */
+#ifndef UMM_CRITICAL_ENTRY
+STATIC EFI_TPL umm_saved_tpl;
+#define UMM_CRITICAL_ENTRY() do { umm_saved_tpl = gBS->RaiseTPL( TPL_HIGH_LEVEL ); } while (0)
+#define UMM_CRITICAL_EXIT()  do { gBS->RestoreTPL( umm_saved_tpl ); } while (0)
+#endif
 
 /* ------------------------------------------------------------------------- */
 
@@ -89,7 +126,7 @@ typedef struct umm_block_t {
   } header;
   union {
     umm_ptr free;
-    UINT8 data[4];
+    UINT8 data[UMM_MALLOC_CFG_BLOCK_SIZE - sizeof(umm_ptr)];
   } body;
 } umm_block;
 
@@ -98,11 +135,71 @@ typedef struct umm_block_t {
 #define UMM_FREELIST_MASK (0x80000000)
 #define UMM_BLOCKNO_MASK  (0x7FFFFFFF)
 
+/*
+ * Free blocks are kept in segregated lists (bins), one per power of two
+ * block count: bin N holds free blocks of [2^N, 2^(N+1)) blocks. A bitmap
+ * of non-empty bins lets us find the first bin that is guaranteed to fit
+ * the request with a single bit scan instead of walking every free block.
+ *
+ * Free list pointers still live in the block bodies, a zero UMM_PFREE means
+ * that the block is the head of its bin, and a zero UMM_NFREE means that it
+ * is the last one. The 0th block is never free, so 0 is a safe terminator.
+ */
+#define UMM_NUM_BINS      (32)
+
+/*
+ * Blocks per page. The heap itself is page aligned, so a block is page
+ * aligned when its number is a multiple of this.
+ */
+#define UMM_PAGE_BLOCKS   (EFI_PAGE_SIZE / sizeof(umm_block))
+
 /* ------------------------------------------------------------------------- */
 
 umm_block *umm_heap = NULL;
 UINT32 umm_numblocks = 0;
 
+/*
+ * Number of blocks initialised so far, the last of them is the end marker.
+ * Equals umm_numblocks unless the pool is initialised lazily.
+ */
+UINT32 umm_limit = 0;
+
+STATIC UINT32 umm_bins[UMM_NUM_BINS];
+STATIC UINT32 umm_bin_map;
+
+/* Usage counters, free list figures are computed on request */
+STATIC UMM_STATS umm_stats;
+
+/*
+ * Magazines keep recently freed blocks of hot sizes as they are, still
+ * marked used, and hand them out again LIFO. A class is identified by its
+ * block count, so any freed block of that count fits any request of it.
+ *
+ * Small classes cover every count up to UMM_MAG_SMALL, the rest are the
+ * sizes in umm_mag_sizes converted to block counts at init.
+ */
+#define UMM_MAG_SMALL     (16)
+
+#if UMM_MALLOC_CFG_MAG_DEPTH > 0
+
+STATIC CONST UINT32 umm_mag_sizes[] = {
+  /* AMI PrintLine buffers, see MOAllocatePool */
+  184320,
+  127968
+};
+
+#define UMM_MAG_CLASSES   (UMM_MAG_SMALL + sizeof(umm_mag_sizes) / sizeof(umm_mag_sizes[0]))
+
+typedef struct umm_magazine_t {
+  UINT32 blocks;
+  UINT32 count;
+  UINT32 stack[UMM_MALLOC_CFG_MAG_DEPTH];
+} umm_magazine;
+
+STATIC umm_magazine umm_magazines[UMM_MAG_CLASSES];
+
+#endif
+
 #define UMM_NUMBLOCKS (umm_numblocks)
 
 /* ------------------------------------------------------------------------ */
@@ -115,6 +212,8 @@ UINT32 umm_numblocks = 0;
 #define UMM_PFREE(b)  (UMM_BLOCK(b).body.free.prev)
 #define UMM_DATA(b)   (UMM_BLOCK(b).body.data)
 
+#define UMM_BLOCKSIZE(b) ((UMM_NBLOCK(b) & UMM_BLOCKNO_MASK) - (b))
+
 /* ------------------------------------------------------------------------ */
 
 STATIC UINT32 umm_blocks( UINT32 size ) {
@@ -141,6 +240,25 @@ STATIC UINT32 umm_blocks( UINT32 size ) {
   return( 2 + size/(sizeof(umm_block)) );
 }
 
+/* ------------------------------------------------------------------------
+ * Returns the number of blocks UmmMalloc() takes for `size` bytes, large
+ * requests are rounded up to whole pages.
+ */
+
+STATIC UINT32 umm_request_blocks( UINT32 size ) {
+  if( size >= UMM_MALLOC_CFG_LARGE_SIZE && size <= MAX_UINT32 - EFI_PAGE_SIZE )
+    return (UINT32)(EFI_SIZE_TO_PAGES( size + sizeof(umm_ptr) ) * UMM_PAGE_BLOCKS);
+
+  return umm_blocks( size );
+}
+
+/* ------------------------------------------------------------------------ */
+
+STATIC UINT32 umm_bin( UINT32 blocks ) {
+  /* blocks is never 0 and never exceeds UMM_BLOCKNO_MASK */
+  return (UINT32)HighBitSet32( blocks );
+}
+
 /* ------------------------------------------------------------------------ */
 /*
  * Split the block `c` into two blocks: `c` and `c + blocks`.
@@ -163,17 +281,239 @@ STATIC VOID umm_split_block( UINT32 c,
 
 /* ------------------------------------------------------------------------ */
 
+STATIC VOID umm_connect_to_free_list( UINT32 c ) {
+  /* Add this block to the head of its bin and set the free block indicator */
+
+  UINT32 bin = umm_bin( UMM_BLOCKSIZE(c) );
+
+  UMM_NFREE(c) = umm_bins[bin];
+  UMM_PFREE(c) = 0;
+
+  if( umm_bins[bin] )
+    UMM_PFREE(umm_bins[bin]) = c;
+
+  umm_bins[bin] = c;
+  umm_bin_map  |= (1U << bin);
+
+  UMM_NBLOCK(c) |= UMM_FREELIST_MASK;
+}
+
+/* ------------------------------------------------------------------------ */
+
 STATIC VOID umm_disconnect_from_free_list( UINT32 c ) {
-  /* Disconnect this block from the FREE list */
+  /* Disconnect this block from the FREE list of its bin */
+
+  UINT32 bin = umm_bin( UMM_BLOCKSIZE(c) );
+
+  if( UMM_PFREE(c) )
+    UMM_NFREE(UMM_PFREE(c)) = UMM_NFREE(c);
+  else
+    umm_bins[bin] = UMM_NFREE(c);
 
-  UMM_NFREE(UMM_PFREE(c)) = UMM_NFREE(c);
-  UMM_PFREE(UMM_NFREE(c)) = UMM_PFREE(c);
+  if( UMM_NFREE(c) )
+    UMM_PFREE(UMM_NFREE(c)) = UMM_PFREE(c);
+
+  if( !umm_bins[bin] )
+    umm_bin_map &= ~(1U << bin);
 
   /* And clear the free block indicator */
 
   UMM_NBLOCK(c) &= (~UMM_FREELIST_MASK);
 }
 
+/* ------------------------------------------------------------------------
+ * Looks up the best fitting block in a single bin, returns 0 if none fits.
+ */
+
+STATIC UINT32 umm_scan_bin( UINT32 bin, UINT32 blocks ) {
+  UINT32 cf;
+  UINT32 blockSize;
+  UINT32 bestSize  = UMM_FREELIST_MASK;
+  UINT32 bestBlock = 0;
+
+  for( cf = umm_bins[bin]; cf; cf = UMM_NFREE(cf) ) {
+    blockSize = UMM_BLOCKSIZE(cf);
+
+    DBGLOG_TRACE( "Looking at block %6i size %6i\n", cf, blockSize );
+
+#if defined UMM_BEST_FIT
+    if( (blockSize >= blocks) && (blockSize < bestSize) ) {
+      bestBlock = cf;
+      bestSize  = blockSize;
+      /* Nothing can beat an exact fit */
+      if( blockSize == blocks )
+        break;
+    }
+#elif defined UMM_FIRST_FIT
+    /* This is the first block that fits! */
+    if( (blockSize >= blocks) ) {
+      bestBlock = cf;
+      break;
+    }
+#else
+#  error "No UMM_*_FIT is defined - check umm_malloc_cfg.h"
+#endif
+  }
+
+  return bestBlock;
+}
+
+/* ------------------------------------------------------------------------
+ * Finds a free block of at least `blocks` blocks, returns 0 if none exists.
+ *
+ * The bin matching the request may hold both smaller and larger blocks,
+ * so it is scanned first. Every block in any higher bin is guaranteed to
+ * fit, so the next non-empty one is taken straight from the bitmap.
+ */
+
+STATIC UINT32 umm_search_free_block( UINT32 blocks ) {
+  UINT32 bin;
+  UINT32 cf;
+  UINT32 map;
+
+  bin = umm_bin( blocks );
+
+  if( umm_bin_map & (1U << bin) ) {
+    cf = umm_scan_bin( bin, blocks );
+    if( cf )
+      return cf;
+  }
+
+  map = bin + 1 < UMM_NUM_BINS ? umm_bin_map & ~((1U << (bin + 1)) - 1) : 0;
+  if( !map )
+    return 0;
+
+  return umm_scan_bin( (UINT32)LowBitSet32( map ), blocks );
+}
+
+/* ------------------------------------------------------------------------ */
+
+STATIC VOID umm_release_block( UINT32 c );
+
+STATIC BOOLEAN umm_magazine_flush( VOID );
+
+/* ------------------------------------------------------------------------
+ * Grows the initialised part of a lazily initialised heap by one growth
+ * step, or up to the whole heap if less is left. The end marker is moved up
+ * and the old one is released like any used block, merging with the free
+ * space below it. Returns FALSE if the heap is fully initialised already.
+ */
+
+STATIC BOOLEAN umm_grow( VOID ) {
+#if UMM_MALLOC_CFG_LAZY_INIT
+  CONST UINT32 step = UMM_MALLOC_CFG_GROW_SIZE / sizeof(umm_block);
+  UINT32 old_last;
+  UINT32 new_last;
+  UINT32 limit;
+
+  if( umm_limit == UMM_NUMBLOCKS )
+    return FALSE;
+
+  limit = umm_limit + step;
+  if( limit > UMM_NUMBLOCKS )
+    limit = UMM_NUMBLOCKS;
+
+  ZeroMem( &umm_heap[umm_limit], (UINTN)(limit - umm_limit) * sizeof(umm_block) );
+
+  old_last = umm_limit - 1;
+  new_last = limit - 1;
+
+  UMM_NBLOCK(new_last) = 0;
+  UMM_PBLOCK(new_last) = old_last;
+  UMM_NBLOCK(old_last) = new_last;
+
+  umm_limit = limit;
+
+  umm_release_block( old_last );
+
+  return TRUE;
+#else
+  return FALSE;
+#endif
+}
+
+/* ------------------------------------------------------------------------
+ * Finds a free block of at least `blocks` blocks, growing a lazily
+ * initialised heap or emptying the magazines if needed. Returns 0 if there
+ * is no such block.
+ */
+
+STATIC UINT32 umm_find_free_block( UINT32 blocks ) {
+  UINT32 cf;
+
+  cf = umm_search_free_block( blocks );
+
+  /*
+   * Grow one step at a time and leave the critical section in between, so
+   * that large requests do not keep interrupts masked while zeroing many
+   * megabytes. The free lists are consistent here, and anything allocated
+   * meanwhile is just not found by the next search.
+   */
+  while( !cf && umm_grow() ) {
+    cf = umm_search_free_block( blocks );
+    if( !cf && umm_limit < UMM_NUMBLOCKS ) {
+      UMM_CRITICAL_EXIT();
+      UMM_CRITICAL_ENTRY();
+    }
+  }
+
+  if( !cf && umm_magazine_flush() )
+    cf = umm_search_free_block( blocks );
+
+  return cf;
+}
+
+/* ------------------------------------------------------------------------
+ * Carves `blocks` blocks starting at `c` out of the free block `cf`, which
+ * must already be disconnected from its bin. Whatever remains below and
+ * above the carved run goes back to the bins as separate free blocks.
+ */
+
+STATIC VOID umm_carve_block( UINT32 cf, UINT32 c, UINT32 blocks ) {
+
+  if( c + blocks < (UMM_NBLOCK(cf) & UMM_BLOCKNO_MASK) ) {
+    umm_split_block( cf, c + blocks - cf, 0 );
+    umm_connect_to_free_list( c + blocks );
+  }
+
+  if( c > cf ) {
+    umm_split_block( cf, c - cf, 0 );
+    umm_connect_to_free_list( cf );
+  }
+}
+
+/* ------------------------------------------------------------------------
+ * Allocates a run of `blocks` blocks such that block `c + skip` starts at
+ * an address aligned to `step` blocks. The run is
+ * taken from the top of the free block, so the free space below stays
+ * contiguous for small allocations. Returns 0 if no free block can hold an
+ * aligned run.
+ */
+
+STATIC UINT32 umm_aligned_block( UINT32 blocks, UINT32 step, UINT32 skip ) {
+  UINT32 cf;
+  UINT32 c;
+  UINT32 base;
+
+  /* Any block this large holds an aligned run wherever it starts */
+  cf = umm_find_free_block( blocks + step - 1 );
+
+  if( !cf )
+    return 0;
+
+  umm_disconnect_from_free_list( cf );
+
+  /* The heap is only page aligned, so larger alignments need its address */
+  base = (UINT32)(((UINTN)umm_heap / sizeof(umm_block)) % step);
+
+  c = (UMM_NBLOCK(cf) & UMM_BLOCKNO_MASK) - blocks + skip;
+  c -= (c + base) % step + skip;
+
+  umm_carve_block( cf, c, blocks );
+
+  return c;
+}
+
 /* ------------------------------------------------------------------------
  * The umm_assimilate_up() function assumes that UMM_NBLOCK(c) does NOT
  * have the UMM_FREELIST_MASK bit set!
@@ -213,17 +553,163 @@ STATIC UINT32 umm_assimilate_down( UINT32 c, UINT32 freemask ) {
   return( UMM_PBLOCK(c) );
 }
 
+/* ------------------------------------------------------------------------
+ * Returns the used block `c` to the bins, merging it with free neighbours.
+ */
+
+STATIC VOID umm_release_block( UINT32 c ) {
+
+  /* Now let's assimilate this block with the next one if possible. */
+
+  umm_assimilate_up( c );
+
+  /* Then assimilate with the previous block if possible */
+
+  if( UMM_NBLOCK(UMM_PBLOCK(c)) & UMM_FREELIST_MASK ) {
+
+    DBGLOG_DEBUG( "Assimilate down to next block, which is FREE\n" );
+
+    /*
+     * The previous block grows, so it has to be moved to another bin.
+     * Take it off its current one before its size changes.
+     */
+
+    umm_disconnect_from_free_list( UMM_PBLOCK(c) );
+
+    c = umm_assimilate_down(c, 0);
+  } else {
+    DBGLOG_DEBUG( "Just add to head of free list\n" );
+  }
+
+  umm_connect_to_free_list( c );
+}
+
+/* ------------------------------------------------------------------------
+ * Returns the magazine of blocks of this size, or NULL if it is not hot.
+ */
+
+#if UMM_MALLOC_CFG_MAG_DEPTH > 0
+STATIC umm_magazine *umm_magazine_for( UINT32 blocks ) {
+  UINT32 m;
+
+  if( blocks <= UMM_MAG_SMALL )
+    return &umm_magazines[blocks - 1];
+
+  for( m = UMM_MAG_SMALL; m < UMM_MAG_CLASSES; ++m ) {
+    if( umm_magazines[m].blocks == blocks )
+      return &umm_magazines[m];
+  }
+
+  return NULL;
+}
+#endif
+
+/* ------------------------------------------------------------------------
+ * Pops a cached block of `blocks` blocks, returns 0 if there is none.
+ */
+
+STATIC UINT32 umm_magazine_pop( UINT32 blocks ) {
+#if UMM_MALLOC_CFG_MAG_DEPTH > 0
+  umm_magazine *mag = umm_magazine_for( blocks );
+
+  if( mag ) {
+    if( mag->count ) {
+      umm_stats.MagazineHits++;
+      return mag->stack[--mag->count];
+    }
+
+    umm_stats.MagazineMisses++;
+  }
+#endif
+
+  return 0;
+}
+
+/* ------------------------------------------------------------------------
+ * Caches the used block `c` instead of freeing it, returns FALSE if its
+ * magazine is full or its size is not hot.
+ */
+
+STATIC BOOLEAN umm_magazine_push( UINT32 c ) {
+#if UMM_MALLOC_CFG_MAG_DEPTH > 0
+  umm_magazine *mag = umm_magazine_for( UMM_BLOCKSIZE(c) );
+
+  if( mag && mag->count < UMM_MALLOC_CFG_MAG_DEPTH ) {
+    mag->stack[mag->count++] = c;
+    return TRUE;
+  }
+#endif
+
+  return FALSE;
+}
+
+/* ------------------------------------------------------------------------
+ * Releases every cached block, so that they can merge with their free
+ * neighbours again. Returns FALSE if there was nothing to release.
+ */
+
+STATIC BOOLEAN umm_magazine_flush( VOID ) {
+  BOOLEAN flushed = FALSE;
+#if UMM_MALLOC_CFG_MAG_DEPTH > 0
+  UINT32 m;
+
+  for( m = 0; m < UMM_MAG_CLASSES; ++m ) {
+    while( umm_magazines[m].count ) {
+      umm_release_block( umm_magazines[m].stack[--umm_magazines[m].count] );
+      flushed = TRUE;
+    }
+  }
+#endif
+
+  return flushed;
+}
+
+/* ------------------------------------------------------------------------ */
+
+STATIC VOID umm_account_alloc( UINT32 c, UINT32 size ) {
+  umm_stats.UsedSize += (UINT64)UMM_BLOCKSIZE(c) * sizeof(umm_block);
+  if( umm_stats.UsedSize > umm_stats.PeakUsedSize )
+    umm_stats.PeakUsedSize = umm_stats.UsedSize;
+
+  umm_stats.Allocs++;
+  umm_stats.Histogram[HighBitSet32( size )]++;
+}
+
 /* ------------------------------------------------------------------------ */
 
 VOID umm_init( VOID ) {
+  UINT32 bin;
+
   /* init heap pointer and size, and memset it to 0 */
   umm_heap = (umm_block *)UMM_MALLOC_CFG_HEAP_ADDR;
   umm_numblocks = (UMM_MALLOC_CFG_HEAP_SIZE / sizeof(umm_block));
 
   /*
-   * This is done at allocation step!
-   * memset(umm_heap, 0x00, UMM_MALLOC_CFG_HEAP_SIZE);
+   * Either the whole heap is zeroed at allocation step, or we zero the first
+   * growth step here and the rest in umm_grow() when it is needed.
    */
+#if UMM_MALLOC_CFG_LAZY_INIT
+  umm_limit = UMM_MALLOC_CFG_GROW_SIZE / sizeof(umm_block);
+  if( umm_limit > umm_numblocks )
+    umm_limit = umm_numblocks;
+  ZeroMem( umm_heap, (UINTN)umm_limit * sizeof(umm_block) );
+#else
+  umm_limit = umm_numblocks;
+#endif
+
+  for( bin = 0; bin < UMM_NUM_BINS; ++bin )
+    umm_bins[bin] = 0;
+  umm_bin_map = 0;
+
+  SetMem( &umm_stats, sizeof(umm_stats), 0 );
+
+#if UMM_MALLOC_CFG_MAG_DEPTH > 0
+  for( bin = 0; bin < UMM_MAG_CLASSES; ++bin ) {
+    umm_magazines[bin].count  = 0;
+    umm_magazines[bin].blocks = bin < UMM_MAG_SMALL
+      ? bin + 1 : umm_request_blocks( umm_mag_sizes[bin - UMM_MAG_SMALL] );
+  }
+#endif
 
   /* setup initial blank heap structure */
   {
@@ -232,19 +718,18 @@ VOID umm_init( VOID ) {
     /* index of the 1st `umm_block` */
     CONST UINT32 block_1th = 1;
     /* index of the latest `umm_block` */
-    CONST UINT32 block_last = UMM_NUMBLOCKS - 1;
+    CONST UINT32 block_last = umm_limit - 1;
 
-    /* setup the 0th `umm_block`, which just points to the 1st */
+    /*
+     * setup the 0th `umm_block`, which just points to the 1st. It is never
+     * free, so it also serves as the list terminator for the bins.
+     */
     UMM_NBLOCK(block_0th) = block_1th;
-    UMM_NFREE(block_0th)  = block_1th;
-    UMM_PFREE(block_0th)  = block_1th;
 
     /*
      * Now, we need to set the whole heap space as a huge free block. We should
-     * not touch the 0th `umm_block`, since it's special: the 0th `umm_block`
-     * is the head of the free block list. It's a part of the heap invariant.
-     *
-     * See the detailed explanation at the beginning of the file.
+     * not touch the 0th `umm_block`, since it's special: it must stay used
+     * to stop the first free block from being assimilated down.
      */
 
     /*
@@ -253,14 +738,10 @@ VOID umm_init( VOID ) {
      * - next `umm_block`: the latest one
      * - prev `umm_block`: the 0th
      *
-     * Plus, it's a free `umm_block`, so we need to apply `UMM_FREELIST_MASK`
-     *
-     * And it's the last free block, so the next free block is 0.
+     * Plus, it's a free `umm_block`, so it goes to the bin of its size.
      */
-    UMM_NBLOCK(block_1th) = block_last | UMM_FREELIST_MASK;
-    UMM_NFREE(block_1th)  = 0;
+    UMM_NBLOCK(block_1th) = block_last;
     UMM_PBLOCK(block_1th) = block_0th;
-    UMM_PFREE(block_1th)  = block_0th;
 
     /*
      * latest `umm_block` has pointers:
@@ -272,9 +753,38 @@ VOID umm_init( VOID ) {
      */
     UMM_NBLOCK(block_last) = 0;
     UMM_PBLOCK(block_last) = block_1th;
+
+    umm_connect_to_free_list( block_1th );
   }
 }
 
+/* ------------------------------------------------------------------------
+ * Returns the block holding the header of the allocation at `ptr`, which
+ * must be within the heap.
+ *
+ * Regular allocations start right after the header, in the same block.
+ * Aligned allocations start at a block boundary, and the header takes the
+ * preceding block, see UmmMallocAligned().
+ */
+
+STATIC UINT32 umm_ptr_block( UINT8 *ptr ) {
+  UINTN offset = (UINTN)(ptr - (UINT8 *)(&(umm_heap[0])));
+
+  /* Note the use of truncated division... */
+  if( offset % sizeof(umm_block) )
+    return (UINT32)(offset / sizeof(umm_block));
+
+  return (UINT32)(offset / sizeof(umm_block)) - 1;
+}
+
+/* ------------------------------------------------------------------------
+ * Returns the number of bytes usable at `ptr` allocated in block `c`.
+ */
+
+STATIC UINTN umm_ptr_size( UINT32 c, UINT8 *ptr ) {
+  return (UINTN)((UINT8 *)&UMM_BLOCK(UMM_NBLOCK(c) & UMM_BLOCKNO_MASK) - ptr);
+}
+
 /* ------------------------------------------------------------------------ */
 
 BOOLEAN UmmInitialized ( VOID ) {
@@ -324,38 +834,19 @@ BOOLEAN UmmFree( VOID *ptr ) {
   /* Protect the critical section... */
   UMM_CRITICAL_ENTRY();
 
-  /* Figure out which block we're in. Note the use of truncated division... */
+  /* Figure out which block we're in. */
 
-  c = (UINT32)((((UINT8 *)ptr)-(UINT8 *)(&(umm_heap[0])))/sizeof(umm_block));
+  c = umm_ptr_block( cptr );
 
   DBGLOG_DEBUG( "Freeing block %6i\n", c );
 
-  /* Now let's assimilate this block with the next one if possible. */
+  umm_stats.UsedSize -= (UINT64)UMM_BLOCKSIZE(c) * sizeof(umm_block);
+  umm_stats.Frees++;
 
-  umm_assimilate_up( c );
-
-  /* Then assimilate with the previous block if possible */
-
-  if( UMM_NBLOCK(UMM_PBLOCK(c)) & UMM_FREELIST_MASK ) {
-
-    DBGLOG_DEBUG( "Assimilate down to next block, which is FREE\n" );
-
-    c = umm_assimilate_down(c, UMM_FREELIST_MASK);
-  } else {
-    /*
-     * The previous block is not a free block, so add this one to the head
-     * of the free list
-     */
-
-    DBGLOG_DEBUG( "Just add to head of free list\n" );
+  /* Keep hot sizes for reuse, otherwise give the block back to the bins */
 
-    UMM_PFREE(UMM_NFREE(0)) = c;
-    UMM_NFREE(c)            = UMM_NFREE(0);
-    UMM_PFREE(c)            = 0;
-    UMM_NFREE(0)            = c;
-
-    UMM_NBLOCK(c)          |= UMM_FREELIST_MASK;
-  }
+  if( !umm_magazine_push( c ) )
+    umm_release_block( c );
 
   /* Release the critical section... */
   UMM_CRITICAL_EXIT();
@@ -367,10 +858,7 @@ BOOLEAN UmmFree( VOID *ptr ) {
 
 VOID *UmmMalloc( UINT32 size ) {
   UINT32 blocks;
-  UINT32 blockSize = 0;
-
-  UINT32 bestSize;
-  UINT32 bestBlock;
+  UINT32 blockSize;
 
   UINT32 cf;
 
@@ -394,48 +882,57 @@ VOID *UmmMalloc( UINT32 size ) {
   /* Protect the critical section... */
   UMM_CRITICAL_ENTRY();
 
-  blocks = umm_blocks( size );
+  /* Hot sizes are likely to be cached, which is as cheap as it gets */
+
+  blocks = umm_request_blocks( size );
+
+  cf = umm_magazine_pop( blocks );
+
+  if( cf ) {
+    DBGLOG_DEBUG( "Allocating %6i blocks starting at %6i - cached\n", blocks, cf );
+
+    umm_account_alloc( cf, size );
+
+    /* Release the critical section... */
+    UMM_CRITICAL_EXIT();
+
+    return( (VOID *)&UMM_DATA(cf) );
+  }
 
   /*
-   * Now we can scan through the free list until we find a space that's big
-   * enough to hold the number of blocks we need.
-   *
-   * This part may be customized to be a best-fit, worst-fit, or first-fit
-   * algorithm
+   * Large requests get whole pages, so their header takes the first block of
+   * a page-aligned run and nothing else shares those pages. If the heap is too
+   * fragmented for an aligned run fall back to the regular path below.
    */
 
-  cf = UMM_NFREE(0);
+  if( size >= UMM_MALLOC_CFG_LARGE_SIZE && size <= MAX_UINT32 - EFI_PAGE_SIZE ) {
+    cf = umm_aligned_block( blocks, UMM_PAGE_BLOCKS, 0 );
 
-  bestBlock = UMM_NFREE(0);
-  bestSize  = 0x7FFFFFFF;
+    if( cf ) {
+      DBGLOG_DEBUG( "Allocating %6i blocks starting at %6i - large\n", blocks, cf );
 
-  while( cf ) {
-    blockSize = (UMM_NBLOCK(cf) & UMM_BLOCKNO_MASK) - cf;
+      umm_account_alloc( cf, size );
 
-    DBGLOG_TRACE( "Looking at block %6i size %6i\n", cf, blockSize );
+      /* Release the critical section... */
+      UMM_CRITICAL_EXIT();
 
-#if defined UMM_BEST_FIT
-    if( (blockSize >= blocks) && (blockSize < bestSize) ) {
-      bestBlock = cf;
-      bestSize  = blockSize;
+      return( (VOID *)&UMM_DATA(cf) );
     }
-#elif defined UMM_FIRST_FIT
-    /* This is the first block that fits! */
-    if( (blockSize >= blocks) )
-      break;
-#else
-#  error "No UMM_*_FIT is defined - check umm_malloc_cfg.h"
-#endif
-
-    cf = UMM_NFREE(cf);
   }
 
-  if( 0x7FFFFFFF != bestSize ) {
-    cf        = bestBlock;
-    blockSize = bestSize;
-  }
+  blocks = umm_blocks( size );
+
+  /*
+   * Now we can look up the bins for a space that's big enough to hold
+   * the number of blocks we need.
+   *
+   * This part may be customized to be a best-fit or first-fit algorithm
+   * within a bin.
+   */
+
+  cf = umm_find_free_block( blocks );
 
-  if( UMM_NBLOCK(cf) & UMM_BLOCKNO_MASK && blockSize >= blocks ) {
+  if( cf ) {
     /*
      * This is an existing block in the memory heap, we just need to split off
      * what we need, unlink it from the free list and mark it as in use, and
@@ -443,38 +940,27 @@ VOID *UmmMalloc( UINT32 size ) {
      * block on the free list...
      */
 
-    if( blockSize == blocks ) {
-      /* It's an exact fit and we don't neet to split off a block. */
-      DBGLOG_DEBUG( "Allocating %6i blocks starting at %6i - exact\n", blocks, cf );
+    blockSize = UMM_BLOCKSIZE(cf);
 
-      /* Disconnect this block from the FREE list */
+    /* Disconnect this block from the FREE list */
 
-      umm_disconnect_from_free_list( cf );
+    umm_disconnect_from_free_list( cf );
 
+    if( blockSize == blocks ) {
+      /* It's an exact fit and we don't neet to split off a block. */
+      DBGLOG_DEBUG( "Allocating %6i blocks starting at %6i - exact\n", blocks, cf );
     } else {
       /* It's not an exact fit and we need to split off a block. */
       DBGLOG_DEBUG( "Allocating %6i blocks starting at %6i - existing\n", blocks, cf );
 
       /*
        * split current free block `cf` into two blocks. The first one will be
-       * returned to user, so it's not free, and the second one will be free.
+       * returned to user, so it's not free, and the second one goes to the
+       * bin matching its new size.
        */
-      umm_split_block( cf, blocks, UMM_FREELIST_MASK /*new block is free*/ );
-
-      /*
-       * `umm_split_block()` does not update the free pointers (it affects
-       * only free flags), but effectively we've just moved beginning of the
-       * free block from `cf` to `cf + blocks`. So we have to adjust pointers
-       * to and from adjacent free blocks.
-       */
-
-      /* previous free block */
-      UMM_NFREE( UMM_PFREE(cf) ) = cf + blocks;
-      UMM_PFREE( cf + blocks ) = UMM_PFREE(cf);
+      umm_split_block( cf, blocks, 0 );
 
-      /* next free block */
-      UMM_PFREE( UMM_NFREE(cf) ) = cf + blocks;
-      UMM_NFREE( cf + blocks ) = UMM_NFREE(cf);
+      umm_connect_to_free_list( cf + blocks );
     }
   } else {
     /* Out of memory */
@@ -487,6 +973,8 @@ VOID *UmmMalloc( UINT32 size ) {
     return( (VOID *)NULL );
   }
 
+  umm_account_alloc( cf, size );
+
   /* Release the critical section... */
   UMM_CRITICAL_EXIT();
 
@@ -494,3 +982,167 @@ VOID *UmmMalloc( UINT32 size ) {
 }
 
 /* ------------------------------------------------------------------------ */
+
+VOID *UmmMallocAligned( UINT32 size, UINT32 alignment ) {
+  UINT32 blocks;
+  UINT32 step;
+  UINT32 c;
+
+  if( !UmmInitialized() )
+    return NULL;
+
+  if( 0 == size || 0 == alignment || (alignment & (alignment - 1)) )
+    return( (VOID *)NULL );
+
+  /* Regular allocations are aligned to the header size already */
+  if( alignment <= sizeof(umm_ptr) )
+    return UmmMalloc( size );
+
+  if( size > MAX_UINT32 - sizeof(umm_block) )
+    return( (VOID *)NULL );
+
+  /* Protect the critical section... */
+  UMM_CRITICAL_ENTRY();
+
+  /*
+   * The data starts at a block boundary that satisfies the alignment, and the
+   * block before it holds only the header. The rest of the header block is
+   * wasted, so this is meant for buffers that really need the alignment.
+   */
+
+  step   = alignment > sizeof(umm_block) ? alignment / (UINT32)sizeof(umm_block) : 1;
+  blocks = 1 + (size + (UINT32)sizeof(umm_block) - 1) / (UINT32)sizeof(umm_block);
+
+  c = umm_aligned_block( blocks, step, 1 );
+
+  if( c ) {
+    DBGLOG_DEBUG( "Allocating %6i blocks starting at %6i - aligned\n", blocks, c );
+
+    umm_account_alloc( c, size );
+  }
+
+  /* Release the critical section... */
+  UMM_CRITICAL_EXIT();
+
+  return c ? (VOID *)&UMM_BLOCK(c + 1) : NULL;
+}
+
+/* ------------------------------------------------------------------------ */
+
+VOID *UmmRealloc( VOID *ptr, UINT32 size ) {
+  UINT8 *cptr = (UINT8 *)ptr;
+  UINT8 *nptr;
+  UINT32 c;
+  UINT32 blocks;
+  UINT32 blockSize;
+  UINT32 next;
+  UINTN  used;
+
+  if( !UmmInitialized() )
+    return NULL;
+
+  if( (VOID *)0 == ptr )
+    return UmmMalloc( size );
+
+  if (cptr < default_umm_heap || cptr >= default_umm_heap + UMM_MALLOC_CFG_HEAP_SIZE)
+    return NULL;
+
+  if( 0 == size ) {
+    UmmFree( ptr );
+    return NULL;
+  }
+
+  /* Protect the critical section... */
+  UMM_CRITICAL_ENTRY();
+
+  c = umm_ptr_block( cptr );
+
+  /*
+   * Count the blocks needed from `c`, the header and any alignment gap before
+   * `ptr` are kept, so that the data does not move.
+   */
+
+  blocks = (UINT32)((cptr - (UINT8 *)&UMM_BLOCK(c) + (UINTN)size + sizeof(umm_block) - 1) / sizeof(umm_block));
+  used   = (UINTN)UMM_BLOCKSIZE(c) * sizeof(umm_block);
+
+  blockSize = UMM_BLOCKSIZE(c);
+  next      = UMM_NBLOCK(c) & UMM_BLOCKNO_MASK;
+
+  /* Absorb the following block if it is free and together they are enough */
+
+  if( blocks > blockSize
+    && (UMM_NBLOCK(next) & UMM_FREELIST_MASK)
+    && blocks <= blockSize + UMM_BLOCKSIZE(next) ) {
+    umm_assimilate_up( c );
+    blockSize = UMM_BLOCKSIZE(c);
+  }
+
+  if( blockSize >= blocks ) {
+    /* Give the excess back to the bins if there is any */
+    if( blockSize > blocks ) {
+      umm_split_block( c, blocks, 0 );
+      umm_release_block( c + blocks );
+    }
+
+    umm_stats.UsedSize += (UINT64)blocks * sizeof(umm_block) - used;
+    if( umm_stats.UsedSize > umm_stats.PeakUsedSize )
+      umm_stats.PeakUsedSize = umm_stats.UsedSize;
+
+    DBGLOG_DEBUG( "Reallocating %6i blocks starting at %6i - in place\n", blocks, c );
+
+    /* Release the critical section... */
+    UMM_CRITICAL_EXIT();
+
+    return ptr;
+  }
+
+  /* Release the critical section... */
+  UMM_CRITICAL_EXIT();
+
+  /* Have to move, the old allocation stays intact if we cannot */
+
+  nptr = UmmMalloc( size );
+  if( (VOID *)0 == nptr )
+    return NULL;
+
+  used = umm_ptr_size( c, cptr );
+  CopyMem( nptr, cptr, used < size ? used : size );
+
+  UmmFree( ptr );
+
+  return nptr;
+}
+
+/* ------------------------------------------------------------------------ */
+
+VOID UmmGetStats( UMM_STATS *stats ) {
+  UINT32 bin;
+  UINT32 cf;
+  UINT64 blockSize;
+
+  UMM_CRITICAL_ENTRY();
+
+  CopyMem( stats, &umm_stats, sizeof(*stats) );
+
+  stats->HeapSize    = UMM_MALLOC_CFG_HEAP_SIZE;
+  stats->InitSize    = UmmInitialized() ? (UINT64)umm_limit * sizeof(umm_block) : 0;
+  stats->LargestFree = 0;
+  stats->FreeBlocks  = 0;
+
+  for( bin = 0; bin < UMM_NUM_BINS; ++bin ) {
+    for( cf = umm_bins[bin]; cf; cf = UMM_NFREE(cf) ) {
+      blockSize = UMM_BLOCKSIZE(cf);
+      if( blockSize > stats->LargestFree )
+        stats->LargestFree = blockSize;
+      stats->FreeBlocks++;
+    }
+  }
+
+  /* The header is not available for data */
+  if( stats->LargestFree )
+    stats->LargestFree = stats->LargestFree * sizeof(umm_block) - sizeof(umm_ptr);
+
+  UMM_CRITICAL_EXIT();
+}
+
+/* ------------------------------------------------------------------------ */
@@ -29,6 +29,22 @@
 #ifndef UMM_MALLOC_H
 #define UMM_MALLOC_H
 
+#define UMM_HISTOGRAM_SIZE 32
+
+typedef struct {
+  UINT64 HeapSize;
+  UINT64 InitSize;
+  UINT64 UsedSize;
+  UINT64 PeakUsedSize;
+  UINT64 Allocs;
+  UINT64 Frees;
+  UINT64 LargestFree;
+  UINT64 FreeBlocks;
+  UINT64 MagazineHits;
+  UINT64 MagazineMisses;
+  UINT64 Histogram[UMM_HISTOGRAM_SIZE];
+} UMM_STATS;
+
 BOOLEAN
 UmmInitialized (
   VOID
@@ -44,9 +60,26 @@ UmmMalloc (
   UINT32 Size
   );
 
+VOID *
+UmmMallocAligned (
+  UINT32 Size,
+  UINT32 Alignment
+  );
+
+VOID *
+UmmRealloc (
+  VOID   *Ptr,
+  UINT32 Size
+  );
+
 BOOLEAN
 UmmFree (
   VOID *Ptr
   );
 
+VOID
+UmmGetStats (
+  UMM_STATS *Stats
+  );
+
 #endif /* UMM_MALLOC_H */
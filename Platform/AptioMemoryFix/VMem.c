@@ -7,18 +7,84 @@
 **/
 
 #include <Library/UefiLib.h>
+#include <Library/BaseLib.h>
 #include <Library/BaseMemoryLib.h>
 #include <Library/DebugLib.h>
+#include <Library/UefiBootServicesTableLib.h>
 
 #include "Config.h"
 #include "VMem.h"
 #include "Lib.h"
 
 /** Memory allocation for VM map pages that we will create with VmMapVirtualPage.
-  * We need to have it preallocated during boot services.
+  * We need to have it preallocated during boot services, so it is sized from the runtime
+  * areas in the memory map and grown when GetMemoryMap reports more of them.
   */
-UINT8  *VmMemoryPool = NULL;
-INTN   VmMemoryPoolFreePages = 0;
+UINT8                 *VmMemoryPool = NULL;
+INTN                  VmMemoryPoolFreePages = 0;
+EFI_PHYSICAL_ADDRESS  VmMemoryPoolBase = 0;
+UINTN                 VmMemoryPoolPages = 0;
+
+/** 1GB page support reported by CPUID, -1 until checked. */
+INTN   VmPage1GbSupport = -1;
+
+/** Direct-mapped translation cache used by GetPhysicalAddr, keyed by 2MB virtual frame.
+  * An entry holds the 2MB frame start for 2MB and 1GB pages or the PTE table for 4KB pages,
+  * so every translation takes a single probe. Entries from older generations are invalid,
+  * VmMapVirtualPages and VmFlashCaches start a new one.
+  */
+#define VM_TLB_ENTRIES  128
+
+typedef struct {
+  PAGE_MAP_AND_DIRECTORY_POINTER  *PageTable;
+  UINT64                          VirtualFrame;
+  PAGE_TABLE_4K_ENTRY             *PTE4K;
+  EFI_PHYSICAL_ADDRESS            FrameStart;
+  UINTN                           Generation;
+} VM_TLB_ENTRY;
+
+STATIC VM_TLB_ENTRY  mVmTlb[VM_TLB_ENTRIES];
+STATIC UINTN         mVmTlbGeneration = 1;
+
+/** Page table trace events, see VmPrintTrace for their decoding. */
+typedef enum {
+  VmTraceWalk,          // Value is virtual address looked up
+  VmTraceMap,           // Value is virtual address mapped
+  VmTraceMapTarget,     // Value is physical address mapped
+  VmTraceMapPages,      // Value is number of pages mapped
+  VmTraceEntry,         // Level and Index of entry read or written, Value is its contents
+  VmTraceRun,           // Level and Index of first 4KB entry written, Value is number of entries
+  VmTraceTable          // Level of new table, Index is 1 if it splits a large page, Value is its address
+} VM_TRACE_EVENT;
+
+typedef struct {
+  UINT8   Event;
+  UINT8   Level;
+  UINT16  Index;
+  UINT32  Reserved;
+  UINT64  Value;
+} VM_TRACE_RECORD;
+
+#if APTIOFIX_VMEM_TRACE && !defined (MDEPKG_NDEBUG)
+
+STATIC VM_TRACE_RECORD  mVmTrace[APTIOFIX_VMEM_TRACE_SIZE];
+STATIC UINTN            mVmTraceCount;
+
+#define VM_TRACE(TraceEvent, TraceLevel, TraceIndex, TraceValue)                        \
+  do {                                                                                  \
+    VM_TRACE_RECORD  *Record_;                                                          \
+    Record_ = &mVmTrace[mVmTraceCount++ & (APTIOFIX_VMEM_TRACE_SIZE - 1)];             \
+    Record_->Event = (UINT8)(TraceEvent);                                               \
+    Record_->Level = (UINT8)(TraceLevel);                                               \
+    Record_->Index = (UINT16)(TraceIndex);                                              \
+    Record_->Value = (UINT64)(TraceValue);                                              \
+  } while (0)
+
+#else
+
+#define VM_TRACE(TraceEvent, TraceLevel, TraceIndex, TraceValue) do { } while (0)
+
+#endif
 
 VOID
 GetCurrentPageTable (
@@ -30,7 +96,7 @@ GetCurrentPageTable (
 
   CR3 = AsmReadCr3();
   DEBUG ((DEBUG_VERBOSE, "GetCurrentPageTable: CR3 = 0x%lx\n", CR3));
-  *PageTable = (PAGE_MAP_AND_DIRECTORY_POINTER*)(UINTN)(CR3 & CR3_ADDR_MASK);
+  *PageTable = (PAGE_MAP_AND_DIRECTORY_POINTER*)VMEM_PHYS_TO_PTR (CR3 & CR3_ADDR_MASK);
   *Flags = CR3 & (CR3_FLAG_PWT | CR3_FLAG_PCD);
 }
 
@@ -80,7 +146,7 @@ PrintPageTablePDE (
         (PT2M->Uint64 & ~PT_ADDR_MASK_2M), VA.Uint64, VA.Uint64 + 0x200000 - 1, Start, Start + 0x200000 - 1));
     } else {
       DEBUG ((DEBUG_VERBOSE, "  Fl: %lx %lx ->\n", (PDE->Uint64 & ~PT_ADDR_MASK_4K), (PDE->Uint64 & PT_ADDR_MASK_4K)));
-      PTE = (PAGE_TABLE_4K_ENTRY *)(PDE->Uint64 & PT_ADDR_MASK_4K);
+      PTE = (PAGE_TABLE_4K_ENTRY *)VMEM_PHYS_TO_PTR (PDE->Uint64 & PT_ADDR_MASK_4K);
       PrintPageTablePTE(PTE, VA);
     }
     PDE++;
@@ -112,7 +178,7 @@ PrintPageTablePDPE (
         (PT1G->Uint64 & ~PT_ADDR_MASK_1G), VA.Uint64, VA.Uint64 + 0x40000000 - 1, Start, Start + 0x40000000 - 1));
     } else {
       DEBUG ((DEBUG_VERBOSE, "  Fl: %lx %lx ->\n", (PDPE->Uint64 & ~PT_ADDR_MASK_4K), (PDPE->Uint64 & PT_ADDR_MASK_4K)));
-      PDE = (PAGE_MAP_AND_DIRECTORY_POINTER *)(PDPE->Uint64 & PT_ADDR_MASK_4K);
+      PDE = (PAGE_MAP_AND_DIRECTORY_POINTER *)VMEM_PHYS_TO_PTR (PDPE->Uint64 & PT_ADDR_MASK_4K);
       PrintPageTablePDE(PDE, VA);
     }
     PDPE++;
@@ -139,141 +205,270 @@ PrintPageTable (
     VA.Pg4K.PML4Offset = Index;
     VA_FIX_SIGN_EXTEND(VA);
     DEBUG ((DEBUG_VERBOSE, "PML4 %03x at %p = %lx => Fl: %lx %lx ->\n", Index, PML4, PML4->Uint64, (PML4->Uint64 & ~PT_ADDR_MASK_4K), (PML4->Uint64 & PT_ADDR_MASK_4K)));
-    PDPE = (PAGE_MAP_AND_DIRECTORY_POINTER *)(PML4->Uint64 & PT_ADDR_MASK_4K);
+    PDPE = (PAGE_MAP_AND_DIRECTORY_POINTER *)VMEM_PHYS_TO_PTR (PML4->Uint64 & PT_ADDR_MASK_4K);
     PrintPageTablePDPE(PDPE, VA);
     PML4++;
   }
   //WaitForKeyPress(L"END");
 }
 
+/** Walks PageTable for VirtualAddr and returns the physical start and size of the page mapping it.
+ *  For 4KB pages PTE is set to the PTE table, otherwise to NULL.
+ */
+STATIC
 EFI_STATUS
-GetPhysicalAddr (
+VmWalkPageTable (
   PAGE_MAP_AND_DIRECTORY_POINTER   *PageTable,
   EFI_VIRTUAL_ADDRESS              VirtualAddr,
-  EFI_PHYSICAL_ADDRESS             *PhysicalAddr
+  EFI_PHYSICAL_ADDRESS             *PageStart,
+  UINT64                           *PageSize,
+  PAGE_TABLE_4K_ENTRY              **PTE
   )
 {
-  EFI_PHYSICAL_ADDRESS            Start;
   VIRTUAL_ADDR                    VA;
-  VIRTUAL_ADDR                    VAStart;
-  VIRTUAL_ADDR                    VAEnd;
   PAGE_MAP_AND_DIRECTORY_POINTER  *PML4;
   PAGE_MAP_AND_DIRECTORY_POINTER  *PDPE;
   PAGE_MAP_AND_DIRECTORY_POINTER  *PDE;
   PAGE_TABLE_4K_ENTRY             *PTE4K;
-  PAGE_TABLE_2M_ENTRY             *PTE2M;
-  PAGE_TABLE_1G_ENTRY             *PTE1G;
 
   VA.Uint64 = (UINT64)VirtualAddr;
-  //VA_FIX_SIGN_EXTEND(VA);
-  DEBUG ((DEBUG_VERBOSE, "PageTable: %p\n", PageTable));
-  DEBUG ((DEBUG_VERBOSE, "VA: %lx => Indexes PML4=%x, PDP=%x, PD=%x, PT=%x\n",
-    VA.Uint64, VA.Pg4K.PML4Offset, VA.Pg4K.PDPOffset, VA.Pg4K.PDOffset, VA.Pg4K.PTOffset));
+  VM_TRACE (VmTraceWalk, 0, 0, VA.Uint64);
 
   // PML4
   PML4 = PageTable;
   PML4 += VA.Pg4K.PML4Offset;
-  // prepare region start and end
-  VAStart.Uint64 = 0;
-  VAStart.Pg4K.PML4Offset = VA.Pg4K.PML4Offset;
-  VA_FIX_SIGN_EXTEND(VAStart);
-  VAEnd.Uint64 = ~(UINT64)0;
-  VAEnd.Pg4K.PML4Offset = VA.Pg4K.PML4Offset;
-  VA_FIX_SIGN_EXTEND(VAEnd);
-  // print it
-  DEBUG ((DEBUG_VERBOSE, "PML4[%03x] at %p = %lx Region: %lx - %lx\n", VA.Pg4K.PML4Offset, PML4, PML4->Uint64, VAStart.Uint64, VAEnd.Uint64));
+  VM_TRACE (VmTraceEntry, 4, VA.Pg4K.PML4Offset, PML4->Uint64);
   if (!PML4->Bits.Present) {
-    DEBUG ((DEBUG_WARN, "-> Mapping not present!\n"));
+    DEBUG ((DEBUG_WARN, "VA %lx: PML4 mapping not present!\n", VA.Uint64));
     return EFI_NO_MAPPING;
   }
-  DEBUG ((DEBUG_VERBOSE, "-> Nx:%x|A:%x|PCD:%x|PWT:%x|US:%x|RW:%x|P:%x -> %lx\n",
-    PML4->Bits.Nx, PML4->Bits.Accessed,
-    PML4->Bits.CacheDisabled, PML4->Bits.WriteThrough,
-    PML4->Bits.UserSupervisor, PML4->Bits.ReadWrite, PML4->Bits.Present,
-    (PML4->Uint64 & PT_ADDR_MASK_4K)
-    ));
 
   // PDPE
-  PDPE = (PAGE_MAP_AND_DIRECTORY_POINTER *)(PML4->Uint64 & PT_ADDR_MASK_4K);
+  PDPE = (PAGE_MAP_AND_DIRECTORY_POINTER *)VMEM_PHYS_TO_PTR (PML4->Uint64 & PT_ADDR_MASK_4K);
   PDPE += VA.Pg4K.PDPOffset;
-  VAStart.Pg4K.PDPOffset = VA.Pg4K.PDPOffset;
-  VAEnd.Pg4K.PDPOffset = VA.Pg4K.PDPOffset;
-  DEBUG ((DEBUG_VERBOSE, "PDPE[%03x] at %p = %lx Region: %lx - %lx\n", VA.Pg4K.PDPOffset, PDPE, PDPE->Uint64, VAStart.Uint64, VAEnd.Uint64));
+  VM_TRACE (VmTraceEntry, 3, VA.Pg4K.PDPOffset, PDPE->Uint64);
   if (!PDPE->Bits.Present) {
-    DEBUG ((DEBUG_WARN, "-> Mapping not present!\n"));
+    DEBUG ((DEBUG_WARN, "VA %lx: PDPE mapping not present!\n", VA.Uint64));
     return EFI_NO_MAPPING;
   }
   if (PDPE->Bits.MustBeZero & 0x1) {
     // 1GB PDPE
-    PTE1G = (PAGE_TABLE_1G_ENTRY *)PDPE;
-    DEBUG ((DEBUG_VERBOSE, "-> Nx:%x|G:%x|PAT:%x|D:%x|A:%x|PCD:%x|PWT:%x|US:%x|RW:%x|P:%x\n",
-      PTE1G->Bits.Nx, PTE1G->Bits.Global, PTE1G->Bits.PAT,
-      PTE1G->Bits.Dirty, PTE1G->Bits.Accessed,
-      PTE1G->Bits.CacheDisabled, PTE1G->Bits.WriteThrough,
-      PTE1G->Bits.UserSupervisor, PTE1G->Bits.ReadWrite, PTE1G->Bits.Present
-      ));
-    Start = (PTE1G->Uint64 & PT_ADDR_MASK_1G);
-    *PhysicalAddr = Start + VA.Pg1G.PhysPgOffset;
-    DEBUG ((DEBUG_VERBOSE, "-> 1GB page %lx - %lx => %lx\n", Start, Start + 0x40000000 - 1, *PhysicalAddr));
+    *PageStart = (PDPE->Uint64 & PT_ADDR_MASK_1G);
+    *PageSize = BASE_1GB;
+    *PTE = NULL;
     return EFI_SUCCESS;
   }
-  DEBUG ((DEBUG_VERBOSE, "-> Nx:%x|A:%x|PCD:%x|PWT:%x|US:%x|RW:%x|P:%x -> %lx\n",
-    PDPE->Bits.Nx, PDPE->Bits.Accessed,
-    PDPE->Bits.CacheDisabled, PDPE->Bits.WriteThrough,
-    PDPE->Bits.UserSupervisor, PDPE->Bits.ReadWrite, PDPE->Bits.Present,
-    (PDPE->Uint64 & PT_ADDR_MASK_4K)
-    ));
 
   // PDE
-  PDE = (PAGE_MAP_AND_DIRECTORY_POINTER *)(PDPE->Uint64 & PT_ADDR_MASK_4K);
+  PDE = (PAGE_MAP_AND_DIRECTORY_POINTER *)VMEM_PHYS_TO_PTR (PDPE->Uint64 & PT_ADDR_MASK_4K);
   PDE += VA.Pg4K.PDOffset;
-  VAStart.Pg4K.PDOffset = VA.Pg4K.PDOffset;
-  VAEnd.Pg4K.PDOffset = VA.Pg4K.PDOffset;
-  DEBUG ((DEBUG_VERBOSE, "PDE[%03x] at %p = %lx Region: %lx - %lx\n", VA.Pg4K.PDOffset, PDE, PDE->Uint64, VAStart.Uint64, VAEnd.Uint64));
+  VM_TRACE (VmTraceEntry, 2, VA.Pg4K.PDOffset, PDE->Uint64);
   if (!PDE->Bits.Present) {
-    DEBUG ((DEBUG_WARN, "-> Mapping not present!\n"));
+    DEBUG ((DEBUG_WARN, "VA %lx: PDE mapping not present!\n", VA.Uint64));
     return EFI_NO_MAPPING;
   }
   if (PDE->Bits.MustBeZero & 0x1) {
     // 2MB PDE
-    PTE2M = (PAGE_TABLE_2M_ENTRY *)PDE;
-    DEBUG ((DEBUG_VERBOSE, "-> Nx:%x|G:%x|PAT:%x|D:%x|A:%x|PCD:%x|PWT:%x|US:%x|RW:%x|P:%x\n",
-      PTE2M->Bits.Nx, PTE2M->Bits.Global, PTE2M->Bits.PAT,
-      PTE2M->Bits.Dirty, PTE2M->Bits.Accessed,
-      PTE2M->Bits.CacheDisabled, PTE2M->Bits.WriteThrough,
-      PTE2M->Bits.UserSupervisor, PTE2M->Bits.ReadWrite, PTE2M->Bits.Present
-      ));
-    Start = (PTE2M->Uint64 & PT_ADDR_MASK_2M);
-    *PhysicalAddr = Start + VA.Pg2M.PhysPgOffset;
-    DEBUG ((DEBUG_VERBOSE, "-> 2MB page %lx - %lx => %lx\n", Start, Start + 0x200000 - 1, *PhysicalAddr));
+    *PageStart = (PDE->Uint64 & PT_ADDR_MASK_2M);
+    *PageSize = BASE_2MB;
+    *PTE = NULL;
     return EFI_SUCCESS;
   }
-  DEBUG ((DEBUG_VERBOSE, "-> Nx:%x|A:%x|PCD:%x|PWT:%x|US:%x|RW:%x|P:%x -> %lx\n",
-    PDE->Bits.Nx, PDE->Bits.Accessed,
-    PDE->Bits.CacheDisabled, PDE->Bits.WriteThrough,
-    PDE->Bits.UserSupervisor, PDE->Bits.ReadWrite, PDE->Bits.Present,
-    (PDE->Uint64 & PT_ADDR_MASK_4K)
-    ));
 
   // PTE
-  PTE4K = (PAGE_TABLE_4K_ENTRY *)(PDE->Uint64 & PT_ADDR_MASK_4K);
+  PTE4K = (PAGE_TABLE_4K_ENTRY *)VMEM_PHYS_TO_PTR (PDE->Uint64 & PT_ADDR_MASK_4K);
   PTE4K += VA.Pg4K.PTOffset;
-  VAStart.Pg4K.PTOffset = VA.Pg4K.PTOffset;
-  VAEnd.Pg4K.PTOffset = VA.Pg4K.PTOffset;
-  DEBUG ((DEBUG_VERBOSE, "PTE[%03x] at %p = %lx Region: %lx - %lx\n", VA.Pg4K.PTOffset, PTE4K, PTE4K->Uint64, VAStart.Uint64, VAEnd.Uint64));
+  VM_TRACE (VmTraceEntry, 1, VA.Pg4K.PTOffset, PTE4K->Uint64);
   if (!PTE4K->Bits.Present) {
-    DEBUG ((DEBUG_WARN, "-> Mapping not present!\n"));
+    DEBUG ((DEBUG_WARN, "VA %lx: PTE mapping not present!\n", VA.Uint64));
     return EFI_NO_MAPPING;
   }
-  DEBUG ((DEBUG_VERBOSE, "-> Nx:%x|G:%x|PAT:%x|D:%x|A:%x|PCD:%x|PWT:%x|US:%x|RW:%x|P:%x -> %lx\n",
-    PTE4K->Bits.Nx, PTE4K->Bits.Global, PTE4K->Bits.PAT,
-    PTE4K->Bits.Dirty, PTE4K->Bits.Accessed,
-    PTE4K->Bits.CacheDisabled, PTE4K->Bits.WriteThrough,
-    PTE4K->Bits.UserSupervisor, PTE4K->Bits.ReadWrite, PTE4K->Bits.Present,
-    (PTE4K->Uint64 & PT_ADDR_MASK_4K)
-    ));
-  Start = (PTE4K->Uint64 & PT_ADDR_MASK_4K);
-  *PhysicalAddr = Start + VA.Pg4K.PhysPgOffset;
+
+  *PageStart = (PTE4K->Uint64 & PT_ADDR_MASK_4K);
+  *PageSize = BASE_4KB;
+  *PTE = PTE4K - VA.Pg4K.PTOffset;
+
+  return EFI_SUCCESS;
+}
+
+/** Returns the physical start and size of the page mapping VirtualAddr, from the translation cache if possible.
+ *  Large pages found in the cache are reported as 2MB pages.
+ */
+STATIC
+EFI_STATUS
+VmTranslate (
+  PAGE_MAP_AND_DIRECTORY_POINTER   *PageTable,
+  EFI_VIRTUAL_ADDRESS              VirtualAddr,
+  EFI_PHYSICAL_ADDRESS             *PageStart,
+  UINT64                           *PageSize
+  )
+{
+  EFI_STATUS                      Status;
+  VM_TLB_ENTRY                    *Entry;
+  PAGE_TABLE_4K_ENTRY             *PTE4K;
+  UINT64                          Frame;
+
+  Frame = RShiftU64 (VirtualAddr, 21);
+  Entry = &mVmTlb[(UINTN)Frame & (VM_TLB_ENTRIES - 1)];
+
+  if (Entry->Generation == mVmTlbGeneration && Entry->VirtualFrame == Frame && Entry->PageTable == PageTable) {
+    if (Entry->PTE4K == NULL) {
+      *PageStart = Entry->FrameStart;
+      *PageSize  = BASE_2MB;
+      return EFI_SUCCESS;
+    }
+
+    PTE4K = Entry->PTE4K + ((UINTN)RShiftU64 (VirtualAddr, 12) & 0x1FF);
+    if (PTE4K->Bits.Present) {
+      *PageStart = (PTE4K->Uint64 & PT_ADDR_MASK_4K);
+      *PageSize  = BASE_4KB;
+      return EFI_SUCCESS;
+    }
+  }
+
+  Status = VmWalkPageTable (PageTable, VirtualAddr, PageStart, PageSize, &PTE4K);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  Entry->PageTable    = PageTable;
+  Entry->VirtualFrame = Frame;
+  Entry->PTE4K        = PTE4K;
+  Entry->FrameStart   = *PageStart + (VirtualAddr & (*PageSize - 1) & ~(BASE_2MB - 1));
+  Entry->Generation   = mVmTlbGeneration;
+
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+GetPhysicalAddr (
+  PAGE_MAP_AND_DIRECTORY_POINTER   *PageTable,
+  EFI_VIRTUAL_ADDRESS              VirtualAddr,
+  EFI_PHYSICAL_ADDRESS             *PhysicalAddr
+  )
+{
+  EFI_STATUS                      Status;
+  EFI_PHYSICAL_ADDRESS            PageStart;
+  UINT64                          PageSize;
+
+  Status = VmTranslate (PageTable, VirtualAddr, &PageStart, &PageSize);
+  if (!EFI_ERROR (Status)) {
+    *PhysicalAddr = PageStart + (VirtualAddr & (PageSize - 1));
+  }
+
+  return Status;
+}
+
+EFI_STATUS
+GetPhysicalAddrs (
+  PAGE_MAP_AND_DIRECTORY_POINTER   *PageTable,
+  CONST EFI_VIRTUAL_ADDRESS        *VirtualAddrs,
+  UINTN                            Count,
+  EFI_PHYSICAL_ADDRESS             *PhysicalAddrs
+  )
+{
+  EFI_STATUS                      Status;
+  EFI_VIRTUAL_ADDRESS             PageVirtual;
+  EFI_PHYSICAL_ADDRESS            PageStart;
+  UINT64                          PageSize;
+  UINTN                           Index;
+
+  Status      = EFI_SUCCESS;
+  PageVirtual = 0;
+  PageStart   = 0;
+  PageSize    = 0;
+
+  for (Index = 0; Index < Count; Index++) {
+    //
+    // Sorted addresses mostly fall into the page translated last.
+    //
+    if (PageSize == 0 || (VirtualAddrs[Index] & ~(PageSize - 1)) != PageVirtual) {
+      if (EFI_ERROR (VmTranslate (PageTable, VirtualAddrs[Index], &PageStart, &PageSize))) {
+        PhysicalAddrs[Index] = 0;
+        PageSize = 0;
+        Status = EFI_NO_MAPPING;
+        continue;
+      }
+      PageVirtual = VirtualAddrs[Index] & ~(PageSize - 1);
+    }
+
+    PhysicalAddrs[Index] = PageStart + (VirtualAddrs[Index] - PageVirtual);
+  }
+
+  return Status;
+}
+
+/** Returns the maximum number of regions of 2^Shift pages that NumPages pages may span. */
+STATIC
+UINTN
+VmMaxRegionSpan (
+  UINT64  NumPages,
+  UINTN   Shift
+  )
+{
+  return (UINTN)RShiftU64 (NumPages + LShiftU64 (1, Shift) - 2, Shift) + 1;
+}
+
+/** Returns the number of page table pages needed to map runtime areas in MemoryMap. */
+UINTN
+VmEstimateTablePages (
+  IN UINTN                  MemoryMapSize,
+  IN EFI_MEMORY_DESCRIPTOR  *MemoryMap,
+  IN UINTN                  DescriptorSize
+  )
+{
+  UINTN                  Pages;
+  UINTN                  NumEntries;
+  UINTN                  Index;
+  EFI_MEMORY_DESCRIPTOR  *Desc;
+
+  Pages      = 0;
+  Desc       = MemoryMap;
+  NumEntries = MemoryMapSize / DescriptorSize;
+
+  for (Index = 0; Index < NumEntries; Index++) {
+    //
+    // Same areas as ExecSetVirtualAddressesToMemMap maps. Virtual addresses are not assigned yet,
+    // so assume that every 2MB, 1GB and 512GB region an area may span needs a table of its own.
+    //
+    if (Desc->NumberOfPages > 0 && Desc->Type != EfiReservedMemoryType && (Desc->Attribute & EFI_MEMORY_RUNTIME) != 0) {
+      Pages += VmMaxRegionSpan (Desc->NumberOfPages, 9);
+      Pages += VmMaxRegionSpan (Desc->NumberOfPages, 18);
+      Pages += VmMaxRegionSpan (Desc->NumberOfPages, 27);
+    }
+
+    Desc = NEXT_MEMORY_DESCRIPTOR (Desc, DescriptorSize);
+  }
+
+  return Pages;
+}
+
+/** Replaces vm memory pool with a new one of NumPages pages. Must not be called once the pool is in use. */
+STATIC
+EFI_STATUS
+VmReserveMemoryPool (
+  IN UINTN  NumPages
+  )
+{
+  EFI_STATUS              Status;
+  EFI_PHYSICAL_ADDRESS    Addr;
+
+  Addr = BASE_4GB; // max address
+
+  Status = AllocatePagesFromTop (EfiBootServicesData, NumPages, &Addr, FALSE);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  if (VmMemoryPoolPages > 0) {
+    gBS->FreePages (VmMemoryPoolBase, VmMemoryPoolPages);
+  }
+
+  VmMemoryPoolBase      = Addr;
+  VmMemoryPoolPages     = NumPages;
+  VmMemoryPool          = (UINT8*)VMEM_PHYS_TO_PTR (Addr);
+  VmMemoryPoolFreePages = (INTN)NumPages;
+  DEBUG ((DEBUG_VERBOSE, "VmMemoryPool = %lx - %lx\n", VmMemoryPool, VmMemoryPool + EFI_PAGES_TO_SIZE(VmMemoryPoolFreePages) - 1));
 
   return EFI_SUCCESS;
 }
@@ -285,27 +480,78 @@ VmAllocateMemoryPool (
   )
 {
   EFI_STATUS              Status;
-  EFI_PHYSICAL_ADDRESS    Addr;
+  UINTN                   MemoryMapSize;
+  EFI_MEMORY_DESCRIPTOR   *MemoryMap;
+  UINTN                   DescriptorSize;
+  UINTN                   NumPages;
 
-  if (VmMemoryPool != NULL) {
+  if (VmMemoryPoolPages > 0) {
     // already allocated
     return EFI_SUCCESS;
   }
 
-  VmMemoryPoolFreePages = 0x200; // 2 MB should be enough
-  Addr = BASE_4GB; // max address
+  Status = GetMemoryMapSnapshot (&MemoryMapSize, &MemoryMap, &DescriptorSize, NULL);
+  if (EFI_ERROR (Status)) {
+    PrintScreen (L"AMF: vm memory pool allocation failure - %r\n", Status);
+    return Status;
+  }
+
+  NumPages = VmEstimateTablePages (MemoryMapSize, MemoryMap, DescriptorSize);
 
-  Status = AllocatePagesFromTop (EfiBootServicesData, VmMemoryPoolFreePages, &Addr, FALSE);
-  if (Status != EFI_SUCCESS) {
+  Status = VmReserveMemoryPool (NumPages);
+  if (EFI_ERROR (Status)) {
     PrintScreen (L"AMF: vm memory pool allocation failure - %r\n", Status);
-  } else {
-    VmMemoryPool = (UINT8*)Addr;
-    DEBUG ((DEBUG_VERBOSE, "VmMemoryPool = %lx - %lx\n", VmMemoryPool, VmMemoryPool + EFI_PAGES_TO_SIZE(VmMemoryPoolFreePages) - 1));
   }
   return Status;
 }
 
-/** Central method for allocating pages for VM page maps. */
+/** Grows vm memory pool if runtime areas in MemoryMap need more page table pages than reserved.
+ *  Returns TRUE if the pool was reallocated, in which case MemoryMap is outdated.
+ */
+BOOLEAN
+VmUpdateMemoryPool (
+  IN UINTN                  MemoryMapSize,
+  IN EFI_MEMORY_DESCRIPTOR  *MemoryMap,
+  IN UINTN                  DescriptorSize
+  )
+{
+  EFI_STATUS              Status;
+  UINTN                   NumPages;
+
+  //
+  // Page tables are only built after ExitBootServices, a pool in use cannot be replaced.
+  //
+  if (VmMemoryPoolPages == 0 || VmMemoryPoolFreePages != (INTN)VmMemoryPoolPages) {
+    return FALSE;
+  }
+
+  NumPages = VmEstimateTablePages (MemoryMapSize, MemoryMap, DescriptorSize);
+  if (NumPages <= VmMemoryPoolPages) {
+    return FALSE;
+  }
+
+  DEBUG ((DEBUG_INFO, "Growing vm memory pool from %u to %u pages\n", VmMemoryPoolPages, NumPages));
+  Status = VmReserveMemoryPool (NumPages);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_WARN, "Failed to grow vm memory pool - %r\n", Status));
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/** Returns vm memory pool size and its high-water usage, both in pages. */
+VOID
+VmGetMemoryPoolStats (
+  OUT UINTN  *TotalPages,
+  OUT UINTN  *UsedPages
+  )
+{
+  *TotalPages = VmMemoryPoolPages;
+  *UsedPages  = VmMemoryPoolPages - (UINTN)VmMemoryPoolFreePages;
+}
+
+/** Central method for allocating pages for VM page maps. Returns NULL when the pool is exhausted. */
 VOID *
 VmAllocatePages (
   UINTN NumPages
@@ -318,42 +564,47 @@ VmAllocatePages (
     VmMemoryPool += EFI_PAGES_TO_SIZE(NumPages);
     VmMemoryPoolFreePages -= NumPages;
   } else {
-    DEBUG ((DEBUG_VERBOSE, "VmAllocatePages - no more pages!\n"));
-    CpuDeadLoop();
+    DEBUG ((DEBUG_WARN, "VmAllocatePages - no more pages!\n"));
   }
   return AllocatedPages;
 }
 
-/** Maps (remaps) 4K page given by VirtualAddr to PhysicalAddr page in PageTable. */
-EFI_STATUS
-VmMapVirtualPage (
+/** Returns TRUE if the CPU supports 1GB pages. */
+STATIC
+BOOLEAN
+VmHas1GbPages (
+  VOID
+  )
+{
+  UINT32  MaxExtId;
+  UINT32  ExtFeatures;
+
+  if (VmPage1GbSupport < 0) {
+    AsmCpuid (0x80000000, &MaxExtId, NULL, NULL, NULL);
+    ExtFeatures = 0;
+    if (MaxExtId >= 0x80000001) {
+      AsmCpuid (0x80000001, NULL, NULL, NULL, &ExtFeatures);
+    }
+    // CPUID.80000001H:EDX.Page1GB [bit 26]
+    VmPage1GbSupport = (ExtFeatures & BIT26) != 0;
+  }
+
+  return VmPage1GbSupport > 0;
+}
+
+/** Returns PDPE table for PML4 entry, creating it with 1GB identity mapping if not present. */
+STATIC
+PAGE_MAP_AND_DIRECTORY_POINTER *
+VmGetPdpeTable (
   PAGE_MAP_AND_DIRECTORY_POINTER  *PageTable,
-  EFI_VIRTUAL_ADDRESS             VirtualAddr,
-  EFI_PHYSICAL_ADDRESS            PhysicalAddr
+  PAGE_MAP_AND_DIRECTORY_POINTER  *PML4
   )
 {
-  EFI_PHYSICAL_ADDRESS            Start;
-  VIRTUAL_ADDR                    VA;
-  VIRTUAL_ADDR                    VAStart;
-  VIRTUAL_ADDR                    VAEnd;
-  PAGE_MAP_AND_DIRECTORY_POINTER  *PML4;
   PAGE_MAP_AND_DIRECTORY_POINTER  *PDPE;
-  PAGE_MAP_AND_DIRECTORY_POINTER  *PDE;
-  PAGE_TABLE_4K_ENTRY             *PTE4K;
-  PAGE_TABLE_4K_ENTRY             *PTE4KTmp;
-  PAGE_TABLE_2M_ENTRY             *PTE2M;
   PAGE_TABLE_1G_ENTRY             *PTE1G;
+  EFI_PHYSICAL_ADDRESS            Start;
   UINTN                           Index;
 
-  VA.Uint64 = (UINT64)VirtualAddr;
-  //VA_FIX_SIGN_EXTEND(VA);
-  DEBUG ((DEBUG_VERBOSE, "VmMapVirtualPage VA %lx => PA %lx\nPageTable: %p\n", VirtualAddr, PhysicalAddr, PageTable));
-  DEBUG ((DEBUG_VERBOSE, "VA: %lx => Indexes PML4=%x, PDP=%x, PD=%x, PT=%x\n",
-    VA.Uint64, VA.Pg4K.PML4Offset, VA.Pg4K.PDPOffset, VA.Pg4K.PDOffset, VA.Pg4K.PTOffset));
-
-  // PML4
-  PML4 = PageTable;
-  PML4 += VA.Pg4K.PML4Offset;
   // there is a problem if our PML4 points to the same table as first PML4 entry
   // since we may mess the mapping of first virtual region (happens in VBox and probably DUET).
   // check for this on first call and if true, just clear our PML4 - we'll rebuild it in later step
@@ -362,164 +613,148 @@ VmMapVirtualPage (
     PML4->Uint64 = 0;
   }
 
-  // prepare region start and end
-  VAStart.Uint64 = 0;
-  VAStart.Pg4K.PML4Offset = VA.Pg4K.PML4Offset;
-  VA_FIX_SIGN_EXTEND(VAStart);
-  VAEnd.Uint64 = ~(UINT64)0;
-  VAEnd.Pg4K.PML4Offset = VA.Pg4K.PML4Offset;
-  VA_FIX_SIGN_EXTEND(VAEnd);
-  // print it
-  DEBUG ((DEBUG_VERBOSE, "PML4[%03x] at %p = %lx Region: %lx - %lx\n", VA.Pg4K.PML4Offset, PML4, PML4->Uint64, VAStart.Uint64, VAEnd.Uint64));
-  if (!PML4->Bits.Present) {
-    DEBUG ((DEBUG_WARN, "-> Mapping not present, creating new PML4 entry and page with PDPE entries!\n"));
-    PDPE = (PAGE_MAP_AND_DIRECTORY_POINTER *)VmAllocatePages(1);
-    if (PDPE == NULL) {
-      DEBUG ((DEBUG_WARN, "No memory - exiting.\n"));
-      return EFI_NO_MAPPING;
-    }
+  if (PML4->Bits.Present) {
+    return (PAGE_MAP_AND_DIRECTORY_POINTER *)VMEM_PHYS_TO_PTR (PML4->Uint64 & PT_ADDR_MASK_4K);
+  }
 
-    ZeroMem(PDPE, EFI_PAGE_SIZE);
-    // init this whole 512GB region with 512 1GB entry pages to map first 512GB phys space
-    PTE1G = (PAGE_TABLE_1G_ENTRY *)PDPE;
-    Start = 0;
-    for (Index = 0; Index < 512; Index++) {
-      PTE1G->Uint64 = Start & PT_ADDR_MASK_1G;
-      PTE1G->Bits.ReadWrite = 1;
-      PTE1G->Bits.Present = 1;
-      PTE1G->Bits.MustBe1 = 1;
-      PTE1G++;
-      Start += 0x40000000;
-    }
+  PDPE = (PAGE_MAP_AND_DIRECTORY_POINTER *)VmAllocatePages(1);
+  if (PDPE == NULL) {
+    DEBUG ((DEBUG_WARN, "No memory - exiting.\n"));
+    return NULL;
+  }
 
-    // put it to PML4
-    PML4->Uint64 = ((UINT64)PDPE) & PT_ADDR_MASK_4K;
-    PML4->Bits.ReadWrite = 1;
-    PML4->Bits.Present = 1;
-    DEBUG ((DEBUG_VERBOSE, "added to PLM4 as %lx\n", PML4->Uint64));
-    // and continue with mapping ...
+  ZeroMem(PDPE, EFI_PAGE_SIZE);
+  // init this whole 512GB region with 512 1GB entry pages to map first 512GB phys space
+  PTE1G = (PAGE_TABLE_1G_ENTRY *)PDPE;
+  Start = 0;
+  for (Index = 0; Index < 512; Index++) {
+    PTE1G->Uint64 = Start & PT_ADDR_MASK_1G;
+    PTE1G->Bits.ReadWrite = 1;
+    PTE1G->Bits.Present = 1;
+    PTE1G->Bits.MustBe1 = 1;
+    PTE1G++;
+    Start += 0x40000000;
   }
-  DEBUG ((DEBUG_VERBOSE, "-> Nx:%x|A:%x|PCD:%x|PWT:%x|US:%x|RW:%x|P:%x -> %lx\n",
-    PML4->Bits.Nx, PML4->Bits.Accessed,
-    PML4->Bits.CacheDisabled, PML4->Bits.WriteThrough,
-    PML4->Bits.UserSupervisor, PML4->Bits.ReadWrite, PML4->Bits.Present,
-    (PML4->Uint64 & PT_ADDR_MASK_4K)
-    ));
 
-  // PDPE
-  PDPE = (PAGE_MAP_AND_DIRECTORY_POINTER *)(PML4->Uint64 & PT_ADDR_MASK_4K);
-  PDPE += VA.Pg4K.PDPOffset;
-  VAStart.Pg4K.PDPOffset = VA.Pg4K.PDPOffset;
-  VAEnd.Pg4K.PDPOffset = VA.Pg4K.PDPOffset;
-  DEBUG ((DEBUG_VERBOSE, "PDPE[%03x] at %p = %lx Region: %lx - %lx\n", VA.Pg4K.PDPOffset, PDPE, PDPE->Uint64, VAStart.Uint64, VAEnd.Uint64));
-  if (!PDPE->Bits.Present || (PDPE->Bits.MustBeZero & 0x1)) {
-    DEBUG ((DEBUG_WARN, "-> Mapping not present or mapped as 1GB page, creating new PDPE entry and page with PDE entries!\n"));
-    PDE = (PAGE_MAP_AND_DIRECTORY_POINTER *)VmAllocatePages(1);
-    if (PDE == NULL) {
-      DEBUG ((DEBUG_WARN, "No memory - exiting.\n"));
-      return EFI_NO_MAPPING;
-    }
-    ZeroMem(PDE, EFI_PAGE_SIZE);
+  VM_TRACE (VmTraceTable, 3, 0, VMEM_PTR_TO_PHYS (PDPE));
 
-    if (PDPE->Bits.MustBeZero & 0x1) {
-      // was 1GB page - init new PDE array to get the same mapping but with 2MB pages
-      DEBUG ((DEBUG_VERBOSE, "-> was 1GB page, initing new PDE array to get the same mapping but with 2MB pages!\n"));
-      PTE2M = (PAGE_TABLE_2M_ENTRY *)PDE;
-      Start = (PDPE->Uint64 & PT_ADDR_MASK_1G);
-      for (Index = 0; Index < 512; Index++) {
-        PTE2M->Uint64 = Start & PT_ADDR_MASK_2M;
-        PTE2M->Bits.ReadWrite = 1;
-        PTE2M->Bits.Present = 1;
-        PTE2M->Bits.MustBe1 = 1;
-        PTE2M++;
-        Start += 0x200000;
-      }
-    }
+  // put it to PML4
+  PML4->Uint64 = VMEM_PTR_TO_PHYS (PDPE) & PT_ADDR_MASK_4K;
+  PML4->Bits.ReadWrite = 1;
+  PML4->Bits.Present = 1;
 
-    // put it to PDPE
-    PDPE->Uint64 = ((UINT64)PDE) & PT_ADDR_MASK_4K;
-    PDPE->Bits.ReadWrite = 1;
-    PDPE->Bits.Present = 1;
-    DEBUG ((DEBUG_VERBOSE, "added to PDPE as %lx\n", PDPE->Uint64));
-    // and continue with mapping ...
+  return PDPE;
+}
+
+/** Returns PDE table for PDPE entry, creating it or splitting 1GB page into 2MB pages. */
+STATIC
+PAGE_MAP_AND_DIRECTORY_POINTER *
+VmGetPdeTable (
+  PAGE_MAP_AND_DIRECTORY_POINTER  *PDPE
+  )
+{
+  PAGE_MAP_AND_DIRECTORY_POINTER  *PDE;
+  PAGE_TABLE_2M_ENTRY             *PTE2M;
+  EFI_PHYSICAL_ADDRESS            Start;
+  UINTN                           Index;
+
+  if (PDPE->Bits.Present && !(PDPE->Bits.MustBeZero & 0x1)) {
+    return (PAGE_MAP_AND_DIRECTORY_POINTER *)VMEM_PHYS_TO_PTR (PDPE->Uint64 & PT_ADDR_MASK_4K);
   }
-  DEBUG ((DEBUG_VERBOSE, "-> Nx:%x|A:%x|PCD:%x|PWT:%x|US:%x|RW:%x|P:%x -> %lx\n",
-    PDPE->Bits.Nx, PDPE->Bits.Accessed,
-    PDPE->Bits.CacheDisabled, PDPE->Bits.WriteThrough,
-    PDPE->Bits.UserSupervisor, PDPE->Bits.ReadWrite, PDPE->Bits.Present,
-    (PDPE->Uint64 & PT_ADDR_MASK_4K)
-    ));
 
-  // PDE
-  PDE = (PAGE_MAP_AND_DIRECTORY_POINTER *)(PDPE->Uint64 & PT_ADDR_MASK_4K);
-  PDE += VA.Pg4K.PDOffset;
-  VAStart.Pg4K.PDOffset = VA.Pg4K.PDOffset;
-  VAEnd.Pg4K.PDOffset = VA.Pg4K.PDOffset;
-  DEBUG ((DEBUG_VERBOSE, "PDE[%03x] at %p = %lx Region: %lx - %lx\n", VA.Pg4K.PDOffset, PDE, PDE->Uint64, VAStart.Uint64, VAEnd.Uint64));
-  if (!PDE->Bits.Present || (PDE->Bits.MustBeZero & 0x1)) {
-    DEBUG ((DEBUG_WARN, "-> Mapping not present or mapped as 2MB page, creating new PDE entry and page with PTE4K entries!\n"));
-    PTE4K = (PAGE_TABLE_4K_ENTRY *)VmAllocatePages(1);
-    if (PTE4K == NULL) {
-      DEBUG ((DEBUG_WARN, "No memory - exiting.\n"));
-      return EFI_NO_MAPPING;
-    }
-    ZeroMem(PTE4K, EFI_PAGE_SIZE);
+  PDE = (PAGE_MAP_AND_DIRECTORY_POINTER *)VmAllocatePages(1);
+  if (PDE == NULL) {
+    DEBUG ((DEBUG_WARN, "No memory - exiting.\n"));
+    return NULL;
+  }
+  ZeroMem(PDE, EFI_PAGE_SIZE);
 
-    if (PDE->Bits.MustBeZero & 0x1) {
-      // was 2MB page - init new PTE array to get the same mapping but with 4KB pages
-      DEBUG ((DEBUG_VERBOSE, "-> was 2MB page - initing new PTE array to get the same mapping but with 4KB pages!\n"));
-      PTE4KTmp = (PAGE_TABLE_4K_ENTRY *)PTE4K;
-      Start = (PDE->Uint64 & PT_ADDR_MASK_2M);
-      for (Index = 0; Index < 512; Index++) {
-        PTE4KTmp->Uint64 = Start & PT_ADDR_MASK_4K;
-        PTE4KTmp->Bits.ReadWrite = 1;
-        PTE4KTmp->Bits.Present = 1;
-        PTE4KTmp++;
-        Start += 0x1000;
-      }
+  if (PDPE->Bits.MustBeZero & 0x1) {
+    // was 1GB page - init new PDE array to get the same mapping but with 2MB pages
+    PTE2M = (PAGE_TABLE_2M_ENTRY *)PDE;
+    Start = (PDPE->Uint64 & PT_ADDR_MASK_1G);
+    for (Index = 0; Index < 512; Index++) {
+      PTE2M->Uint64 = Start & PT_ADDR_MASK_2M;
+      PTE2M->Bits.ReadWrite = 1;
+      PTE2M->Bits.Present = 1;
+      PTE2M->Bits.MustBe1 = 1;
+      PTE2M++;
+      Start += 0x200000;
     }
+  }
+
+  VM_TRACE (VmTraceTable, 2, PDPE->Bits.MustBeZero & 0x1, VMEM_PTR_TO_PHYS (PDE));
+
+  // put it to PDPE
+  PDPE->Uint64 = VMEM_PTR_TO_PHYS (PDE) & PT_ADDR_MASK_4K;
+  PDPE->Bits.ReadWrite = 1;
+  PDPE->Bits.Present = 1;
+
+  return PDE;
+}
+
+/** Returns PTE table for PDE entry, creating it or splitting 2MB page into 4KB pages. */
+STATIC
+PAGE_TABLE_4K_ENTRY *
+VmGetPteTable (
+  PAGE_MAP_AND_DIRECTORY_POINTER  *PDE
+  )
+{
+  PAGE_TABLE_4K_ENTRY             *PTE4K;
+  PAGE_TABLE_4K_ENTRY             *PTE4KTmp;
+  EFI_PHYSICAL_ADDRESS            Start;
+  UINTN                           Index;
 
-    // put it to PDE
-    PDE->Uint64 = ((UINT64)PTE4K) & PT_ADDR_MASK_4K;
-    PDE->Bits.ReadWrite = 1;
-    PDE->Bits.Present = 1;
-    DEBUG ((DEBUG_VERBOSE, "added to PDE as %lx\n", PDE->Uint64));
-    // and continue with mapping ...
+  if (PDE->Bits.Present && !(PDE->Bits.MustBeZero & 0x1)) {
+    return (PAGE_TABLE_4K_ENTRY *)VMEM_PHYS_TO_PTR (PDE->Uint64 & PT_ADDR_MASK_4K);
   }
-  DEBUG ((DEBUG_VERBOSE, "-> Nx:%x|A:%x|PCD:%x|PWT:%x|US:%x|RW:%x|P:%x -> %lx\n",
-    PDE->Bits.Nx, PDE->Bits.Accessed,
-    PDE->Bits.CacheDisabled, PDE->Bits.WriteThrough,
-    PDE->Bits.UserSupervisor, PDE->Bits.ReadWrite, PDE->Bits.Present,
-    (PDE->Uint64 & PT_ADDR_MASK_4K)
-    ));
 
-  // PTE
-  PTE4K = (PAGE_TABLE_4K_ENTRY *)(PDE->Uint64 & PT_ADDR_MASK_4K);
-  PTE4K += VA.Pg4K.PTOffset;
-  VAStart.Pg4K.PTOffset = VA.Pg4K.PTOffset;
-  VAEnd.Pg4K.PTOffset = VA.Pg4K.PTOffset;
-  DEBUG ((DEBUG_VERBOSE, "PTE[%03x] at %p = %lx Region: %lx - %lx\n", VA.Pg4K.PTOffset, PTE4K, PTE4K->Uint64, VAStart.Uint64, VAEnd.Uint64));
-  if (PTE4K->Bits.Present) {
-    DEBUG ((DEBUG_WARN, "mapping already present - remapping!\n"));
-  }
-  DEBUG ((DEBUG_VERBOSE, "-> Nx:%x|G:%x|PAT:%x|D:%x|A:%x|PCD:%x|PWT:%x|US:%x|RW:%x|P:%x -> %lx\n",
-    PTE4K->Bits.Nx, PTE4K->Bits.Global, PTE4K->Bits.PAT,
-    PTE4K->Bits.Dirty, PTE4K->Bits.Accessed,
-    PTE4K->Bits.CacheDisabled, PTE4K->Bits.WriteThrough,
-    PTE4K->Bits.UserSupervisor, PTE4K->Bits.ReadWrite, PTE4K->Bits.Present,
-    (PTE4K->Uint64 & PT_ADDR_MASK_4K)
-    ));
-  // put it to PTE
-  PTE4K->Uint64 = ((UINT64)PhysicalAddr) & PT_ADDR_MASK_4K;
-  PTE4K->Bits.ReadWrite = 1;
-  PTE4K->Bits.Present = 1;
-  DEBUG ((DEBUG_VERBOSE, "added to PTE4K as %lx\n", PTE4K->Uint64));
+  PTE4K = (PAGE_TABLE_4K_ENTRY *)VmAllocatePages(1);
+  if (PTE4K == NULL) {
+    DEBUG ((DEBUG_WARN, "No memory - exiting.\n"));
+    return NULL;
+  }
+  ZeroMem(PTE4K, EFI_PAGE_SIZE);
 
-  return EFI_SUCCESS;
+  if (PDE->Bits.MustBeZero & 0x1) {
+    // was 2MB page - init new PTE array to get the same mapping but with 4KB pages
+    PTE4KTmp = (PAGE_TABLE_4K_ENTRY *)PTE4K;
+    Start = (PDE->Uint64 & PT_ADDR_MASK_2M);
+    for (Index = 0; Index < 512; Index++) {
+      PTE4KTmp->Uint64 = Start & PT_ADDR_MASK_4K;
+      PTE4KTmp->Bits.ReadWrite = 1;
+      PTE4KTmp->Bits.Present = 1;
+      PTE4KTmp++;
+      Start += 0x1000;
+    }
+  }
 
+  VM_TRACE (VmTraceTable, 1, PDE->Bits.MustBeZero & 0x1, VMEM_PTR_TO_PHYS (PTE4K));
+
+  // put it to PDE
+  PDE->Uint64 = VMEM_PTR_TO_PHYS (PTE4K) & PT_ADDR_MASK_4K;
+  PDE->Bits.ReadWrite = 1;
+  PDE->Bits.Present = 1;
+
+  return PTE4K;
 }
 
-/** Maps (remaps) NumPages 4K pages given by VirtualAddr to PhysicalAddr pages in PageTable. */
+/** Maps (remaps) 4K page given by VirtualAddr to PhysicalAddr page in PageTable. */
+EFI_STATUS
+VmMapVirtualPage (
+  PAGE_MAP_AND_DIRECTORY_POINTER  *PageTable,
+  EFI_VIRTUAL_ADDRESS             VirtualAddr,
+  EFI_PHYSICAL_ADDRESS            PhysicalAddr
+  )
+{
+  return VmMapVirtualPages (PageTable, VirtualAddr, 1, PhysicalAddr);
+}
+
+/** Maps (remaps) NumPages 4K pages given by VirtualAddr to PhysicalAddr pages in PageTable.
+ * The tables are walked once per leaf table rather than once per page. Whenever both addresses
+ * are suitably aligned and enough pages remain, 1GB or 2MB pages are used, so only the range
+ * edges need 4KB tables.
+ */
 EFI_STATUS
 VmMapVirtualPages (
   PAGE_MAP_AND_DIRECTORY_POINTER  *PageTable,
@@ -528,18 +763,155 @@ VmMapVirtualPages (
   EFI_PHYSICAL_ADDRESS            PhysicalAddr
   )
 {
-  EFI_STATUS  Status;
+  VIRTUAL_ADDR                    VA;
+  PAGE_MAP_AND_DIRECTORY_POINTER  *PDPE;
+  PAGE_MAP_AND_DIRECTORY_POINTER  *PDE;
+  PAGE_TABLE_4K_ENTRY             *PTE4K;
+  PAGE_TABLE_2M_ENTRY             *PTE2M;
+  PAGE_TABLE_1G_ENTRY             *PTE1G;
+  UINTN                           Pages;
+  UINTN                           Index;
+
+  VM_TRACE (VmTraceMap, 0, 0, VirtualAddr);
+  VM_TRACE (VmTraceMapTarget, 0, 0, PhysicalAddr);
+  VM_TRACE (VmTraceMapPages, 0, 0, NumPages);
+
+  mVmTlbGeneration++;
+
+  while (NumPages > 0) {
+    VA.Uint64 = (UINT64)VirtualAddr;
+
+    PDPE = VmGetPdpeTable (PageTable, PageTable + VA.Pg4K.PML4Offset);
+    if (PDPE == NULL) {
+      return EFI_NO_MAPPING;
+    }
+    PDPE += VA.Pg4K.PDPOffset;
+
+    if (((VirtualAddr | PhysicalAddr) & (BASE_1GB - 1)) == 0
+      && NumPages >= EFI_SIZE_TO_PAGES (BASE_1GB)
+      && VmHas1GbPages ()) {
+      // whole 1GB page, any PDE table under it is no longer needed
+      PTE1G = (PAGE_TABLE_1G_ENTRY *)PDPE;
+      PTE1G->Uint64 = ((UINT64)PhysicalAddr) & PT_ADDR_MASK_1G;
+      PTE1G->Bits.ReadWrite = 1;
+      PTE1G->Bits.Present = 1;
+      PTE1G->Bits.MustBe1 = 1;
+      VM_TRACE (VmTraceEntry, 3, VA.Pg4K.PDPOffset, PTE1G->Uint64);
+      Pages = EFI_SIZE_TO_PAGES (BASE_1GB);
+    } else {
+      PDE = VmGetPdeTable (PDPE);
+      if (PDE == NULL) {
+        return EFI_NO_MAPPING;
+      }
+      PDE += VA.Pg4K.PDOffset;
+
+      if (((VirtualAddr | PhysicalAddr) & (BASE_2MB - 1)) == 0
+        && NumPages >= EFI_SIZE_TO_PAGES (BASE_2MB)) {
+        // whole 2MB page, any PTE table under it is no longer needed
+        PTE2M = (PAGE_TABLE_2M_ENTRY *)PDE;
+        PTE2M->Uint64 = ((UINT64)PhysicalAddr) & PT_ADDR_MASK_2M;
+        PTE2M->Bits.ReadWrite = 1;
+        PTE2M->Bits.Present = 1;
+        PTE2M->Bits.MustBe1 = 1;
+        VM_TRACE (VmTraceEntry, 2, VA.Pg4K.PDOffset, PTE2M->Uint64);
+        Pages = EFI_SIZE_TO_PAGES (BASE_2MB);
+      } else {
+        PTE4K = VmGetPteTable (PDE);
+        if (PTE4K == NULL) {
+          return EFI_NO_MAPPING;
+        }
+        PTE4K += VA.Pg4K.PTOffset;
+
+        // fill up to the end of this PTE table
+        Pages = MIN (NumPages, 512 - (UINTN)VA.Pg4K.PTOffset);
+        VM_TRACE (VmTraceRun, 1, VA.Pg4K.PTOffset, Pages);
+        for (Index = 0; Index < Pages; Index++) {
+          PTE4K->Uint64 = ((UINT64)PhysicalAddr + EFI_PAGES_TO_SIZE (Index)) & PT_ADDR_MASK_4K;
+          PTE4K->Bits.ReadWrite = 1;
+          PTE4K->Bits.Present = 1;
+          PTE4K++;
+        }
+      }
+    }
+
+    VirtualAddr  += EFI_PAGES_TO_SIZE (Pages);
+    PhysicalAddr += EFI_PAGES_TO_SIZE (Pages);
+    NumPages     -= Pages;
+  }
+
+  return EFI_SUCCESS;
+}
+
+/** Prints recorded page table trace events, oldest first. */
+VOID
+VmPrintTrace (
+  VOID
+  )
+{
+#if APTIOFIX_VMEM_TRACE && !defined (MDEPKG_NDEBUG)
+  STATIC CONST CHAR8  *LevelNames[] = { "", "PTE", "PDE", "PDPE", "PML4" };
+  VM_TRACE_RECORD     *Record;
+  UINTN               Index;
+  UINTN               Start;
+  UINT64              Value;
+
+  Start = 0;
+  if (mVmTraceCount > APTIOFIX_VMEM_TRACE_SIZE) {
+    //
+    // Overwritten records may have cut an event in half, so start at the next walk or mapping.
+    //
+    for (Start = mVmTraceCount - APTIOFIX_VMEM_TRACE_SIZE; Start < mVmTraceCount; Start++) {
+      Record = &mVmTrace[Start & (APTIOFIX_VMEM_TRACE_SIZE - 1)];
+      if (Record->Event == VmTraceWalk || Record->Event == VmTraceMap) {
+        break;
+      }
+    }
+  }
 
-  Status = EFI_SUCCESS;
-  while (NumPages > 0 && (Status == EFI_SUCCESS)) {
-    Status = VmMapVirtualPage(PageTable, VirtualAddr, PhysicalAddr);
-    VirtualAddr += 0x1000;
-    PhysicalAddr += 0x1000;
-    NumPages--;
-    DEBUG ((DEBUG_VERBOSE, "NumPages: %d, %lx => %lx\n", NumPages, VirtualAddr, PhysicalAddr));
-    //WaitForKeyPress(L"press a key to continue\n");
+  DEBUG ((DEBUG_INFO, "VmTrace: %u events, showing last %u\n", mVmTraceCount, mVmTraceCount - Start));
+
+  for (Index = Start; Index < mVmTraceCount; Index++) {
+    Record = &mVmTrace[Index & (APTIOFIX_VMEM_TRACE_SIZE - 1)];
+    Value  = Record->Value;
+
+    switch (Record->Event) {
+      case VmTraceWalk:
+        DEBUG ((DEBUG_INFO, "Walk VA %lx\n", Value));
+        break;
+      case VmTraceMap:
+        DEBUG ((DEBUG_INFO, "Map VA %lx", Value));
+        break;
+      case VmTraceMapTarget:
+        DEBUG ((DEBUG_INFO, " => PA %lx", Value));
+        break;
+      case VmTraceMapPages:
+        DEBUG ((DEBUG_INFO, " (%lx pages)\n", Value));
+        break;
+      case VmTraceEntry:
+        DEBUG ((DEBUG_INFO, "  %a[%03x] = %lx -> Nx:%x|PCD:%x|PWT:%x|US:%x|RW:%x|P:%x",
+          LevelNames[MIN (Record->Level, 4)], Record->Index, Value,
+          (UINTN)RShiftU64 (Value, 63), (UINTN)(Value >> 4) & 1, (UINTN)(Value >> 3) & 1,
+          (UINTN)(Value >> 2) & 1, (UINTN)(Value >> 1) & 1, (UINTN)Value & 1));
+        if (Record->Level == 1 || (Record->Level < 4 && (Value & BIT7) != 0)) {
+          DEBUG ((DEBUG_INFO, " %a page %lx\n", Record->Level == 3 ? "1GB" : (Record->Level == 2 ? "2MB" : "4KB"),
+            Value & (Record->Level == 3 ? PT_ADDR_MASK_1G : (Record->Level == 2 ? PT_ADDR_MASK_2M : PT_ADDR_MASK_4K))));
+        } else {
+          DEBUG ((DEBUG_INFO, " table %lx\n", Value & PT_ADDR_MASK_4K));
+        }
+        break;
+      case VmTraceRun:
+        DEBUG ((DEBUG_INFO, "  PTE[%03x] - PTE[%03x] written\n", Record->Index, Record->Index + (UINTN)Value - 1));
+        break;
+      case VmTraceTable:
+        DEBUG ((DEBUG_INFO, "  new %a table at %lx%a\n", LevelNames[MIN (Record->Level, 4)], Value,
+          Record->Index != 0 ? ", split from large page" : ""));
+        break;
+      default:
+        DEBUG ((DEBUG_INFO, "  unknown event %u\n", Record->Event));
+        break;
+    }
   }
-  return Status;
+#endif
 }
 
 /** Flashes TLB caches. */
@@ -548,6 +920,8 @@ VmFlashCaches (
   VOID
   )
 {
+  mVmTlbGeneration++;
+
   // just reload CR3
   AsmWriteCr3(AsmReadCr3());
 }
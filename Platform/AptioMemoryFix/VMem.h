@@ -156,6 +156,17 @@ typedef union {
 #define PT_ADDR_MASK_2M 0x000FFFFFFFE00000
 #define PT_ADDR_MASK_1G 0x000FFFFFC0000000
 
+/** Translation between physical addresses stored in page tables and pointers to the tables.
+ *  Firmware runs identity mapped, host builds (Utilities/VMemSim) keep tables in an arena.
+ */
+#ifndef VMEM_PHYS_TO_PTR
+#define VMEM_PHYS_TO_PTR(Addr) ((VOID *)(UINTN)(Addr))
+#endif
+
+#ifndef VMEM_PTR_TO_PHYS
+#define VMEM_PTR_TO_PHYS(Ptr)  ((UINT64)(UINTN)(Ptr))
+#endif
+
 /** Returns pointer to PML4 table in PageTable and PWT and PCD flags in Flags. */
 VOID
 GetCurrentPageTable (
@@ -170,7 +181,9 @@ PrintPageTable (
   UINTN                           Flags
   );
 
-/** Returns physical addr for given virtual addr. */
+/** Returns physical addr for given virtual addr.
+ *  Translations are cached, call VmFlashCaches after changing PageTable other than with VmMapVirtualPages.
+ */
 EFI_STATUS 
 GetPhysicalAddr (
   PAGE_MAP_AND_DIRECTORY_POINTER *PageTable,
@@ -178,12 +191,48 @@ GetPhysicalAddr (
   EFI_PHYSICAL_ADDRESS           *PhysicalAddr
   );
 
+/** Returns physical addrs for Count virtual addrs, which should be sorted for every page to be looked up once.
+ *  Unmapped addrs get 0 and EFI_NO_MAPPING is returned, the remaining addrs are still translated.
+ */
+EFI_STATUS
+GetPhysicalAddrs (
+  PAGE_MAP_AND_DIRECTORY_POINTER *PageTable,
+  CONST EFI_VIRTUAL_ADDRESS      *VirtualAddrs,
+  UINTN                          Count,
+  EFI_PHYSICAL_ADDRESS           *PhysicalAddrs
+  );
+
+/** Returns the number of page table pages needed to map runtime areas in MemoryMap. */
+UINTN
+VmEstimateTablePages (
+  IN UINTN                  MemoryMapSize,
+  IN EFI_MEMORY_DESCRIPTOR  *MemoryMap,
+  IN UINTN                  DescriptorSize
+  );
+
 /** Inits vm memory pool. Should be called while boot services are still usable. */
 EFI_STATUS
 VmAllocateMemoryPool (
   VOID
   );
 
+/** Grows vm memory pool if runtime areas in MemoryMap need more page table pages than reserved.
+ *  Returns TRUE if the pool was reallocated, in which case MemoryMap is outdated.
+ */
+BOOLEAN
+VmUpdateMemoryPool (
+  IN UINTN                  MemoryMapSize,
+  IN EFI_MEMORY_DESCRIPTOR  *MemoryMap,
+  IN UINTN                  DescriptorSize
+  );
+
+/** Returns vm memory pool size and its high-water usage, both in pages. */
+VOID
+VmGetMemoryPoolStats (
+  OUT UINTN  *TotalPages,
+  OUT UINTN  *UsedPages
+  );
+
 /** Maps (remaps) 4K page given by VirtualAddr to PhysicalAddr page in PageTable. */
 EFI_STATUS
 VmMapVirtualPage (
@@ -201,7 +250,13 @@ VmMapVirtualPages (
   EFI_PHYSICAL_ADDRESS           PhysicalAddr
   );
 
-/** Flashes TLB caches. */
+/** Prints page table events recorded with APTIOFIX_VMEM_TRACE. */
+VOID
+VmPrintTrace (
+  VOID
+  );
+
+/** Flashes TLB caches, including the GetPhysicalAddr translation cache. */
 VOID
 VmFlashCaches (
   VOID
@@ -0,0 +1,223 @@
+/**
+
+  Read-through cache for Apple boot variables used while boot.efi runs.
+  Variables like boot-args and csr-active-config are read many times
+  and every read goes to SMM-backed NVRAM on most boards.
+
+**/
+
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/DebugLib.h>
+
+#include "Config.h"
+#include "Lib.h"
+#include "VariableCache.h"
+
+/** Longest cached variable name including the terminator */
+#define VARIABLE_CACHE_NAME_LENGTH 32
+
+typedef struct {
+  CHAR16      Name[VARIABLE_CACHE_NAME_LENGTH];
+  // EFI_SUCCESS, EFI_NOT_FOUND for variables known to be missing, or
+  // the error of the first read for variables not kept in the cache
+  EFI_STATUS  Status;
+  UINT32      Attributes;
+  // Data location in mVariableCacheData, entries are kept in data order
+  UINT32      DataOffset;
+  UINT32      DataSize;
+} VARIABLE_CACHE_ENTRY;
+
+STATIC BOOLEAN               mVariableCacheEnabled;
+STATIC UINTN                 mVariableCacheCount;
+STATIC UINTN                 mVariableCacheDataUsed;
+STATIC VARIABLE_CACHE_ENTRY  mVariableCache[APTIOFIX_VARIABLE_CACHE_ENTRIES];
+STATIC UINT8                 mVariableCacheData[APTIOFIX_VARIABLE_CACHE_DATA_SIZE];
+
+VOID
+EnableVariableCache (
+  VOID
+  )
+{
+  mVariableCacheCount    = 0;
+  mVariableCacheDataUsed = 0;
+  mVariableCacheEnabled  = APTIOFIX_VARIABLE_CACHE == 1;
+}
+
+VOID
+DisableVariableCache (
+  VOID
+  )
+{
+  mVariableCacheCount    = 0;
+  mVariableCacheDataUsed = 0;
+  mVariableCacheEnabled  = FALSE;
+}
+
+/** Returns TRUE when the variable may be cached. */
+STATIC
+BOOLEAN
+IsCacheableVariable (
+  IN CHAR16    *VariableName,
+  IN EFI_GUID  *VendorGuid
+  )
+{
+  return mVariableCacheEnabled
+    && VariableName != NULL
+    && VendorGuid != NULL
+    && CompareGuid (VendorGuid, &gAppleBootVariableGuid)
+    && StrnLenS (VariableName, VARIABLE_CACHE_NAME_LENGTH) < VARIABLE_CACHE_NAME_LENGTH;
+}
+
+STATIC
+VARIABLE_CACHE_ENTRY *
+FindCachedVariable (
+  IN CHAR16  *VariableName
+  )
+{
+  UINTN  Index;
+
+  for (Index = 0; Index < mVariableCacheCount; ++Index) {
+    if (StrCmp (mVariableCache[Index].Name, VariableName) == 0) {
+      return &mVariableCache[Index];
+    }
+  }
+
+  return NULL;
+}
+
+/** Reads the variable into the cache, returns NULL when there are no free entries.
+ *  Variables that do not fit or cannot be read get an entry without data, so that they are not read twice later.
+ */
+STATIC
+VARIABLE_CACHE_ENTRY *
+AddCachedVariable (
+  IN EFI_GET_VARIABLE  GetVariable,
+  IN CHAR16            *VariableName
+  )
+{
+  VARIABLE_CACHE_ENTRY  *Entry;
+  EFI_STATUS            Status;
+  UINT32                Attributes;
+  UINTN                 DataSize;
+
+  if (mVariableCacheCount == ARRAY_SIZE (mVariableCache)) {
+    return NULL;
+  }
+
+  DataSize = sizeof (mVariableCacheData) - mVariableCacheDataUsed;
+  Status   = GetVariable (
+    VariableName,
+    &gAppleBootVariableGuid,
+    &Attributes,
+    &DataSize,
+    &mVariableCacheData[mVariableCacheDataUsed]
+    );
+
+  if (EFI_ERROR (Status)) {
+    //
+    // Missing, too large for the remaining space or a device error.
+    // Only missing variables are served from the cache, the rest go to GetVariable.
+    //
+    Attributes = 0;
+    DataSize   = 0;
+  }
+
+  Entry             = &mVariableCache[mVariableCacheCount++];
+  StrCpyS (Entry->Name, ARRAY_SIZE (Entry->Name), VariableName);
+  Entry->Status     = Status;
+  Entry->Attributes = Attributes;
+  Entry->DataOffset = (UINT32)mVariableCacheDataUsed;
+  Entry->DataSize   = (UINT32)DataSize;
+
+  mVariableCacheDataUsed += DataSize;
+
+  return Entry;
+}
+
+EFI_STATUS
+CachedGetVariable (
+  IN     EFI_GET_VARIABLE  GetVariable,
+  IN     CHAR16            *VariableName,
+  IN     EFI_GUID          *VendorGuid,
+  OUT    UINT32            *Attributes OPTIONAL,
+  IN OUT UINTN             *DataSize,
+  OUT    VOID              *Data
+  )
+{
+  VARIABLE_CACHE_ENTRY  *Entry;
+
+  Entry = NULL;
+  if (DataSize != NULL && IsCacheableVariable (VariableName, VendorGuid)) {
+    Entry = FindCachedVariable (VariableName);
+    if (Entry == NULL) {
+      Entry = AddCachedVariable (GetVariable, VariableName);
+    }
+  }
+
+  if (Entry == NULL || (EFI_ERROR (Entry->Status) && Entry->Status != EFI_NOT_FOUND)) {
+    return GetVariable (VariableName, VendorGuid, Attributes, DataSize, Data);
+  }
+
+  if (Entry->Status == EFI_NOT_FOUND) {
+    return EFI_NOT_FOUND;
+  }
+
+  if (Attributes != NULL) {
+    *Attributes = Entry->Attributes;
+  }
+
+  if (*DataSize < Entry->DataSize) {
+    *DataSize = Entry->DataSize;
+    return EFI_BUFFER_TOO_SMALL;
+  }
+
+  if (Data == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  CopyMem (Data, &mVariableCacheData[Entry->DataOffset], Entry->DataSize);
+  *DataSize = Entry->DataSize;
+
+  return EFI_SUCCESS;
+}
+
+VOID
+InvalidateCachedVariable (
+  IN CHAR16    *VariableName,
+  IN EFI_GUID  *VendorGuid
+  )
+{
+  VARIABLE_CACHE_ENTRY  *Entry;
+  UINTN                 Index;
+  UINTN                 DataEnd;
+
+  if (!IsCacheableVariable (VariableName, VendorGuid)) {
+    return;
+  }
+
+  Entry = FindCachedVariable (VariableName);
+  if (Entry == NULL) {
+    return;
+  }
+
+  //
+  // Compact the data and the entries following the dropped one, so that the space can be reused.
+  //
+  DataEnd = Entry->DataOffset + Entry->DataSize;
+  CopyMem (
+    &mVariableCacheData[Entry->DataOffset],
+    &mVariableCacheData[DataEnd],
+    mVariableCacheDataUsed - DataEnd
+    );
+  mVariableCacheDataUsed -= Entry->DataSize;
+
+  Index = (UINTN)(Entry - mVariableCache);
+  while (++Index < mVariableCacheCount) {
+    mVariableCache[Index].DataOffset -= Entry->DataSize;
+  }
+
+  Index = (UINTN)(Entry - mVariableCache);
+  CopyMem (Entry, Entry + 1, (mVariableCacheCount - Index - 1) * sizeof (*Entry));
+  --mVariableCacheCount;
+}
@@ -0,0 +1,42 @@
+/**
+
+  Read-through cache for Apple boot variables used while boot.efi runs.
+
+**/
+
+#ifndef APTIOFIX_VARIABLE_CACHE_H
+#define APTIOFIX_VARIABLE_CACHE_H
+
+/** Drops all cached variables and starts caching, called before starting boot.efi. */
+VOID
+EnableVariableCache (
+  VOID
+  );
+
+/** Drops all cached variables and stops caching, called at ExitBootServices. */
+VOID
+DisableVariableCache (
+  VOID
+  );
+
+/** GetVariable serving repeated reads of gAppleBootVariableGuid variables from memory.
+ *  Missing variables are cached as well. Anything not fitting into the cache is read with GetVariable.
+ */
+EFI_STATUS
+CachedGetVariable (
+  IN     EFI_GET_VARIABLE  GetVariable,
+  IN     CHAR16            *VariableName,
+  IN     EFI_GUID          *VendorGuid,
+  OUT    UINT32            *Attributes OPTIONAL,
+  IN OUT UINTN             *DataSize,
+  OUT    VOID              *Data
+  );
+
+/** Drops cached variable, called on every SetVariable. */
+VOID
+InvalidateCachedVariable (
+  IN CHAR16                *VariableName,
+  IN EFI_GUID              *VendorGuid
+  );
+
+#endif // APTIOFIX_VARIABLE_CACHE_H
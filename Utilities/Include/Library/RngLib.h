@@ -0,0 +1,11 @@
+//
+// Host stub, see UefiHost.h
+// The host tool provides the implementation.
+//
+#include <UefiHost.h>
+
+BOOLEAN
+EFIAPI
+GetRandomNumber16 (
+  OUT UINT16  *Rand
+  );
@@ -0,0 +1,4 @@
+//
+// Host stub, see UefiHost.h
+//
+#include <UefiHost.h>
@@ -0,0 +1,258 @@
+/**
+
+  Minimal UEFI environment for building AptioMemoryFix sources on the host.
+  Only the types and library functions used by the shared sources are provided.
+
+**/
+
+#ifndef APTIOFIX_UEFI_HOST_H
+#define APTIOFIX_UEFI_HOST_H
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint8_t   UINT8;
+typedef int8_t    INT8;
+typedef uint16_t  UINT16;
+typedef int16_t   INT16;
+typedef uint32_t  UINT32;
+typedef int32_t   INT32;
+typedef uint64_t  UINT64;
+typedef int64_t   INT64;
+typedef uintptr_t UINTN;
+typedef intptr_t  INTN;
+typedef UINT8     BOOLEAN;
+typedef char      CHAR8;
+typedef UINT16    CHAR16;
+typedef void      VOID;
+
+typedef UINTN     EFI_STATUS;
+typedef UINT64    EFI_PHYSICAL_ADDRESS;
+typedef UINT64    EFI_VIRTUAL_ADDRESS;
+
+#define STATIC    static
+#define CONST     const
+#define IN
+#define OUT
+#define OPTIONAL
+#define EFIAPI
+
+#define TRUE      ((BOOLEAN)1)
+#define FALSE     ((BOOLEAN)0)
+
+#define MAX_BIT               ((UINTN)1 << (sizeof (UINTN) * 8 - 1))
+#define ENCODE_ERROR(Status)  ((EFI_STATUS)(MAX_BIT | (Status)))
+#define EFI_ERROR(Status)     (((INTN)(EFI_STATUS)(Status)) < 0)
+
+#define EFI_SUCCESS           ((EFI_STATUS)0)
+#define EFI_INVALID_PARAMETER ENCODE_ERROR (2)
+#define EFI_BUFFER_TOO_SMALL  ENCODE_ERROR (5)
+#define EFI_OUT_OF_RESOURCES  ENCODE_ERROR (9)
+#define EFI_NOT_FOUND         ENCODE_ERROR (14)
+#define EFI_NO_MAPPING        ENCODE_ERROR (17)
+
+#define MAX_UINT32            ((UINT32)0xFFFFFFFF)
+
+#define BASE_4KB              0x00001000ULL
+#define BASE_2MB              0x00200000ULL
+#define BASE_1GB              0x40000000ULL
+#define BASE_4GB              0x0000000100000000ULL
+
+#define EFI_PAGE_SIZE         0x1000
+#define EFI_PAGE_MASK         0xFFF
+#define EFI_PAGE_SHIFT        12
+#define EFI_SIZE_TO_PAGES(Size)   (((Size) >> EFI_PAGE_SHIFT) + (((Size) & EFI_PAGE_MASK) ? 1 : 0))
+#define EFI_PAGES_TO_SIZE(Pages)  ((UINTN)(Pages) << EFI_PAGE_SHIFT)
+
+#define SIGNATURE_16(A, B)        ((A) | ((B) << 8))
+#define SIGNATURE_32(A, B, C, D)  (SIGNATURE_16 (A, B) | (SIGNATURE_16 (C, D) << 16))
+
+#define ARRAY_SIZE(Array)     (sizeof (Array) / sizeof ((Array)[0]))
+#define MIN(a, b)             (((a) < (b)) ? (a) : (b))
+#define MAX(a, b)             (((a) > (b)) ? (a) : (b))
+
+#define BIT0                  0x00000001
+#define BIT1                  0x00000002
+#define BIT2                  0x00000004
+#define BIT7                  0x00000080
+#define BIT26                 0x04000000
+#define BIT30                 0x40000000
+
+#define DEBUG_WARN            0x00000002
+#define DEBUG_INFO            0x00000040
+#define DEBUG_VERBOSE         0x00400000
+#define DEBUG(Expression)     do { } while (0)
+#define ASSERT(Expression)    do { } while (0)
+
+//
+// Memory map and other UEFI types referenced by the shared headers
+//
+
+typedef VOID      *EFI_HANDLE;
+
+typedef struct {
+  UINT32  Data1;
+  UINT16  Data2;
+  UINT16  Data3;
+  UINT8   Data4[8];
+} EFI_GUID;
+
+typedef enum {
+  EfiReservedMemoryType,
+  EfiLoaderCode,
+  EfiLoaderData,
+  EfiBootServicesCode,
+  EfiBootServicesData,
+  EfiRuntimeServicesCode,
+  EfiRuntimeServicesData,
+  EfiConventionalMemory,
+  EfiUnusableMemory,
+  EfiACPIReclaimMemory,
+  EfiACPIMemoryNVS,
+  EfiMemoryMappedIO,
+  EfiMemoryMappedIOPortSpace,
+  EfiPalCode,
+  EfiPersistentMemory,
+  EfiMaxMemoryType
+} EFI_MEMORY_TYPE;
+
+typedef enum {
+  AllocateAnyPages,
+  AllocateMaxAddress,
+  AllocateAddress,
+  MaxAllocateType
+} EFI_ALLOCATE_TYPE;
+
+typedef struct {
+  UINT32                Type;
+  EFI_PHYSICAL_ADDRESS  PhysicalStart;
+  EFI_VIRTUAL_ADDRESS   VirtualStart;
+  UINT64                NumberOfPages;
+  UINT64                Attribute;
+} EFI_MEMORY_DESCRIPTOR;
+
+#define EFI_MEMORY_RUNTIME    0x8000000000000000ULL
+
+#define NEXT_MEMORY_DESCRIPTOR(MemoryDescriptor, Size) \
+  ((EFI_MEMORY_DESCRIPTOR *)((UINT8 *)(MemoryDescriptor) + (Size)))
+
+typedef struct _EFI_SYSTEM_TABLE          EFI_SYSTEM_TABLE;
+typedef struct _EFI_DEVICE_PATH_PROTOCOL  EFI_DEVICE_PATH_PROTOCOL;
+
+typedef
+EFI_STATUS
+(EFIAPI *EFI_EXIT_BOOT_SERVICES) (
+  IN EFI_HANDLE  ImageHandle,
+  IN UINTN       MapKey
+  );
+
+//
+// Host tools are single threaded, UmmMalloc needs no TPL protection
+//
+#define UMM_CRITICAL_ENTRY()
+#define UMM_CRITICAL_EXIT()
+
+//
+// BaseLib
+//
+
+STATIC inline
+INTN
+HighBitSet32 (
+  UINT32  Operand
+  )
+{
+  return Operand != 0 ? 31 - __builtin_clz (Operand) : -1;
+}
+
+STATIC inline
+INTN
+LowBitSet32 (
+  UINT32  Operand
+  )
+{
+  return Operand != 0 ? __builtin_ctz (Operand) : -1;
+}
+
+STATIC inline
+INTN
+HighBitSet64 (
+  UINT64  Operand
+  )
+{
+  return Operand != 0 ? 63 - __builtin_clzll (Operand) : -1;
+}
+
+STATIC inline
+INTN
+LowBitSet64 (
+  UINT64  Operand
+  )
+{
+  return Operand != 0 ? __builtin_ctzll (Operand) : -1;
+}
+
+STATIC inline
+UINT64
+LShiftU64 (
+  UINT64  Operand,
+  UINTN   Count
+  )
+{
+  return Operand << Count;
+}
+
+STATIC inline
+UINT64
+RShiftU64 (
+  UINT64  Operand,
+  UINTN   Count
+  )
+{
+  return Operand >> Count;
+}
+
+STATIC inline
+UINT64
+LRotU64 (
+  UINT64  Operand,
+  UINTN   Count
+  )
+{
+  return (Operand << Count) | (Operand >> (64 - Count));
+}
+
+STATIC inline
+UINT64
+MultU64x64 (
+  UINT64  Multiplicand,
+  UINT64  Multiplier
+  )
+{
+  return Multiplicand * Multiplier;
+}
+
+STATIC inline
+UINT64
+DivU64x32 (
+  UINT64  Dividend,
+  UINT32  Divisor
+  )
+{
+  return Dividend / Divisor;
+}
+
+//
+// BaseMemoryLib
+//
+
+#define CopyMem(Dst, Src, Len)    memmove ((Dst), (Src), (Len))
+#define SetMem(Buf, Len, Val)     memset ((Buf), (Val), (Len))
+#define ZeroMem(Buf, Len)         memset ((Buf), 0, (Len))
+#define CompareMem(A, B, Len)     memcmp ((A), (B), (Len))
+
+#endif // APTIOFIX_UEFI_HOST_H
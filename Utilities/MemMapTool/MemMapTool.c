@@ -0,0 +1,641 @@
+/**
+
+  Host analyzer for memory maps stored by AptioMemoryFix with -aptiodump.
+  Builds MemoryMap.c and CustomSlide.c and replays the map through them,
+  reporting the shrunk map, valid KASLR slides and RT relocation decisions.
+
+  Accepted input:
+    raw dump         as written to aptiomemfix-memmap or aptiomemfix-vmap
+    nvram -x output  the <data> following the variable key is base64 decoded
+    nvram output     the value following the variable name is %-decoded
+
+**/
+
+#include <time.h>
+
+//
+// CPU functions used by CustomSlide.c
+//
+
+STATIC BOOLEAN  mSandyOrIvy;
+
+STATIC
+UINT64
+AsmReadTsc (
+  VOID
+  )
+{
+  return 0;
+}
+
+/** Reports the CPU the map was dumped on, Ivy Bridge (family 6, model 0x3A) or a newer one. */
+STATIC
+UINT32
+AsmCpuid (
+  UINT32  Index,
+  UINT32  *Eax,
+  UINT32  *Ebx,
+  UINT32  *Ecx,
+  UINT32  *Edx
+  )
+{
+  if (Eax != NULL) {
+    *Eax = Index == 1 ? (mSandyOrIvy ? 0x306A9 : 0x906EA) : 0;
+  }
+  if (Ebx != NULL) {
+    *Ebx = 0;
+  }
+  if (Ecx != NULL) {
+    *Ecx = 0;
+  }
+  if (Edx != NULL) {
+    *Edx = 0;
+  }
+  return Index;
+}
+
+BOOLEAN
+EFIAPI
+GetRandomNumber16 (
+  OUT UINT16  *Rand
+  )
+{
+  return FALSE;
+}
+
+//
+// Library functions used by CustomSlide.c
+//
+
+EFI_STATUS
+EFIAPI
+GetMemoryMapSnapshot (
+  OUT UINTN                   *MemoryMapSize,
+  OUT EFI_MEMORY_DESCRIPTOR   **MemoryMap,
+  OUT UINTN                   *DescriptorSize,
+  OUT UINTN                   *MapKey  OPTIONAL
+  )
+{
+  return EFI_NOT_FOUND;
+}
+
+VOID
+EFIAPI
+PrintScreen (
+  IN  CONST CHAR16   *Format,
+  ...
+  )
+{
+}
+
+#include "MemoryMap.c"
+#include "CustomSlide.c"
+
+STATIC CONST CHAR8  *mMemoryTypeNames[EfiMaxMemoryType] = {
+  "Reserved",
+  "LDR_code",
+  "LDR_data",
+  "BS_code",
+  "BS_data",
+  "RT_code",
+  "RT_data",
+  "Available",
+  "Unusable",
+  "ACPI_recl",
+  "ACPI_NVS",
+  "MemMapIO",
+  "MemPortIO",
+  "PAL_code",
+  "Persistent"
+};
+
+STATIC
+CONST CHAR8 *
+MemoryTypeName (
+  UINT32  Type
+  )
+{
+  return Type < EfiMaxMemoryType ? mMemoryTypeNames[Type] : "Unknown";
+}
+
+STATIC
+UINT64
+NanoTime (
+  VOID
+  )
+{
+  struct timespec  Ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &Ts);
+  return (UINT64)Ts.tv_sec * 1000000000ULL + (UINT64)Ts.tv_nsec;
+}
+
+/** Prints the map in the same layout as PrintMemMap. */
+STATIC
+VOID
+PrintMap (
+  CONST CHAR8            *Name,
+  UINTN                  MemoryMapSize,
+  UINTN                  DescriptorSize,
+  EFI_MEMORY_DESCRIPTOR  *MemoryMap
+  )
+{
+  EFI_MEMORY_DESCRIPTOR  *Desc;
+  UINTN                  Index;
+
+  printf ("--- %s ---\n", Name);
+  printf ("Type       Start      End        Virtual          # Pages    Attributes\n");
+
+  Desc = MemoryMap;
+  for (Index = 0; Index < MemoryMapSize / DescriptorSize; Index++) {
+    printf ("%-10s %010llX %010llX %016llX %010llX %016llX\n",
+      MemoryTypeName (Desc->Type),
+      (unsigned long long)Desc->PhysicalStart,
+      (unsigned long long)(Desc->PhysicalStart + EFI_PAGES_TO_SIZE (Desc->NumberOfPages) - 1),
+      (unsigned long long)Desc->VirtualStart,
+      (unsigned long long)Desc->NumberOfPages,
+      (unsigned long long)Desc->Attribute);
+    Desc = NEXT_MEMORY_DESCRIPTOR (Desc, DescriptorSize);
+  }
+}
+
+/** Returns the value of a base64 digit, or -1 for characters to skip. */
+STATIC
+int
+Base64Value (
+  CHAR8  Chr
+  )
+{
+  if (Chr >= 'A' && Chr <= 'Z') {
+    return Chr - 'A';
+  }
+  if (Chr >= 'a' && Chr <= 'z') {
+    return Chr - 'a' + 26;
+  }
+  if (Chr >= '0' && Chr <= '9') {
+    return Chr - '0' + 52;
+  }
+  if (Chr == '+') {
+    return 62;
+  }
+  if (Chr == '/') {
+    return 63;
+  }
+  return -1;
+}
+
+/** Decodes base64 or %-encoded text between Start and End in place, returns decoded size. */
+STATIC
+UINTN
+DecodeText (
+  CHAR8    *Start,
+  CHAR8    *End,
+  BOOLEAN  Base64
+  )
+{
+  UINT8   *Out;
+  UINT8   *Begin;
+  UINT32  Bits;
+  UINTN   NumBits;
+  int     Value;
+  CHAR8   Hex[3];
+
+  Begin   = (UINT8 *)Start;
+  Out     = Begin;
+  Bits    = 0;
+  NumBits = 0;
+  Hex[2]  = '\0';
+
+  for (; Start < End; Start++) {
+    if (Base64) {
+      Value = Base64Value (*Start);
+      if (Value < 0) {
+        continue;
+      }
+      Bits     = (Bits << 6) | (UINT32)Value;
+      NumBits += 6;
+      if (NumBits >= 8) {
+        NumBits -= 8;
+        *Out++   = (UINT8)(Bits >> NumBits);
+      }
+    } else if (*Start == '%' && End - Start >= 3) {
+      Hex[0] = Start[1];
+      Hex[1] = Start[2];
+      *Out++ = (UINT8)strtoul (Hex, NULL, 16);
+      Start += 2;
+    } else if (*Start == '\n' || *Start == '\r') {
+      break;
+    } else {
+      *Out++ = (UINT8)*Start;
+    }
+  }
+
+  return (UINTN)(Out - Begin);
+}
+
+/** Finds the dump of VariableName in nvram output, decodes it in place and returns its size. */
+STATIC
+UINTN
+ExtractFromNvramOutput (
+  CHAR8        *Buffer,
+  UINTN        Size,
+  CONST CHAR8  *VariableName,
+  UINT8        **Dump
+  )
+{
+  CHAR8  *Name;
+  CHAR8  *Start;
+  CHAR8  *End;
+  UINTN  NameLength;
+
+  Buffer[Size] = '\0';
+  NameLength   = strlen (VariableName);
+
+  for (Name = strstr (Buffer, VariableName); Name != NULL; Name = strstr (Name + NameLength, VariableName)) {
+    //
+    // nvram -x: <key>GUID:name</key> followed by <data>base64</data>.
+    //
+    if (strncmp (Name + NameLength, "</key>", 6) == 0) {
+      Start = strstr (Name, "<data>");
+      End   = Start != NULL ? strstr (Start, "</data>") : NULL;
+      if (End == NULL) {
+        return 0;
+      }
+      Start += 6;
+      *Dump  = (UINT8 *)Start;
+      return DecodeText (Start, End, TRUE);
+    }
+
+    //
+    // nvram: [GUID:]name followed by a tab and %-encoded value.
+    //
+    if (Name[NameLength] == '\t') {
+      Start = Name + NameLength + 1;
+      *Dump = (UINT8 *)Start;
+      return DecodeText (Start, Buffer + Size, FALSE);
+    }
+  }
+
+  return 0;
+}
+
+/** Reads the file at Path, returns the buffer or NULL. A spare byte is left for a terminator. */
+STATIC
+UINT8 *
+ReadFile (
+  CONST CHAR8  *Path,
+  UINTN        *Size
+  )
+{
+  FILE   *File;
+  UINT8  *Buffer;
+  UINTN  Capacity;
+  size_t Read;
+
+  File = strcmp (Path, "-") == 0 ? stdin : fopen (Path, "rb");
+  if (File == NULL) {
+    return NULL;
+  }
+
+  Capacity = 0x10000;
+  Buffer   = malloc (Capacity);
+  *Size    = 0;
+
+  while (Buffer != NULL && (Read = fread (Buffer + *Size, 1, Capacity - *Size - 1, File)) > 0) {
+    *Size += Read;
+    if (Capacity - *Size == 1) {
+      Capacity *= 2;
+      Buffer    = realloc (Buffer, Capacity);
+    }
+  }
+
+  if (File != stdin) {
+    fclose (File);
+  }
+
+  return Buffer;
+}
+
+/** Prints valid slides as ranges, like DecideOnCustomSlideImplementation. */
+STATIC
+VOID
+PrintValidSlides (
+  CONST UINT64  *Bitmap,
+  UINTN         Count
+  )
+{
+  UINTN    Slide;
+  UINTN    RunStart;
+  BOOLEAN  Valid;
+  BOOLEAN  Separator;
+  UINT8    LargestFirst;
+  UINTN    LargestNum;
+
+  printf ("Valid slides: %zu/%d", (size_t)Count, TOTAL_SLIDE_NUM);
+  if (Count == 0) {
+    printf (", custom slide is needed\n");
+    return;
+  }
+
+  printf (":");
+  RunStart  = 0;
+  Separator = FALSE;
+  for (Slide = 0; Slide <= TOTAL_SLIDE_NUM; Slide++) {
+    Valid = Slide < TOTAL_SLIDE_NUM && (Bitmap[Slide / 64] & (1ULL << (Slide % 64))) != 0;
+    if (Valid && (Slide == 0 || (Bitmap[(Slide - 1) / 64] & (1ULL << ((Slide - 1) % 64))) == 0)) {
+      RunStart = Slide;
+    } else if (!Valid && Slide > 0 && (Bitmap[(Slide - 1) / 64] & (1ULL << ((Slide - 1) % 64))) != 0) {
+      if (RunStart == Slide - 1) {
+        printf ("%s %zu", Separator ? "," : "", (size_t)RunStart);
+      } else {
+        printf ("%s %zu-%zu", Separator ? "," : "", (size_t)RunStart, (size_t)(Slide - 1));
+      }
+      Separator = TRUE;
+    }
+  }
+
+  LargestNum = GetLargestValidSlideRun (Bitmap, &LargestFirst);
+  printf ("\nLargest contiguous slide range: %u-%zu (%zu slides)\n", LargestFirst,
+    (size_t)(LargestFirst + LargestNum - 1), (size_t)LargestNum);
+}
+
+/** Replays SortMemoryMap and ShrinkMemMap on a copy of the map, like MOGetMemoryMap. */
+STATIC
+VOID
+AnalyzeShrink (
+  MEMMAP_DUMP_HEADER     *Header,
+  EFI_MEMORY_DESCRIPTOR  *MemoryMap,
+  BOOLEAN                ProtectCsm,
+  BOOLEAN                Print,
+  UINTN                  Repeat
+  )
+{
+  EFI_MEMORY_DESCRIPTOR  *Shrunk;
+  EFI_MEMORY_DESCRIPTOR  *Desc;
+  UINTN                  ShrunkSize;
+  UINTN                  Index;
+  UINTN                  Pass;
+  UINT64                 Start;
+  UINT64                 Time;
+
+  Shrunk = malloc ((UINTN)Header->MemoryMapSize);
+
+  Time = 0;
+  for (Pass = 0; Pass < Repeat; Pass++) {
+    CopyMem (Shrunk, MemoryMap, (UINTN)Header->MemoryMapSize);
+    ShrunkSize = (UINTN)Header->MemoryMapSize;
+    Start = NanoTime ();
+    SortMemoryMap (ShrunkSize, Shrunk, Header->DescriptorSize);
+    ShrinkMemMap (&ShrunkSize, Shrunk, Header->DescriptorSize, ProtectCsm);
+    Time += NanoTime () - Start;
+  }
+
+  printf ("Shrunk map: %zu -> %zu descriptors (%.1f us)\n",
+    (size_t)(Header->MemoryMapSize / Header->DescriptorSize), (size_t)(ShrunkSize / Header->DescriptorSize),
+    (double)Time / (double)Repeat / 1000.0);
+
+  if (ProtectCsm) {
+    Desc = MemoryMap;
+    for (Index = 0; Index < Header->MemoryMapSize / Header->DescriptorSize; Index++) {
+      if (IsCsmRegion (Desc)) {
+        printf ("CSM region: %010llX-%010llX protected as ACPI_NVS\n", (unsigned long long)Desc->PhysicalStart,
+          (unsigned long long)(Desc->PhysicalStart + EFI_PAGES_TO_SIZE (Desc->NumberOfPages) - 1));
+        break;
+      }
+      Desc = NEXT_MEMORY_DESCRIPTOR (Desc, Header->DescriptorSize);
+    }
+    if (Index == Header->MemoryMapSize / Header->DescriptorSize) {
+      printf ("CSM region: not found\n");
+    }
+  }
+
+  if (Print) {
+    PrintMap ("Shrunk map", ShrunkSize, Header->DescriptorSize, Shrunk);
+  }
+
+  free (Shrunk);
+}
+
+/** Replays valid slide computation on a sorted copy of the map, like DecideOnCustomSlideImplementation. */
+STATIC
+VOID
+AnalyzeSlides (
+  MEMMAP_DUMP_HEADER     *Header,
+  EFI_MEMORY_DESCRIPTOR  *MemoryMap,
+  UINTN                  Repeat
+  )
+{
+  EFI_MEMORY_DESCRIPTOR  *Sorted;
+  UINT64                 Bitmap[SLIDE_BITMAP_SIZE];
+  UINTN                  Count;
+  UINTN                  Pass;
+  UINT64                 Start;
+  UINT64                 Time;
+
+  Sorted = malloc ((UINTN)Header->MemoryMapSize);
+
+  Count = 0;
+  Time  = 0;
+  for (Pass = 0; Pass < Repeat; Pass++) {
+    CopyMem (Sorted, MemoryMap, (UINTN)Header->MemoryMapSize);
+    Start = NanoTime ();
+    SortMemoryMap ((UINTN)Header->MemoryMapSize, Sorted, Header->DescriptorSize);
+    Count = ComputeValidSlides ((UINTN)Header->MemoryMapSize, Sorted, Header->DescriptorSize, IsSandyOrIvy (), Bitmap);
+    Time += NanoTime () - Start;
+  }
+
+  printf ("Slides computed in %.1f us\n", (double)Time / (double)Repeat / 1000.0);
+  PrintValidSlides (Bitmap, Count);
+
+  free (Sorted);
+}
+
+/** Replays RT area relocation protection and its restoration, returns FALSE if types were not restored. */
+STATIC
+BOOLEAN
+AnalyzeRtRelocation (
+  MEMMAP_DUMP_HEADER     *Header,
+  EFI_MEMORY_DESCRIPTOR  *MemoryMap
+  )
+{
+  EFI_MEMORY_DESCRIPTOR  *Protected;
+  EFI_MEMORY_DESCRIPTOR  *Desc;
+  EFI_MEMORY_DESCRIPTOR  *Orig;
+  UINTN                  NumEntries;
+  UINTN                  NumProtected;
+  UINTN                  Index;
+  UINT64                 Start;
+  UINT64                 Time;
+  BOOLEAN                Restored;
+
+  Protected  = malloc ((UINTN)Header->MemoryMapSize);
+  NumEntries = (UINTN)(Header->MemoryMapSize / Header->DescriptorSize);
+  CopyMem (Protected, MemoryMap, (UINTN)Header->MemoryMapSize);
+
+  Start = NanoTime ();
+  ProtectRtMemoryFromRelocation ((UINTN)Header->MemoryMapSize, Header->DescriptorSize, Header->DescriptorVersion,
+    Protected, Header->SysTable);
+  Time = NanoTime () - Start;
+
+  printf ("RT relocation (%.1f us), system table area %010llX:\n", (double)Time / 1000.0,
+    (unsigned long long)Header->SysTable);
+
+  NumProtected = 0;
+  Desc = Protected;
+  Orig = MemoryMap;
+  for (Index = 0; Index < NumEntries; Index++) {
+    if ((Orig->Attribute & EFI_MEMORY_RUNTIME) != 0) {
+      printf ("  %-10s %010llX %010llX %s\n", MemoryTypeName (Orig->Type),
+        (unsigned long long)Orig->PhysicalStart, (unsigned long long)Orig->NumberOfPages,
+        Desc->Type != Orig->Type ? "protected as MemMapIO"
+          : (Orig->PhysicalStart == Header->SysTable ? "relocated, has system table" : "unchanged"));
+      if (Desc->Type != Orig->Type) {
+        NumProtected++;
+      }
+    }
+    Desc = NEXT_MEMORY_DESCRIPTOR (Desc, Header->DescriptorSize);
+    Orig = NEXT_MEMORY_DESCRIPTOR (Orig, Header->DescriptorSize);
+  }
+
+  if (NumProtected > gRelocInfoData.NumEntries) {
+    printf ("  %zu areas exceed APTIFIX_MAX_RT_RELOC_NUM (%zu) and will stay MemMapIO\n",
+      (size_t)(NumProtected - gRelocInfoData.NumEntries), (size_t)APTIFIX_MAX_RT_RELOC_NUM);
+  }
+
+  RestoreRelocInfoProtectMemTypes ((UINTN)Header->MemoryMapSize, Header->DescriptorSize, Protected);
+  Restored = CompareMem (Protected, MemoryMap, (UINTN)Header->MemoryMapSize) == 0;
+  printf ("RT relocation: %zu areas protected, types %s restored\n", (size_t)NumProtected, Restored ? "are" : "are NOT");
+
+  free (Protected);
+  return Restored;
+}
+
+STATIC
+VOID
+Usage (
+  VOID
+  )
+{
+  fprintf (stderr,
+    "Usage: MemMapTool [-v variable] [-c on|off] [-s on|off] [-p] [-r repeat] <dump file or - for stdin>\n"
+    "  -v  variable to look for in nvram output (aptiomemfix-memmap)\n"
+    "  -c  override CSM region protection stored in the dump\n"
+    "  -s  override Sandy Bridge or Ivy Bridge CPU stored in the dump\n"
+    "  -p  print original and shrunk maps\n"
+    "  -r  repeat shrinking and slide computation to time them\n");
+}
+
+int
+main (
+  int   argc,
+  char  *argv[]
+  )
+{
+  CONST CHAR8            *VariableName;
+  CONST CHAR8            *Path;
+  UINT8                  *Buffer;
+  UINT8                  *Dump;
+  UINTN                  Size;
+  UINTN                  DumpSize;
+  UINTN                  Repeat;
+  int                    ProtectCsm;
+  int                    SandyOrIvy;
+  BOOLEAN                Print;
+  MEMMAP_DUMP_HEADER     *Header;
+  EFI_MEMORY_DESCRIPTOR  *MemoryMap;
+  int                    Arg;
+
+  VariableName = "aptiomemfix-memmap";
+  Path         = NULL;
+  Repeat       = 1;
+  ProtectCsm   = -1;
+  SandyOrIvy   = -1;
+  Print        = FALSE;
+
+  for (Arg = 1; Arg < argc; ++Arg) {
+    if (strcmp (argv[Arg], "-p") == 0) {
+      Print = TRUE;
+    } else if (argv[Arg][0] == '-' && argv[Arg][1] != '\0' && Arg + 1 < argc) {
+      if (strcmp (argv[Arg], "-v") == 0) {
+        VariableName = argv[++Arg];
+      } else if (strcmp (argv[Arg], "-c") == 0) {
+        ProtectCsm = strcmp (argv[++Arg], "on") == 0;
+      } else if (strcmp (argv[Arg], "-s") == 0) {
+        SandyOrIvy = strcmp (argv[++Arg], "on") == 0;
+      } else if (strcmp (argv[Arg], "-r") == 0) {
+        Repeat = strtoul (argv[++Arg], NULL, 0);
+        Repeat = MAX (Repeat, 1);
+      } else {
+        Usage ();
+        return EXIT_FAILURE;
+      }
+    } else if (Path == NULL) {
+      Path = argv[Arg];
+    } else {
+      Usage ();
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (Path == NULL) {
+    Usage ();
+    return EXIT_FAILURE;
+  }
+
+  Buffer = ReadFile (Path, &Size);
+  if (Buffer == NULL) {
+    fprintf (stderr, "Failed to read %s\n", Path);
+    return EXIT_FAILURE;
+  }
+
+  //
+  // Raw dumps start with the signature, anything else is nvram output.
+  //
+  Dump     = Buffer;
+  DumpSize = Size;
+  if (Size < sizeof (UINT32) || *(UINT32 *)Buffer != MEMMAP_DUMP_SIGNATURE) {
+    DumpSize = ExtractFromNvramOutput ((CHAR8 *)Buffer, Size, VariableName, &Dump);
+  }
+
+  //
+  // Decoded data may be unaligned within the text, descriptors are accessed as UINT64.
+  //
+  Header = malloc (DumpSize + 1);
+  CopyMem (Header, Dump, DumpSize);
+  free (Buffer);
+
+  if (ParseMemMapDump (Header, DumpSize) == NULL) {
+    fprintf (stderr, "No valid %s dump in %s\n", VariableName, Path);
+    free (Header);
+    return EXIT_FAILURE;
+  }
+
+  MemoryMap   = (EFI_MEMORY_DESCRIPTOR *)(Header + 1);
+  mSandyOrIvy = SandyOrIvy >= 0 ? SandyOrIvy != 0 : (Header->Flags & MEMMAP_DUMP_FLAG_SANDY_OR_IVY) != 0;
+  if (ProtectCsm < 0) {
+    ProtectCsm = (Header->Flags & MEMMAP_DUMP_FLAG_PROTECT_CSM) != 0;
+  }
+
+  printf ("%s map: %zu descriptors of %u bytes, version %u, shims %08llX, system table %08llX\n",
+    (Header->Flags & MEMMAP_DUMP_FLAG_VIRTUAL_MAP) != 0 ? "SetVirtualAddressMap" : "GetMemoryMap",
+    (size_t)(Header->MemoryMapSize / Header->DescriptorSize), Header->DescriptorSize, Header->DescriptorVersion,
+    (unsigned long long)Header->Shims, (unsigned long long)Header->SysTable);
+  printf ("Sandy or Ivy Bridge: %s, CSM region protection: %s\n", mSandyOrIvy ? "yes" : "no", ProtectCsm ? "on" : "off");
+
+  if (Print) {
+    PrintMap ("Original map", (UINTN)Header->MemoryMapSize, Header->DescriptorSize, MemoryMap);
+  }
+
+  //
+  // SetVirtualAddressMap only gets runtime areas, shrinking and slides do not apply to it.
+  //
+  if ((Header->Flags & MEMMAP_DUMP_FLAG_VIRTUAL_MAP) == 0) {
+    AnalyzeShrink (Header, MemoryMap, ProtectCsm != 0, Print, Repeat);
+    AnalyzeSlides (Header, MemoryMap, Repeat);
+  }
+
+  Arg = AnalyzeRtRelocation (Header, MemoryMap) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+  free (Header);
+  return Arg;
+}
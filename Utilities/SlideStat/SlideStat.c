@@ -0,0 +1,363 @@
+/**
+
+  Host statistics tool for the AptioMemoryFix KASLR slide selection.
+  Builds CustomSlide.c, fills the valid slide bitmap with synthetic slide
+  sets and draws slides with GenerateRandomSlideValue, checking with a
+  chi-square test that every valid slide is equally likely and that no
+  invalid slide is ever returned.
+
+  Entropy sources:
+    prng    deterministic host PRNG returned by GetRandomNumber16
+    rdrand  RDRAND instruction, when the host CPU supports it
+    tsc     no RDRAND, so the TSC jitter fallback is used
+
+  The previous modulo selection (a non-zero 8-bit value modulo the number
+  of valid slides) is measured on the same PRNG for comparison.
+
+**/
+
+#include <math.h>
+#include <time.h>
+
+//
+// CPU functions used by CustomSlide.c
+//
+
+STATIC BOOLEAN  mRdRand;
+STATIC BOOLEAN  mHostRdRand;
+
+STATIC
+UINT64
+AsmReadTsc (
+  VOID
+  )
+{
+  UINT32  Low;
+  UINT32  High;
+
+  __asm__ __volatile__ ("rdtsc" : "=a" (Low), "=d" (High));
+  return ((UINT64)High << 32) | Low;
+}
+
+STATIC
+UINT32
+AsmCpuid (
+  UINT32  Index,
+  UINT32  *Eax,
+  UINT32  *Ebx,
+  UINT32  *Ecx,
+  UINT32  *Edx
+  )
+{
+  UINT32  Regs[4];
+
+  __asm__ __volatile__ ("cpuid" : "=a" (Regs[0]), "=b" (Regs[1]), "=c" (Regs[2]), "=d" (Regs[3]) : "a" (Index), "c" (0));
+
+  if (Index == 1) {
+    Regs[2] = mRdRand ? (Regs[2] | BIT30) : (Regs[2] & ~BIT30);
+  }
+
+  if (Eax != NULL) {
+    *Eax = Regs[0];
+  }
+  if (Ebx != NULL) {
+    *Ebx = Regs[1];
+  }
+  if (Ecx != NULL) {
+    *Ecx = Regs[2];
+  }
+  if (Edx != NULL) {
+    *Edx = Regs[3];
+  }
+  return Index;
+}
+
+STATIC UINT64  mRandom = 0x9E3779B97F4A7C15ULL;
+
+STATIC
+UINT64
+Random (
+  VOID
+  )
+{
+  mRandom ^= mRandom << 13;
+  mRandom ^= mRandom >> 7;
+  mRandom ^= mRandom << 17;
+  return mRandom;
+}
+
+BOOLEAN
+EFIAPI
+GetRandomNumber16 (
+  OUT UINT16  *Rand
+  )
+{
+  UINT8  Carry;
+
+  if (!mHostRdRand) {
+    *Rand = (UINT16)(Random () >> 48);
+    return TRUE;
+  }
+
+  __asm__ __volatile__ ("rdrand %0; setc %1" : "=r" (*Rand), "=qm" (Carry));
+  return Carry != 0;
+}
+
+//
+// Library functions used by CustomSlide.c
+//
+
+EFI_STATUS
+EFIAPI
+GetMemoryMapSnapshot (
+  OUT UINTN                   *MemoryMapSize,
+  OUT EFI_MEMORY_DESCRIPTOR   **MemoryMap,
+  OUT UINTN                   *DescriptorSize,
+  OUT UINTN                   *MapKey  OPTIONAL
+  )
+{
+  return EFI_NOT_FOUND;
+}
+
+VOID
+EFIAPI
+PrintScreen (
+  IN  CONST CHAR16   *Format,
+  ...
+  )
+{
+}
+
+#include "CustomSlide.c"
+
+STATIC
+UINT64
+NanoTime (
+  VOID
+  )
+{
+  struct timespec  Ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &Ts);
+  return (UINT64)Ts.tv_sec * 1000000000ULL + (UINT64)Ts.tv_nsec;
+}
+
+/** Returns the normal deviate of a chi-square value (Wilson-Hilferty approximation). */
+STATIC
+double
+ChiSquareZ (
+  CONST UINT64  *Counts,
+  UINTN         Count,
+  UINT64        Draws
+  )
+{
+  double  Expected;
+  double  ChiSquare;
+  double  Diff;
+  double  Df;
+  UINTN   Index;
+
+  Expected  = (double)Draws / (double)Count;
+  ChiSquare = 0;
+  for (Index = 0; Index < Count; ++Index) {
+    Diff       = (double)Counts[Index] - Expected;
+    ChiSquare += Diff * Diff / Expected;
+  }
+
+  Df = (double)(Count - 1);
+  return (cbrt (ChiSquare / Df) - (1.0 - 2.0 / (9.0 * Df))) / sqrt (2.0 / (9.0 * Df));
+}
+
+/** Fills gValidSlides with Count slides, either contiguous or spread randomly. */
+STATIC
+VOID
+MakeSlideSet (
+  UINTN    Count,
+  BOOLEAN  Contiguous
+  )
+{
+  UINTN  Slide;
+  UINTN  Set;
+
+  ZeroMem (gValidSlides, sizeof (gValidSlides));
+
+  if (Contiguous) {
+    Slide = (UINTN)(Random () % (TOTAL_SLIDE_NUM - Count + 1));
+    for (Set = 0; Set < Count; ++Set) {
+      gValidSlides[(Slide + Set) / 64] |= 1ULL << ((Slide + Set) % 64);
+    }
+  } else {
+    for (Set = 0; Set < Count; ) {
+      Slide = (UINTN)(Random () % TOTAL_SLIDE_NUM);
+      if ((gValidSlides[Slide / 64] & (1ULL << (Slide % 64))) == 0) {
+        gValidSlides[Slide / 64] |= 1ULL << (Slide % 64);
+        ++Set;
+      }
+    }
+  }
+
+  gValidSlidesNum = (UINT32)Count;
+}
+
+/** Draws slides for the current set, returns FALSE on an invalid slide or a failed test. */
+STATIC
+BOOLEAN
+TestSlideSet (
+  UINTN    Count,
+  BOOLEAN  Contiguous,
+  UINT64   Draws,
+  double   Threshold
+  )
+{
+  UINT64   Counts[TOTAL_SLIDE_NUM];
+  UINT64   Legacy[TOTAL_SLIDE_NUM];
+  UINTN    Index[TOTAL_SLIDE_NUM];
+  UINT64   Draw;
+  UINT64   Start;
+  UINT64   Time;
+  UINTN    Slide;
+  UINTN    Set;
+  UINT8    Value;
+  double   Z;
+  double   LegacyZ;
+
+  MakeSlideSet (Count, Contiguous);
+
+  //
+  // Map every valid slide to its position among the valid ones.
+  //
+  Set = 0;
+  for (Slide = 0; Slide < TOTAL_SLIDE_NUM; ++Slide) {
+    Index[Slide] = (gValidSlides[Slide / 64] & (1ULL << (Slide % 64))) != 0 ? Set++ : TOTAL_SLIDE_NUM;
+  }
+
+  memset (Counts, 0, sizeof (Counts));
+  memset (Legacy, 0, sizeof (Legacy));
+
+  Start = NanoTime ();
+  for (Draw = 0; Draw < Draws; ++Draw) {
+    Slide = GenerateRandomSlideValue ();
+    if (Index[Slide] == TOTAL_SLIDE_NUM) {
+      printf ("%3zu %-10s invalid slide %zu returned\n", (size_t)Count, Contiguous ? "contiguous" : "spread", (size_t)Slide);
+      return FALSE;
+    }
+    ++Counts[Index[Slide]];
+  }
+  Time = NanoTime () - Start;
+
+  for (Draw = 0; Draw < Draws; ++Draw) {
+    do {
+      Value = (UINT8)(Random () >> 56);
+    } while (Value == 0);
+    ++Legacy[Value % Count];
+  }
+
+  Z       = Count > 1 ? ChiSquareZ (Counts, Count, Draws) : 0;
+  LegacyZ = Count > 1 ? ChiSquareZ (Legacy, Count, Draws) : 0;
+
+  printf ("%3zu %-10s %8.1f ns/draw   z %7.2f %-4s   legacy z %9.2f\n", (size_t)Count,
+    Contiguous ? "contiguous" : "spread", (double)Time / (double)Draws, Z, Z < Threshold ? "ok" : "FAIL", LegacyZ);
+
+  return Z < Threshold;
+}
+
+STATIC
+VOID
+Usage (
+  VOID
+  )
+{
+  fprintf (stderr,
+    "Usage: SlideStat [-s prng|rdrand|tsc] [-n draws per set] [-c valid slides] [-r seed]\n"
+    "                 [-z max chi-square normal deviate]\n");
+}
+
+int
+main (
+  int   argc,
+  char  *argv[]
+  )
+{
+  STATIC CONST UINTN  Sets[] = { 256, 255, 200, 129, 128, 100, 37, 3, 2 };
+  CONST CHAR8         *Source;
+  UINT64              Draws;
+  UINTN               Count;
+  UINTN               Set;
+  UINT32              Eax;
+  UINT32              Ecx;
+  double              Threshold;
+  BOOLEAN             Passed;
+  int                 Arg;
+
+  Source    = "prng";
+  Draws     = 0;
+  Count     = 0;
+  Threshold = 3.72; // p = 0.0001
+
+  for (Arg = 1; Arg < argc; ++Arg) {
+    if (argv[Arg][0] != '-' || Arg + 1 >= argc) {
+      Usage ();
+      return EXIT_FAILURE;
+    }
+
+    if (strcmp (argv[Arg], "-s") == 0) {
+      Source = argv[++Arg];
+    } else if (strcmp (argv[Arg], "-n") == 0) {
+      Draws = strtoull (argv[++Arg], NULL, 0);
+    } else if (strcmp (argv[Arg], "-c") == 0) {
+      Count = strtoul (argv[++Arg], NULL, 0);
+    } else if (strcmp (argv[Arg], "-r") == 0) {
+      mRandom = strtoull (argv[++Arg], NULL, 0) | 1;
+    } else if (strcmp (argv[Arg], "-z") == 0) {
+      Threshold = strtod (argv[++Arg], NULL);
+    } else {
+      Usage ();
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (Count > TOTAL_SLIDE_NUM) {
+    Usage ();
+    return EXIT_FAILURE;
+  }
+
+  if (strcmp (Source, "prng") == 0) {
+    mRdRand = TRUE;
+  } else if (strcmp (Source, "rdrand") == 0) {
+    __asm__ __volatile__ ("cpuid" : "=a" (Eax), "=c" (Ecx) : "a" (1), "c" (0) : "ebx", "edx");
+    if ((Ecx & BIT30) == 0) {
+      fprintf (stderr, "RDRAND is not supported by this CPU\n");
+      return EXIT_FAILURE;
+    }
+    mRdRand     = TRUE;
+    mHostRdRand = TRUE;
+  } else if (strcmp (Source, "tsc") == 0) {
+    mRdRand = FALSE;
+  } else {
+    Usage ();
+    return EXIT_FAILURE;
+  }
+
+  //
+  // TSC jitter takes tens of microseconds per value, use fewer draws by default.
+  //
+  if (Draws == 0) {
+    Draws = mRdRand ? 4000000 : 20000;
+  }
+
+  printf ("%s source, %llu draws per set\n", Source, (unsigned long long)Draws);
+
+  Passed = TRUE;
+  if (Count > 0) {
+    Passed &= TestSlideSet (Count, FALSE, Draws, Threshold);
+  } else {
+    for (Set = 0; Set < ARRAY_SIZE (Sets); ++Set) {
+      Passed &= TestSlideSet (Sets[Set], FALSE, Draws, Threshold);
+      if (Sets[Set] < TOTAL_SLIDE_NUM) {
+        Passed &= TestSlideSet (Sets[Set], TRUE, Draws, Threshold);
+      }
+    }
+  }
+
+  return Passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
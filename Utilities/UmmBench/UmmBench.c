@@ -0,0 +1,671 @@
+/**
+
+  Host benchmark for the AptioMemoryFix custom pool allocator.
+  Replays gBS->AllocatePool/FreePool traces against UmmMalloc and reports
+  timing, peak usage, fragmentation and free list lengths.
+
+  Trace format (text, one operation per line, # starts a comment):
+    <time in us> A <id> <size> <memory type>
+    <time in us> F <id> <size> <memory type>
+
+  Only EfiBootServicesData allocations are routed to UmmMalloc, just like
+  MOAllocatePool does. Everything else goes to the host allocator and is
+  reported as firmware pool traffic.
+
+**/
+
+#include <errno.h>
+#include <sys/mman.h>
+#include <time.h>
+
+//
+// Build the allocator directly into the benchmark to reach its internals.
+//
+#include "UmmMalloc/UmmMalloc.c"
+
+#define EFI_BOOT_SERVICES_DATA  4
+
+typedef struct {
+  UINT64  Time;
+  UINT32  Id;
+  UINT32  Size;
+  UINT32  Type;
+  CHAR8   Op;
+} TRACE_RECORD;
+
+typedef struct {
+  TRACE_RECORD  *Records;
+  UINTN         Count;
+  UINT32        MaxId;
+} TRACE;
+
+typedef struct {
+  UINT64  Allocs;
+  UINT64  Frees;
+  UINT64  Fallbacks;
+  UINT64  Firmware;
+  UINT64  LiveBytes;
+  UINT64  PeakLiveBytes;
+  UINT64  PeakUsedBytes;
+  UINT64  InitBytes;
+  UINT64  MagazineHits;
+  UINT64  MagazineMisses;
+  UINT64  FreeBlocks;
+  UINT64  WorstFreeBlocks;
+  UINT64  WorstBinLength;
+  double  PeakFragmentation;
+  double  EndFragmentation;
+} REPLAY_STATS;
+
+typedef struct {
+  UINT64  FreeBlocks;
+  UINT64  FreeBytes;
+  UINT64  LargestFree;
+  UINT64  LongestBin;
+} HEAP_WALK;
+
+STATIC UINT8  *mHeap;
+
+STATIC
+UINT64
+NanoTime (
+  VOID
+  )
+{
+  struct timespec  Ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &Ts);
+  return (UINT64)Ts.tv_sec * 1000000000ULL + (UINT64)Ts.tv_nsec;
+}
+
+STATIC
+VOID
+WalkHeap (
+  HEAP_WALK  *Walk
+  )
+{
+  UINT32  Bin;
+  UINT32  Block;
+  UINT64  Length;
+  UINT64  Size;
+
+  memset (Walk, 0, sizeof (*Walk));
+
+  for (Bin = 0; Bin < UMM_NUM_BINS; ++Bin) {
+    Length = 0;
+    for (Block = umm_bins[Bin]; Block != 0; Block = UMM_NFREE (Block)) {
+      Size = (UINT64)UMM_BLOCKSIZE (Block) * sizeof (umm_block);
+      Walk->FreeBytes += Size;
+      if (Size > Walk->LargestFree) {
+        Walk->LargestFree = Size;
+      }
+      ++Length;
+    }
+
+    Walk->FreeBlocks += Length;
+    if (Length > Walk->LongestBin) {
+      Walk->LongestBin = Length;
+    }
+  }
+}
+
+STATIC
+double
+Fragmentation (
+  HEAP_WALK  *Walk
+  )
+{
+  if (Walk->FreeBytes == 0) {
+    return 0.0;
+  }
+
+  return 1.0 - (double)Walk->LargestFree / (double)Walk->FreeBytes;
+}
+
+STATIC
+BOOLEAN
+LoadTrace (
+  CONST CHAR8  *Path,
+  TRACE        *Trace
+  )
+{
+  FILE          *File;
+  CHAR8         Line[256];
+  UINTN         Capacity;
+  TRACE_RECORD  Record;
+  unsigned long long Time;
+  unsigned      Id;
+  unsigned      Size;
+  unsigned      Type;
+  char          Op;
+
+  File = fopen (Path, "r");
+  if (File == NULL) {
+    fprintf (stderr, "Failed to open %s - %s\n", Path, strerror (errno));
+    return FALSE;
+  }
+
+  memset (Trace, 0, sizeof (*Trace));
+  Capacity = 0;
+
+  while (fgets (Line, sizeof (Line), File) != NULL) {
+    if (Line[0] == '#' || Line[0] == '\n') {
+      continue;
+    }
+
+    if (sscanf (Line, "%llu %c %u %u %u", &Time, &Op, &Id, &Size, &Type) != 5
+      || (Op != 'A' && Op != 'F')) {
+      fprintf (stderr, "Malformed trace line in %s: %s", Path, Line);
+      fclose (File);
+      free (Trace->Records);
+      return FALSE;
+    }
+
+    if (Trace->Count == Capacity) {
+      Capacity = Capacity != 0 ? Capacity * 2 : 4096;
+      Trace->Records = realloc (Trace->Records, Capacity * sizeof (TRACE_RECORD));
+      if (Trace->Records == NULL) {
+        fprintf (stderr, "Out of memory loading %s\n", Path);
+        fclose (File);
+        return FALSE;
+      }
+    }
+
+    Record.Time = Time;
+    Record.Op   = Op;
+    Record.Id   = Id;
+    Record.Size = Size;
+    Record.Type = Type;
+    Trace->Records[Trace->Count++] = Record;
+
+    if (Id > Trace->MaxId) {
+      Trace->MaxId = Id;
+    }
+  }
+
+  fclose (File);
+  return TRUE;
+}
+
+/**
+  Replays the trace once. When SampleRate is not 0 the heap is walked every
+  SampleRate operations and at every new peak, which is slow, so timed runs
+  pass 0.
+**/
+STATIC
+VOID
+Replay (
+  TRACE         *Trace,
+  VOID          **Slots,
+  UINTN         SampleRate,
+  REPLAY_STATS  *Stats
+  )
+{
+  UINTN         Index;
+  TRACE_RECORD  *Record;
+  VOID          *Buffer;
+  HEAP_WALK     Walk;
+  BOOLEAN       NewPeak;
+
+  memset (Stats, 0, sizeof (*Stats));
+  UmmSetHeap (mHeap);
+
+  for (Index = 0; Index < Trace->Count; ++Index) {
+    Record  = &Trace->Records[Index];
+    NewPeak = FALSE;
+
+    if (Record->Op == 'A') {
+      Buffer = NULL;
+      if (Record->Type == EFI_BOOT_SERVICES_DATA) {
+        Buffer = UmmMalloc (Record->Size);
+        if (Buffer == NULL) {
+          ++Stats->Fallbacks;
+        }
+      } else {
+        ++Stats->Firmware;
+      }
+
+      if (Buffer == NULL) {
+        Buffer = malloc (Record->Size != 0 ? Record->Size : 1);
+      } else {
+        Stats->LiveBytes += Record->Size;
+        if (Stats->LiveBytes > Stats->PeakLiveBytes) {
+          Stats->PeakLiveBytes = Stats->LiveBytes;
+          NewPeak = TRUE;
+        }
+      }
+
+      Slots[Record->Id] = Buffer;
+      ++Stats->Allocs;
+    } else if (Slots[Record->Id] != NULL) {
+      if (UmmFree (Slots[Record->Id])) {
+        Stats->LiveBytes -= Record->Size;
+      } else {
+        free (Slots[Record->Id]);
+      }
+
+      Slots[Record->Id] = NULL;
+      ++Stats->Frees;
+    }
+
+    if (SampleRate != 0 && (NewPeak || Index % SampleRate == 0)) {
+      WalkHeap (&Walk);
+      if (Walk.FreeBlocks > Stats->WorstFreeBlocks) {
+        Stats->WorstFreeBlocks = Walk.FreeBlocks;
+      }
+      if (Walk.LongestBin > Stats->WorstBinLength) {
+        Stats->WorstBinLength = Walk.LongestBin;
+      }
+      if ((UINT64)umm_limit * sizeof (umm_block) - Walk.FreeBytes > Stats->PeakUsedBytes) {
+        Stats->PeakUsedBytes = (UINT64)umm_limit * sizeof (umm_block) - Walk.FreeBytes;
+      }
+      if (NewPeak) {
+        Stats->PeakFragmentation = Fragmentation (&Walk);
+      }
+    }
+  }
+
+  if (SampleRate != 0) {
+    WalkHeap (&Walk);
+    Stats->InitBytes        = (UINT64)umm_limit * sizeof (umm_block);
+    Stats->MagazineHits     = umm_stats.MagazineHits;
+    Stats->MagazineMisses   = umm_stats.MagazineMisses;
+    Stats->FreeBlocks       = Walk.FreeBlocks;
+    Stats->EndFragmentation = Fragmentation (&Walk);
+  }
+
+  //
+  // Release leaked host allocations, the pool is simply reset.
+  //
+  for (Index = 0; Index <= Trace->MaxId; ++Index) {
+    if (Slots[Index] != NULL) {
+      if (!UmmFree (Slots[Index])) {
+        free (Slots[Index]);
+      }
+      Slots[Index] = NULL;
+    }
+  }
+}
+
+STATIC
+INT32
+RunTrace (
+  CONST CHAR8  *Path,
+  UINTN        Iterations,
+  UINTN        SampleRate
+  )
+{
+  TRACE         Trace;
+  VOID          **Slots;
+  REPLAY_STATS  Stats;
+  UINT64        Start;
+  UINT64        Elapsed;
+  UINTN         Index;
+
+  if (!LoadTrace (Path, &Trace)) {
+    return EXIT_FAILURE;
+  }
+
+  Slots = calloc (Trace.MaxId + 1, sizeof (VOID *));
+  if (Slots == NULL) {
+    fprintf (stderr, "Out of memory replaying %s\n", Path);
+    free (Trace.Records);
+    return EXIT_FAILURE;
+  }
+
+  Elapsed = 0;
+  for (Index = 0; Index < Iterations; ++Index) {
+    Start    = NanoTime ();
+    Replay (&Trace, Slots, 0, &Stats);
+    Elapsed += NanoTime () - Start;
+  }
+
+  Replay (&Trace, Slots, SampleRate, &Stats);
+
+  printf ("%s\n", Path);
+  printf ("  operations        %llu (%llu allocs, %llu frees) x %zu\n",
+    (unsigned long long)(Stats.Allocs + Stats.Frees), (unsigned long long)Stats.Allocs,
+    (unsigned long long)Stats.Frees, (size_t)Iterations);
+  printf ("  time              %.1f ns/op\n",
+    (double)Elapsed / (double)((Stats.Allocs + Stats.Frees) * Iterations));
+  printf ("  fallbacks         %llu (firmware pool types %llu)\n",
+    (unsigned long long)Stats.Fallbacks, (unsigned long long)Stats.Firmware);
+  printf ("  peak live         %.2f MB\n", (double)Stats.PeakLiveBytes / (1024.0 * 1024.0));
+  printf ("  peak heap used    %.2f MB of %.2f MB\n", (double)Stats.PeakUsedBytes / (1024.0 * 1024.0),
+    (double)UMM_MALLOC_CFG_HEAP_SIZE / (1024.0 * 1024.0));
+  printf ("  initialised       %.2f MB\n", (double)Stats.InitBytes / (1024.0 * 1024.0));
+  printf ("  fragmentation     %.4f at peak, %.4f at end\n", Stats.PeakFragmentation, Stats.EndFragmentation);
+  printf ("  free blocks       %llu at end, %llu worst\n",
+    (unsigned long long)Stats.FreeBlocks, (unsigned long long)Stats.WorstFreeBlocks);
+  printf ("  magazines         %llu hits, %llu misses\n",
+    (unsigned long long)Stats.MagazineHits, (unsigned long long)Stats.MagazineMisses);
+  printf ("  longest free list %llu\n", (unsigned long long)Stats.WorstBinLength);
+
+  free (Slots);
+  free (Trace.Records);
+  return EXIT_SUCCESS;
+}
+
+//
+// Trace generation
+//
+
+STATIC UINT64  mRandom = 0x9E3779B97F4A7C15ULL;
+
+STATIC
+UINT32
+Random (
+  UINT32  Limit
+  )
+{
+  mRandom ^= mRandom << 13;
+  mRandom ^= mRandom >> 7;
+  mRandom ^= mRandom << 17;
+  return (UINT32)(mRandom % Limit);
+}
+
+typedef struct {
+  UINT64  Time;
+  UINT32  NextId;
+  UINT32  *Live;
+  UINT32  *LiveSize;
+  UINT32  LiveCount;
+  UINT32  LiveCapacity;
+} TRACE_WRITER;
+
+STATIC
+UINT32
+EmitAlloc (
+  TRACE_WRITER  *Writer,
+  UINT32        Size,
+  UINT32        Type,
+  BOOLEAN       Track
+  )
+{
+  UINT32  Id;
+
+  Id = Writer->NextId++;
+  Writer->Time += 1 + Random (40);
+  printf ("%llu A %u %u %u\n", (unsigned long long)Writer->Time, Id, Size, Type);
+
+  if (Track) {
+    if (Writer->LiveCount == Writer->LiveCapacity) {
+      Writer->LiveCapacity = Writer->LiveCapacity != 0 ? Writer->LiveCapacity * 2 : 1024;
+      Writer->Live         = realloc (Writer->Live, Writer->LiveCapacity * sizeof (UINT32));
+      Writer->LiveSize     = realloc (Writer->LiveSize, Writer->LiveCapacity * sizeof (UINT32));
+      if (Writer->Live == NULL || Writer->LiveSize == NULL) {
+        fprintf (stderr, "Out of memory generating trace\n");
+        exit (EXIT_FAILURE);
+      }
+    }
+
+    Writer->Live[Writer->LiveCount]     = Id;
+    Writer->LiveSize[Writer->LiveCount] = Size;
+    ++Writer->LiveCount;
+  }
+
+  return Id;
+}
+
+STATIC
+VOID
+EmitFree (
+  TRACE_WRITER  *Writer,
+  UINT32        Id,
+  UINT32        Size
+  )
+{
+  Writer->Time += 1 + Random (20);
+  printf ("%llu F %u %u %u\n", (unsigned long long)Writer->Time, Id, Size, EFI_BOOT_SERVICES_DATA);
+}
+
+STATIC
+VOID
+EmitFreeRandom (
+  TRACE_WRITER  *Writer
+  )
+{
+  UINT32  Index;
+
+  if (Writer->LiveCount == 0) {
+    return;
+  }
+
+  Index = Random (Writer->LiveCount);
+  EmitFree (Writer, Writer->Live[Index], Writer->LiveSize[Index]);
+  --Writer->LiveCount;
+  Writer->Live[Index]     = Writer->Live[Writer->LiveCount];
+  Writer->LiveSize[Index] = Writer->LiveSize[Writer->LiveCount];
+}
+
+/**
+  One AMI PrintLine call, see MOAllocatePool.
+**/
+STATIC
+VOID
+EmitPrintLine (
+  TRACE_WRITER  *Writer
+  )
+{
+  UINT32  First;
+  UINT32  Second;
+
+  First  = EmitAlloc (Writer, 184320, EFI_BOOT_SERVICES_DATA, FALSE);
+  Second = EmitAlloc (Writer, 127968, EFI_BOOT_SERVICES_DATA, FALSE);
+  EmitFree (Writer, Second, 127968);
+  EmitFree (Writer, First, 184320);
+}
+
+STATIC
+UINT32
+SmallSize (
+  VOID
+  )
+{
+  STATIC CONST UINT32 Sizes[] = { 8, 16, 24, 32, 48, 64, 96, 128, 256, 512 };
+  return Sizes[Random (ARRAY_SIZE (Sizes))] + Random (8);
+}
+
+/**
+  Approximates a 10.13 boot: boot.efi setup with many small short-lived
+  allocations, then kext loading keeping plists and binaries alive, then
+  the prelinked kernel with large decompression buffers. Roughly 300 MB
+  stays allocated at the peak.
+**/
+STATIC
+VOID
+GenerateBoot (
+  TRACE_WRITER  *Writer,
+  UINT32        Scale,
+  BOOLEAN       Verbose
+  )
+{
+  UINT32  Index;
+  UINT32  Kext;
+  UINT32  Id;
+  UINT32  Binary;
+  UINT32  Compressed;
+  UINT32  Kernel;
+
+  for (Index = 0; Index < 400 * Scale; ++Index) {
+    if (Random (3) != 0) {
+      EmitAlloc (Writer, SmallSize (), EFI_BOOT_SERVICES_DATA, TRUE);
+    } else {
+      EmitFreeRandom (Writer);
+    }
+    if (Verbose && Random (8) == 0) {
+      EmitPrintLine (Writer);
+    }
+    if (Random (32) == 0) {
+      EmitAlloc (Writer, SmallSize (), 6, FALSE);
+    }
+  }
+
+  for (Kext = 0; Kext < 120 * Scale; ++Kext) {
+    EmitAlloc (Writer, 4096 + Random (60 * 1024), EFI_BOOT_SERVICES_DATA, TRUE);
+    Binary = 16 * 1024 + Random (2 * 1024 * 1024);
+    Id     = EmitAlloc (Writer, Binary, EFI_BOOT_SERVICES_DATA, Random (4) != 0);
+    for (Index = 0; Index < 8; ++Index) {
+      EmitAlloc (Writer, SmallSize (), EFI_BOOT_SERVICES_DATA, Random (2) == 0);
+    }
+    if (Verbose && Random (2) == 0) {
+      EmitPrintLine (Writer);
+    }
+    if (Random (2) == 0) {
+      EmitFreeRandom (Writer);
+    }
+  }
+
+  Compressed = 32 * 1024 * 1024;
+  Kernel     = 144 * 1024 * 1024;
+  Id         = EmitAlloc (Writer, Compressed, EFI_BOOT_SERVICES_DATA, FALSE);
+  EmitAlloc (Writer, Kernel, EFI_BOOT_SERVICES_DATA, TRUE);
+  EmitFree (Writer, Id, Compressed);
+
+  for (Index = 0; Index < 200 * Scale; ++Index) {
+    if (Random (2) == 0) {
+      EmitAlloc (Writer, SmallSize (), EFI_BOOT_SERVICES_DATA, TRUE);
+    } else {
+      EmitFreeRandom (Writer);
+    }
+    if (Verbose) {
+      EmitPrintLine (Writer);
+    }
+  }
+}
+
+/**
+  Random sizes from 8 bytes to 4 MB with random lifetimes.
+  Not modelled on anything real, used to stress fragmentation.
+**/
+STATIC
+VOID
+GenerateFragmentation (
+  TRACE_WRITER  *Writer,
+  UINT32        Scale
+  )
+{
+  UINT32  Index;
+  UINT32  Size;
+
+  for (Index = 0; Index < 4000 * Scale; ++Index) {
+    if (Writer->LiveCount < 64 || Random (5) < 3) {
+      Size = Random (4) == 0 ? 4096 + Random (4 * 1024 * 1024) : SmallSize ();
+      EmitAlloc (Writer, Size, EFI_BOOT_SERVICES_DATA, TRUE);
+    } else {
+      EmitFreeRandom (Writer);
+    }
+  }
+}
+
+STATIC
+INT32
+Generate (
+  CONST CHAR8  *Pattern,
+  UINT32       Scale
+  )
+{
+  TRACE_WRITER  Writer;
+
+  memset (&Writer, 0, sizeof (Writer));
+
+  printf ("# UmmBench trace: %s, scale %u\n", Pattern, Scale);
+  printf ("# <time in us> <A|F> <id> <size> <memory type>\n");
+
+  if (strcmp (Pattern, "boot") == 0) {
+    GenerateBoot (&Writer, Scale, FALSE);
+  } else if (strcmp (Pattern, "verbose") == 0) {
+    GenerateBoot (&Writer, Scale, TRUE);
+  } else if (strcmp (Pattern, "frag") == 0) {
+    GenerateFragmentation (&Writer, Scale);
+  } else {
+    fprintf (stderr, "Unknown pattern %s, use boot, verbose or frag\n", Pattern);
+    return EXIT_FAILURE;
+  }
+
+  while (Writer.LiveCount > 0) {
+    EmitFreeRandom (&Writer);
+  }
+
+  free (Writer.Live);
+  free (Writer.LiveSize);
+  return EXIT_SUCCESS;
+}
+
+STATIC
+VOID
+Usage (
+  VOID
+  )
+{
+  fprintf (stderr,
+    "Usage: UmmBench [-n iterations] [-s sample rate] trace...\n"
+    "       UmmBench -g boot|verbose|frag [-r seed] [-x scale]\n");
+}
+
+int
+main (
+  int   argc,
+  char  *argv[]
+  )
+{
+  CONST CHAR8  *Pattern;
+  UINTN        Iterations;
+  UINTN        SampleRate;
+  UINT32       Scale;
+  INT32        Status;
+  int          Index;
+
+  Pattern    = NULL;
+  Iterations = 10;
+  SampleRate = 64;
+  Scale      = 1;
+
+  for (Index = 1; Index < argc && argv[Index][0] == '-'; ++Index) {
+    if (Index + 1 >= argc) {
+      Usage ();
+      return EXIT_FAILURE;
+    }
+
+    if (strcmp (argv[Index], "-n") == 0) {
+      Iterations = strtoul (argv[++Index], NULL, 0);
+    } else if (strcmp (argv[Index], "-s") == 0) {
+      SampleRate = strtoul (argv[++Index], NULL, 0);
+    } else if (strcmp (argv[Index], "-g") == 0) {
+      Pattern = argv[++Index];
+    } else if (strcmp (argv[Index], "-r") == 0) {
+      mRandom = strtoull (argv[++Index], NULL, 0) | 1;
+    } else if (strcmp (argv[Index], "-x") == 0) {
+      Scale = (UINT32)strtoul (argv[++Index], NULL, 0);
+    } else {
+      Usage ();
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (Pattern != NULL) {
+    return Generate (Pattern, Scale != 0 ? Scale : 1);
+  }
+
+  if (Index == argc || Iterations == 0) {
+    Usage ();
+    return EXIT_FAILURE;
+  }
+
+  mHeap = mmap (NULL, UMM_MALLOC_CFG_HEAP_SIZE, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (mHeap == MAP_FAILED) {
+    fprintf (stderr, "Failed to map %u bytes for the pool\n", (unsigned)UMM_MALLOC_CFG_HEAP_SIZE);
+    return EXIT_FAILURE;
+  }
+
+  Status = EXIT_SUCCESS;
+  for (; Index < argc; ++Index) {
+    if (RunTrace (argv[Index], Iterations, SampleRate) != EXIT_SUCCESS) {
+      Status = EXIT_FAILURE;
+    }
+  }
+
+  munmap (mHeap, UMM_MALLOC_CFG_HEAP_SIZE);
+  return Status;
+}
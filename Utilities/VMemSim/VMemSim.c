@@ -0,0 +1,677 @@
+/**
+
+  Host simulator for the AptioMemoryFix page table code.
+  Builds VMem.c against page tables kept in an mmap'd arena that stands in
+  for physical memory below 4 GB, maps synthetic runtime area layouts the way
+  ExecSetVirtualAddressesToMemMap does and checks every translation.
+
+  Layouts:
+    boot    virtual address is the physical address in the kernel region,
+            like boot.efi assigns them
+    packed  areas are packed one after another in the kernel region
+    mixed   random choice of the above per area
+
+  Reports mapping time, random and page by page walks per second (single and
+  batched), table pages used against the pool estimate and how much of the
+  mapped memory is covered by large pages.
+
+**/
+
+#include <sys/mman.h>
+#include <time.h>
+
+//
+// Page tables live in the arena, which pretends to be physical memory at SIM_ARENA_BASE.
+//
+#define SIM_ARENA_BASE    0xC0000000ULL
+#define SIM_KERNEL_BASE   0xFFFFFF8000000000ULL
+
+STATIC UINT8   *mArena;
+STATIC UINT64  mArenaSize;
+STATIC UINT64  mArenaTop;
+
+STATIC
+VOID *
+SimPhysToPtr (
+  UINT64  Addr
+  )
+{
+  if (Addr < SIM_ARENA_BASE || Addr - SIM_ARENA_BASE >= mArenaSize) {
+    fprintf (stderr, "Page table address %llx is outside of the arena\n", (unsigned long long)Addr);
+    abort ();
+  }
+
+  return mArena + (Addr - SIM_ARENA_BASE);
+}
+
+#define VMEM_PHYS_TO_PTR(Addr) SimPhysToPtr ((UINT64)(Addr))
+#define VMEM_PTR_TO_PHYS(Ptr)  ((UINT64)((UINT8 *)(Ptr) - mArena) + SIM_ARENA_BASE)
+
+//
+// CPU and boot services used by VMem.c
+//
+
+STATIC UINTN    mCr3;
+STATIC BOOLEAN  mPage1Gb = TRUE;
+
+STATIC
+UINTN
+AsmReadCr3 (
+  VOID
+  )
+{
+  return mCr3;
+}
+
+STATIC
+UINTN
+AsmWriteCr3 (
+  UINTN  Cr3
+  )
+{
+  mCr3 = Cr3;
+  return Cr3;
+}
+
+STATIC
+UINT32
+AsmCpuid (
+  UINT32  Index,
+  UINT32  *Eax,
+  UINT32  *Ebx,
+  UINT32  *Ecx,
+  UINT32  *Edx
+  )
+{
+  if (Eax != NULL) {
+    *Eax = Index == 0x80000000 ? 0x80000008 : 0;
+  }
+  if (Ebx != NULL) {
+    *Ebx = 0;
+  }
+  if (Ecx != NULL) {
+    *Ecx = 0;
+  }
+  if (Edx != NULL) {
+    *Edx = (Index == 0x80000001 && mPage1Gb) ? BIT26 : 0;
+  }
+  return Index;
+}
+
+typedef struct {
+  EFI_STATUS (*FreePages) (EFI_PHYSICAL_ADDRESS Memory, UINTN Pages);
+} SIM_BOOT_SERVICES;
+
+STATIC
+EFI_STATUS
+SimFreePages (
+  EFI_PHYSICAL_ADDRESS  Memory,
+  UINTN                 Pages
+  )
+{
+  //
+  // The arena is a bump allocator reset for every layout, freed pages are simply dropped.
+  //
+  return EFI_SUCCESS;
+}
+
+STATIC SIM_BOOT_SERVICES  mBootServices = { SimFreePages };
+STATIC SIM_BOOT_SERVICES  *gBS = &mBootServices;
+
+//
+// Build page table code directly into the simulator to reach its internals.
+//
+#include "VMem.c"
+
+STATIC EFI_MEMORY_DESCRIPTOR  *mLayout;
+STATIC UINTN                  mLayoutCount;
+
+EFI_STATUS
+EFIAPI
+AllocatePagesFromTop (
+  IN EFI_MEMORY_TYPE          MemoryType,
+  IN UINTN                    Pages,
+  IN OUT EFI_PHYSICAL_ADDRESS *Memory,
+  IN BOOLEAN                  CheckRange
+  )
+{
+  UINT64  Top;
+
+  Top = MIN (SIM_ARENA_BASE + mArenaTop, *Memory);
+  if (Top < SIM_ARENA_BASE + EFI_PAGES_TO_SIZE (Pages)) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  *Memory   = Top - EFI_PAGES_TO_SIZE (Pages);
+  mArenaTop = *Memory - SIM_ARENA_BASE;
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+EFIAPI
+GetMemoryMapSnapshot (
+  OUT UINTN                   *MemoryMapSize,
+  OUT EFI_MEMORY_DESCRIPTOR   **MemoryMap,
+  OUT UINTN                   *DescriptorSize,
+  OUT UINTN                   *MapKey  OPTIONAL
+  )
+{
+  *MemoryMapSize  = mLayoutCount * sizeof (EFI_MEMORY_DESCRIPTOR);
+  *MemoryMap      = mLayout;
+  *DescriptorSize = sizeof (EFI_MEMORY_DESCRIPTOR);
+  if (MapKey != NULL) {
+    *MapKey = 0;
+  }
+  return EFI_SUCCESS;
+}
+
+VOID
+EFIAPI
+PrintScreen (
+  IN  CONST CHAR16   *Format,
+  ...
+  )
+{
+  fprintf (stderr, "VMem.c reported a failure\n");
+}
+
+//
+// Layout generation
+//
+
+STATIC UINT64  mRandom = 0x9E3779B97F4A7C15ULL;
+
+STATIC
+UINT64
+Random (
+  UINT64  Limit
+  )
+{
+  mRandom ^= mRandom << 13;
+  mRandom ^= mRandom >> 7;
+  mRandom ^= mRandom << 17;
+  return mRandom % Limit;
+}
+
+STATIC
+UINT64
+NanoTime (
+  VOID
+  )
+{
+  struct timespec  Ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &Ts);
+  return (UINT64)Ts.tv_sec * 1000000000ULL + (UINT64)Ts.tv_nsec;
+}
+
+/** Runtime areas are mostly a few pages of driver code and data, with some large reserved regions. */
+STATIC
+UINT64
+AreaPages (
+  VOID
+  )
+{
+  UINT64  Class;
+
+  Class = Random (100);
+  if (Class < 65) {
+    return 1 + Random (64);
+  } else if (Class < 90) {
+    return 65 + Random (4032);
+  } else if (Class < 99) {
+    return 4097 + Random (28672);
+  }
+  return 262144 + Random (262144);
+}
+
+STATIC
+BOOLEAN
+GenerateLayout (
+  CONST CHAR8  *Layout,
+  UINTN        Count
+  )
+{
+  EFI_MEMORY_DESCRIPTOR  *Desc;
+  UINT64                 Phys;
+  UINT64                 Virt;
+  UINT64                 Align;
+  UINTN                  Index;
+  BOOLEAN                Packed;
+
+  if (strcmp (Layout, "boot") != 0 && strcmp (Layout, "packed") != 0 && strcmp (Layout, "mixed") != 0) {
+    fprintf (stderr, "Unknown layout %s\n", Layout);
+    return FALSE;
+  }
+
+  mLayout = calloc (Count, sizeof (EFI_MEMORY_DESCRIPTOR));
+  if (mLayout == NULL) {
+    fprintf (stderr, "Out of memory generating layout\n");
+    return FALSE;
+  }
+  mLayoutCount = Count;
+
+  Phys = BASE_4GB;
+  Virt = SIM_KERNEL_BASE;
+
+  for (Index = 0; Index < Count; ++Index) {
+    Desc = &mLayout[Index];
+
+    //
+    // Mixed alignments: most areas are page aligned, some start on 2 MB or 1 GB boundaries.
+    //
+    Align = Random (100);
+    Align = Align < 70 ? BASE_4KB : (Align < 92 ? BASE_2MB : BASE_1GB);
+    Phys  = (Phys + EFI_PAGES_TO_SIZE (Random (16)) + Align - 1) & ~(Align - 1);
+
+    Desc->Type          = Random (2) == 0 ? EfiRuntimeServicesCode : EfiRuntimeServicesData;
+    Desc->PhysicalStart = Phys;
+    Desc->NumberOfPages = AreaPages ();
+    Desc->Attribute     = EFI_MEMORY_RUNTIME;
+
+    Packed = strcmp (Layout, "packed") == 0 || (strcmp (Layout, "mixed") == 0 && Random (2) == 0);
+    if (Packed) {
+      Desc->VirtualStart = Virt;
+    } else {
+      Desc->VirtualStart = SIM_KERNEL_BASE | Phys;
+    }
+
+    Phys += EFI_PAGES_TO_SIZE (Desc->NumberOfPages);
+    Virt  = MAX (Virt, Desc->VirtualStart) + EFI_PAGES_TO_SIZE (Desc->NumberOfPages);
+  }
+
+  return TRUE;
+}
+
+//
+// Simulation
+//
+
+typedef struct {
+  UINT64  MapNs;
+  UINT64  WalkNs;
+  UINT64  Walks;
+  UINT64  WrongWalks;
+  UINT64  PageNs;
+  UINT64  BatchNs;
+  UINT64  Pages;
+  UINT64  WrongPages;
+  UINTN   PoolPages;
+  UINTN   UsedPages;
+  UINT64  Bytes[3];
+} SIM_STATS;
+
+/** Creates firmware-like page table with the first 512 GB identity mapped by 1 GB pages. */
+STATIC
+PAGE_MAP_AND_DIRECTORY_POINTER *
+CreatePageTable (
+  VOID
+  )
+{
+  EFI_PHYSICAL_ADDRESS            Addr;
+  PAGE_MAP_AND_DIRECTORY_POINTER  *PML4;
+  PAGE_TABLE_1G_ENTRY             *PTE1G;
+  UINTN                           Index;
+
+  Addr = BASE_4GB;
+  if (EFI_ERROR (AllocatePagesFromTop (EfiBootServicesData, 2, &Addr, FALSE))) {
+    return NULL;
+  }
+
+  PML4  = VMEM_PHYS_TO_PTR (Addr);
+  PTE1G = VMEM_PHYS_TO_PTR (Addr + EFI_PAGE_SIZE);
+  ZeroMem (PML4, 2 * EFI_PAGE_SIZE);
+
+  for (Index = 0; Index < 512; Index++) {
+    PTE1G[Index].Uint64        = LShiftU64 (Index, 30);
+    PTE1G[Index].Bits.ReadWrite = 1;
+    PTE1G[Index].Bits.Present   = 1;
+    PTE1G[Index].Bits.MustBe1   = 1;
+  }
+
+  PML4->Uint64         = Addr + EFI_PAGE_SIZE;
+  PML4->Bits.ReadWrite = 1;
+  PML4->Bits.Present   = 1;
+
+  mCr3 = (UINTN)Addr;
+  return PML4;
+}
+
+/** Returns the size of the page mapping VirtualAddr, or 0 if it is not mapped. */
+STATIC
+UINT64
+LeafSize (
+  PAGE_MAP_AND_DIRECTORY_POINTER  *PageTable,
+  EFI_VIRTUAL_ADDRESS             VirtualAddr
+  )
+{
+  VIRTUAL_ADDR                    VA;
+  PAGE_MAP_AND_DIRECTORY_POINTER  *Entry;
+
+  VA.Uint64 = VirtualAddr;
+
+  Entry = PageTable + VA.Pg4K.PML4Offset;
+  if (!Entry->Bits.Present) {
+    return 0;
+  }
+
+  Entry = (PAGE_MAP_AND_DIRECTORY_POINTER *)VMEM_PHYS_TO_PTR (Entry->Uint64 & PT_ADDR_MASK_4K) + VA.Pg4K.PDPOffset;
+  if (!Entry->Bits.Present) {
+    return 0;
+  }
+  if (Entry->Bits.MustBeZero & 0x1) {
+    return BASE_1GB;
+  }
+
+  Entry = (PAGE_MAP_AND_DIRECTORY_POINTER *)VMEM_PHYS_TO_PTR (Entry->Uint64 & PT_ADDR_MASK_4K) + VA.Pg4K.PDOffset;
+  if (!Entry->Bits.Present) {
+    return 0;
+  }
+
+  return (Entry->Bits.MustBeZero & 0x1) ? BASE_2MB : BASE_4KB;
+}
+
+/** Maps the layout into a fresh page table, returns NULL on failure. */
+STATIC
+PAGE_MAP_AND_DIRECTORY_POINTER *
+MapLayout (
+  VOID
+  )
+{
+  PAGE_MAP_AND_DIRECTORY_POINTER  *PageTable;
+  UINTN                           Flags;
+  UINTN                           Index;
+
+  mArenaTop             = mArenaSize;
+  VmMemoryPool          = NULL;
+  VmMemoryPoolFreePages = 0;
+  VmMemoryPoolBase      = 0;
+  VmMemoryPoolPages     = 0;
+  VmPage1GbSupport      = -1;
+
+  if (CreatePageTable () == NULL || EFI_ERROR (VmAllocateMemoryPool ())) {
+    fprintf (stderr, "Arena of %llu MB is too small\n", (unsigned long long)(mArenaSize >> 20));
+    return NULL;
+  }
+
+  GetCurrentPageTable (&PageTable, &Flags);
+
+  for (Index = 0; Index < mLayoutCount; ++Index) {
+    if (EFI_ERROR (VmMapVirtualPages (PageTable, mLayout[Index].VirtualStart,
+      (UINTN)mLayout[Index].NumberOfPages, mLayout[Index].PhysicalStart))) {
+      fprintf (stderr, "Mapping area %zu failed, pool exhausted\n", (size_t)Index);
+      return NULL;
+    }
+  }
+
+  VmFlashCaches ();
+  return PageTable;
+}
+
+/** Translates every page of the layout in address order, one by one and in a batch. */
+STATIC
+BOOLEAN
+WalkPages (
+  PAGE_MAP_AND_DIRECTORY_POINTER  *PageTable,
+  SIM_STATS                       *Stats
+  )
+{
+  EFI_VIRTUAL_ADDRESS             *Addrs;
+  EFI_PHYSICAL_ADDRESS            *Phys;
+  EFI_PHYSICAL_ADDRESS            *Expected;
+  UINT64                          Start;
+  UINT64                          Page;
+  UINTN                           Index;
+  UINTN                           Count;
+
+  Count = 0;
+  for (Index = 0; Index < mLayoutCount; ++Index) {
+    Count += (UINTN)mLayout[Index].NumberOfPages;
+  }
+
+  Addrs    = malloc (Count * sizeof (*Addrs));
+  Phys     = malloc (Count * sizeof (*Phys));
+  Expected = malloc (Count * sizeof (*Expected));
+  if (Addrs == NULL || Phys == NULL || Expected == NULL) {
+    fprintf (stderr, "Out of memory preparing %zu page walks\n", (size_t)Count);
+    free (Addrs);
+    free (Phys);
+    free (Expected);
+    return FALSE;
+  }
+
+  //
+  // Layouts are generated in ascending virtual address order.
+  //
+  Count = 0;
+  for (Index = 0; Index < mLayoutCount; ++Index) {
+    for (Page = 0; Page < mLayout[Index].NumberOfPages; ++Page) {
+      Addrs[Count]    = mLayout[Index].VirtualStart + EFI_PAGES_TO_SIZE (Page);
+      Expected[Count] = mLayout[Index].PhysicalStart + EFI_PAGES_TO_SIZE (Page);
+      ++Count;
+    }
+  }
+
+  VmFlashCaches ();
+  Start = NanoTime ();
+  for (Index = 0; Index < Count; ++Index) {
+    if (GetPhysicalAddr (PageTable, Addrs[Index], &Phys[Index]) != EFI_SUCCESS) {
+      Phys[Index] = 0;
+    }
+  }
+  Stats->PageNs = NanoTime () - Start;
+
+  for (Index = 0; Index < Count; ++Index) {
+    Stats->WrongPages += Phys[Index] != Expected[Index];
+  }
+
+  VmFlashCaches ();
+  Start = NanoTime ();
+  GetPhysicalAddrs (PageTable, Addrs, Count, Phys);
+  Stats->BatchNs = NanoTime () - Start;
+
+  for (Index = 0; Index < Count; ++Index) {
+    Stats->WrongPages += Phys[Index] != Expected[Index];
+  }
+
+  Stats->Pages = Count;
+
+  free (Addrs);
+  free (Phys);
+  free (Expected);
+  return TRUE;
+}
+
+STATIC
+BOOLEAN
+Simulate (
+  UINTN      Iterations,
+  UINT64     Walks,
+  SIM_STATS  *Stats
+  )
+{
+  PAGE_MAP_AND_DIRECTORY_POINTER  *PageTable;
+  EFI_MEMORY_DESCRIPTOR           *Desc;
+  EFI_VIRTUAL_ADDRESS             *Addrs;
+  EFI_PHYSICAL_ADDRESS            *Expected;
+  EFI_PHYSICAL_ADDRESS            Phys;
+  EFI_VIRTUAL_ADDRESS             Virt;
+  EFI_VIRTUAL_ADDRESS             End;
+  UINT64                          Start;
+  UINT64                          Size;
+  UINT64                          Offset;
+  UINTN                           Index;
+
+  ZeroMem (Stats, sizeof (*Stats));
+  PageTable = NULL;
+
+  for (Index = 0; Index < Iterations; ++Index) {
+    Start     = NanoTime ();
+    PageTable = MapLayout ();
+    Stats->MapNs += NanoTime () - Start;
+    if (PageTable == NULL) {
+      return FALSE;
+    }
+  }
+
+  VmGetMemoryPoolStats (&Stats->PoolPages, &Stats->UsedPages);
+
+  //
+  // Large page coverage of the mapped bytes.
+  //
+  for (Index = 0; Index < mLayoutCount; ++Index) {
+    Desc = &mLayout[Index];
+    Virt = Desc->VirtualStart;
+    End  = Virt + EFI_PAGES_TO_SIZE (Desc->NumberOfPages);
+    while (Virt < End) {
+      Size = LeafSize (PageTable, Virt);
+      if (Size == 0) {
+        fprintf (stderr, "Address %llx is not mapped\n", (unsigned long long)Virt);
+        return FALSE;
+      }
+      Offset = MIN ((Virt & ~(Size - 1)) + Size, End) - Virt;
+      Stats->Bytes[Size == BASE_1GB ? 0 : (Size == BASE_2MB ? 1 : 2)] += Offset;
+      Virt += Offset;
+    }
+  }
+
+  //
+  // Random translations, addresses are prepared upfront to time the walks alone.
+  //
+  Addrs    = malloc (Walks * sizeof (*Addrs));
+  Expected = malloc (Walks * sizeof (*Expected));
+  if (Addrs == NULL || Expected == NULL) {
+    fprintf (stderr, "Out of memory preparing %llu walks\n", (unsigned long long)Walks);
+    free (Addrs);
+    free (Expected);
+    return FALSE;
+  }
+
+  for (Index = 0; Index < Walks; ++Index) {
+    Desc            = &mLayout[Random (mLayoutCount)];
+    Offset          = Random (EFI_PAGES_TO_SIZE (Desc->NumberOfPages));
+    Addrs[Index]    = Desc->VirtualStart + Offset;
+    Expected[Index] = Desc->PhysicalStart + Offset;
+  }
+
+  Start = NanoTime ();
+  for (Index = 0; Index < Walks; ++Index) {
+    if (GetPhysicalAddr (PageTable, Addrs[Index], &Phys) != EFI_SUCCESS || Phys != Expected[Index]) {
+      Stats->WrongWalks++;
+    }
+  }
+  Stats->WalkNs = NanoTime () - Start;
+  Stats->Walks  = Walks;
+
+  free (Addrs);
+  free (Expected);
+
+  return WalkPages (PageTable, Stats);
+}
+
+STATIC
+VOID
+Usage (
+  VOID
+  )
+{
+  fprintf (stderr,
+    "Usage: VMemSim [-l boot|packed|mixed] [-d areas] [-r seed] [-n iterations]\n"
+    "               [-w walks] [-g 0|1 (1 GB pages)] [-m arena MB]\n");
+}
+
+int
+main (
+  int   argc,
+  char  *argv[]
+  )
+{
+  CONST CHAR8  *Layout;
+  UINTN        Areas;
+  UINTN        Iterations;
+  UINT64       Walks;
+  UINT64       Pages;
+  UINT64       Total;
+  SIM_STATS    Stats;
+  UINTN        Index;
+  int          Arg;
+
+  Layout     = "mixed";
+  Areas      = 300;
+  Iterations = 100;
+  Walks      = 1000000;
+  mArenaSize = 256ULL << 20;
+
+  for (Arg = 1; Arg < argc; ++Arg) {
+    if (argv[Arg][0] != '-' || Arg + 1 >= argc) {
+      Usage ();
+      return EXIT_FAILURE;
+    }
+
+    if (strcmp (argv[Arg], "-l") == 0) {
+      Layout = argv[++Arg];
+    } else if (strcmp (argv[Arg], "-d") == 0) {
+      Areas = strtoul (argv[++Arg], NULL, 0);
+    } else if (strcmp (argv[Arg], "-r") == 0) {
+      mRandom = strtoull (argv[++Arg], NULL, 0) | 1;
+    } else if (strcmp (argv[Arg], "-n") == 0) {
+      Iterations = strtoul (argv[++Arg], NULL, 0);
+    } else if (strcmp (argv[Arg], "-w") == 0) {
+      Walks = strtoull (argv[++Arg], NULL, 0);
+    } else if (strcmp (argv[Arg], "-g") == 0) {
+      mPage1Gb = strtoul (argv[++Arg], NULL, 0) != 0;
+    } else if (strcmp (argv[Arg], "-m") == 0) {
+      mArenaSize = strtoull (argv[++Arg], NULL, 0) << 20;
+    } else {
+      Usage ();
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (Areas == 0 || Iterations == 0 || Walks == 0 || mArenaSize == 0 || mArenaSize > BASE_4GB - SIM_ARENA_BASE) {
+    Usage ();
+    return EXIT_FAILURE;
+  }
+
+  if (!GenerateLayout (Layout, Areas)) {
+    return EXIT_FAILURE;
+  }
+
+  mArena = mmap (NULL, mArenaSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (mArena == MAP_FAILED) {
+    fprintf (stderr, "Failed to map %llu bytes for the arena\n", (unsigned long long)mArenaSize);
+    free (mLayout);
+    return EXIT_FAILURE;
+  }
+
+  if (!Simulate (Iterations, Walks, &Stats)) {
+    munmap (mArena, mArenaSize);
+    free (mLayout);
+    return EXIT_FAILURE;
+  }
+
+  Pages = 0;
+  for (Index = 0; Index < mLayoutCount; ++Index) {
+    Pages += mLayout[Index].NumberOfPages;
+  }
+  Total = Stats.Bytes[0] + Stats.Bytes[1] + Stats.Bytes[2];
+
+  printf ("%s layout, %zu areas, %.2f GB mapped, 1 GB pages %s\n", Layout, (size_t)Areas,
+    (double)EFI_PAGES_TO_SIZE (Pages) / (double)BASE_1GB, mPage1Gb ? "on" : "off");
+  printf ("  map time          %.1f us per layout x %zu\n",
+    (double)Stats.MapNs / 1000.0 / (double)Iterations, (size_t)Iterations);
+  printf ("  table pages       %zu used, %zu reserved\n", (size_t)Stats.UsedPages, (size_t)Stats.PoolPages);
+  printf ("  page coverage     1 GB %.1f%%, 2 MB %.1f%%, 4 KB %.1f%%\n",
+    100.0 * (double)Stats.Bytes[0] / (double)Total, 100.0 * (double)Stats.Bytes[1] / (double)Total,
+    100.0 * (double)Stats.Bytes[2] / (double)Total);
+  printf ("  walks             %.2f M/s, %llu of %llu wrong\n",
+    (double)Stats.Walks * 1000.0 / (double)Stats.WalkNs,
+    (unsigned long long)Stats.WrongWalks, (unsigned long long)Stats.Walks);
+  printf ("  page walks        %.2f M/s single, %.2f M/s batched, %llu of %llu wrong\n",
+    (double)Stats.Pages * 1000.0 / (double)Stats.PageNs, (double)Stats.Pages * 1000.0 / (double)Stats.BatchNs,
+    (unsigned long long)Stats.WrongPages, (unsigned long long)Stats.Pages * 2);
+
+  munmap (mArena, mArenaSize);
+  free (mLayout);
+  return (Stats.WrongWalks == 0 && Stats.WrongPages == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}